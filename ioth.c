@@ -20,25 +20,33 @@
 #include <errno.h>
 #include <string.h>
 #include <dlfcn.h>
-#include <limits.h>
-#include <config.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 #include <fduserdata.h>
-#include <checklicense.h>
 #include <ioth.h>
+#include <ioth_nlsock.h>
+#include <ioth_module.h>
 
 static FDUSERDATA *fdtable;
-static __thread void *stackdata;
-static const char *proglicense;
-
-void ioth_set_license(const char *license) {
-	proglicense = license;
-}
-
 #define FOREACHDEFFUN \
 	__MACROFUN(newstack) \
 	__MACROFUN(delstack) \
+	__MACROFUN(fwstats) \
+	FOREACHCTXFUN \
 	FOREACHFUN
+#define FOREACHCTXFUN \
+	__MACROFUN(csocket) \
+	__MACROFUN(caccept) \
+	__MACROFUN(cclose) \
+	__MACROFUN(cbind) \
+	__MACROFUN(cconnect) \
+	__MACROFUN(clisten) \
+	__MACROFUN(crecvfrom) \
+	__MACROFUN(crecvmsg) \
+	__MACROFUN(csendto) \
+	__MACROFUN(csendmsg)
 #define FOREACHFUN \
 	__MACROFUN(socket) \
 	__MACROFUN(close) \
@@ -53,6 +61,8 @@ void ioth_set_license(const char *license) {
 	__MACROFUN(shutdown) \
 	__MACROFUN(ioctl) \
 	__MACROFUN(fcntl) \
+	FOREACHDATAFUN
+#define FOREACHDATAFUN \
 	__MACROFUN(read) \
 	__MACROFUN(readv) \
 	__MACROFUN(recv) \
@@ -64,65 +74,75 @@ void ioth_set_license(const char *license) {
 	__MACROFUN(sendto) \
 	__MACROFUN(sendmsg)
 
+/* data path: the functions of the plugin or adapter thunks,
+ * resolved once at stack creation (see ioth_resolve) */
+struct ioth_datapath {
+	typeof(read) *read;
+	typeof(readv) *readv;
+	typeof(recv) *recv;
+	typeof(ioth_recvfrom) *recvfrom;
+	typeof(recvmsg) *recvmsg;
+	typeof(write) *write;
+	typeof(writev) *writev;
+	typeof(send) *send;
+	typeof(ioth_sendto) *sendto;
+	typeof(sendmsg) *sendmsg;
+};
+
 struct ioth {
 	void *handle;
 	void *stackdata;
 	_Atomic unsigned int count;
+	/* persistent netlink socket (-1 if not open yet) */
+	pthread_mutex_t nlmutex;
+	int nlfd;
+	_Atomic uint32_t nlseq;
+	uint32_t caps;
 	struct ioth_functions f;
+	struct ioth_datapath d;
 };
 
 static struct ioth native_iothstack = {
+	.nlmutex = PTHREAD_MUTEX_INITIALIZER,
+	.nlfd = -1,
+	.caps = IOTH_CAP_KERNELFD | IOTH_CAP_THREADSAFE | IOTH_CAP_MULTISTACK,
 #define __MACROFUN(X) .f.X = X,
 	FOREACHFUN
 #undef __MACROFUN
+#define __MACROFUN(X) .d.X = X,
+	FOREACHDATAFUN
+#undef __MACROFUN
 };
 
 static struct ioth *default_iothstack = &native_iothstack;
 
+/* fduserdata of each file descriptor */
+struct ioth_fd {
+	struct ioth *stack;
+	void *cookie; // private pointer of the plugin (csocket/caccept)
+};
+
+/* the stack (its stackdata and the cookie) of the current call of this thread:
+ * getstackdata and the thunks of the data path use it.
+ * getstackdata uses the copy of stackdata: the stack of the last call
+ * may have been deleted */
+static __thread struct {
+	struct ioth *stack;
+	void *stackdata;
+	void *cookie;
+} current;
+
+static inline void setcurrent(struct ioth *stack, void *cookie) {
+	current.stack = stack;
+	current.stackdata = stack->stackdata;
+	current.cookie = cookie;
+}
+
 static void *getstackdata(void) {
-	return stackdata;
+	return current.stackdata;
 }
 
 #define SYMBOL_PREFIX "ioth_"
-#ifndef USER_IOTH_PATH
-#define USER_IOTH_PATH "/.ioth"
-#endif
-/* this whould be defind by cmake in config.h */
-#ifndef SYSTEM_IOTH_PATH
-#define SYSTEM_IOTH_PATH "/usr/local/lib/ioth"
-#endif
-
-static inline char *gethomedir(void) {
-	char *homedir = getenv("HOME");
-	/* If there is no home directory, use CWD */
-	if (!homedir)
-		homedir = ".";
-	return homedir;
-}
-
-static void *ioth_dlopen(const char *modname, int flags) {
-	char path[PATH_MAX];
-	char *homedir = gethomedir();
-
-#define TRY_DLOPEN(LMID, ...) \
-	do { \
-		void *handle; \
-		snprintf(path, PATH_MAX, __VA_ARGS__); \
-		if ((handle = dlmopen(LMID, path, flags))) { \
-			return handle; \
-		} \
-	} while(0)
-	TRY_DLOPEN(LM_ID_BASE, "%s%s/ioth_%s-r.so", homedir, USER_IOTH_PATH, modname);
-	TRY_DLOPEN(LM_ID_NEWLM, "%s%s/ioth_%s.so", homedir, USER_IOTH_PATH, modname);
-	TRY_DLOPEN(LM_ID_BASE, "%s/ioth_%s-r.so", SYSTEM_IOTH_PATH, modname);
-	TRY_DLOPEN(LM_ID_NEWLM, "%s/ioth_%s.so", SYSTEM_IOTH_PATH, modname);
-#ifdef DEBUG
-	TRY_DLOPEN(LM_ID_BASE, "./ioth_%s-r.so", modname);
-	TRY_DLOPEN(LM_ID_NEWLM, "./ioth_%s.so", modname);
-#endif
-#undef TRY_DLOPEN
-	return NULL;
-}
 
 static void *ioth_dlsym(void *handle, const char *modname, const char *symbol) {
 	size_t extended_symbol_len = sizeof(SYMBOL_PREFIX) + 1 + strlen(modname) + strlen(symbol);
@@ -133,6 +153,151 @@ static void *ioth_dlsym(void *handle, const char *modname, const char *symbol) {
 }
 
 
+/* adapter thunks of the data path: when a stack does not provide a function
+ * (e.g. read), the thunk calls the function which implements it (e.g. recv).
+ * The stack is the current stack of the thread (set by ioth_getstack) */
+#define F_RECV(fd, ...) current.stack->f.recv(fd, __VA_ARGS__)
+#define F_RECVFROM(fd, ...) current.stack->f.recvfrom(fd, __VA_ARGS__)
+#define C_RECVFROM(fd, ...) current.stack->f.crecvfrom(current.stackdata, fd, current.cookie, __VA_ARGS__)
+#define F_RECVMSG(fd, ...) current.stack->f.recvmsg(fd, __VA_ARGS__)
+#define C_RECVMSG(fd, ...) current.stack->f.crecvmsg(current.stackdata, fd, current.cookie, __VA_ARGS__)
+#define F_SEND(fd, ...) current.stack->f.send(fd, __VA_ARGS__)
+#define F_SENDTO(fd, ...) current.stack->f.sendto(fd, __VA_ARGS__)
+#define C_SENDTO(fd, ...) current.stack->f.csendto(current.stackdata, fd, current.cookie, __VA_ARGS__)
+#define F_SENDMSG(fd, ...) current.stack->f.sendmsg(fd, __VA_ARGS__)
+#define C_SENDMSG(fd, ...) current.stack->f.csendmsg(current.stackdata, fd, current.cookie, __VA_ARGS__)
+
+/* read and recv by a recvfrom-like function */
+#define RECVFROM_THUNKS(name, CALL) \
+	static ssize_t read_ ## name(int fd, void *buf, size_t len) { \
+		return CALL(fd, buf, len, 0, NULL, NULL); \
+	} \
+	static ssize_t recv_ ## name(int fd, void *buf, size_t len, int flags) { \
+		return CALL(fd, buf, len, flags, NULL, NULL); \
+	}
+
+/* read, readv, recv and recvfrom by a recvmsg-like function */
+#define RECVMSG_THUNKS(name, CALL) \
+	static ssize_t recvfrom_ ## name(int fd, void *buf, size_t len, int flags, \
+			struct sockaddr *from, socklen_t *fromlen) { \
+		struct iovec iov[] = {{buf, len}}; \
+		struct msghdr mhdr = { \
+			.msg_name = from, \
+			.msg_namelen = (fromlen) ? *fromlen : 0, \
+			.msg_iov = iov, \
+			.msg_iovlen = 1}; \
+		ssize_t retval = CALL(fd, &mhdr, flags); \
+		if (retval >= 0 && fromlen) *fromlen = mhdr.msg_namelen; \
+		return retval; \
+	} \
+	static ssize_t read_ ## name(int fd, void *buf, size_t len) { \
+		return recvfrom_ ## name(fd, buf, len, 0, NULL, NULL); \
+	} \
+	static ssize_t recv_ ## name(int fd, void *buf, size_t len, int flags) { \
+		return recvfrom_ ## name(fd, buf, len, flags, NULL, NULL); \
+	} \
+	static ssize_t readv_ ## name(int fd, const struct iovec *iov, int iovcnt) { \
+		struct msghdr mhdr = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt }; \
+		return CALL(fd, &mhdr, 0); \
+	}
+
+/* write and send by a sendto-like function */
+#define SENDTO_THUNKS(name, CALL) \
+	static ssize_t write_ ## name(int fd, const void *buf, size_t len) { \
+		return CALL(fd, buf, len, 0, NULL, 0); \
+	} \
+	static ssize_t send_ ## name(int fd, const void *buf, size_t len, int flags) { \
+		return CALL(fd, buf, len, flags, NULL, 0); \
+	}
+
+/* write, writev, send and sendto by a sendmsg-like function */
+#define SENDMSG_THUNKS(name, CALL) \
+	static ssize_t sendto_ ## name(int fd, const void *buf, size_t len, int flags, \
+			const struct sockaddr *to, socklen_t tolen) { \
+		struct iovec iov[] = {{(void *)buf, (size_t)len}}; \
+		struct msghdr mhdr = { \
+			.msg_name = (struct sockaddr *) to, \
+			.msg_namelen = tolen, \
+			.msg_iov = iov, \
+			.msg_iovlen = 1}; \
+		return CALL(fd, &mhdr, flags); \
+	} \
+	static ssize_t write_ ## name(int fd, const void *buf, size_t len) { \
+		return sendto_ ## name(fd, buf, len, 0, NULL, 0); \
+	} \
+	static ssize_t send_ ## name(int fd, const void *buf, size_t len, int flags) { \
+		return sendto_ ## name(fd, buf, len, flags, NULL, 0); \
+	} \
+	static ssize_t writev_ ## name(int fd, const struct iovec *iov, int iovcnt) { \
+		struct msghdr mhdr = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt }; \
+		return CALL(fd, &mhdr, 0); \
+	}
+
+RECVFROM_THUNKS(recvfrom, F_RECVFROM)
+RECVFROM_THUNKS(crecvfrom, C_RECVFROM)
+RECVMSG_THUNKS(recvmsg, F_RECVMSG)
+RECVMSG_THUNKS(crecvmsg, C_RECVMSG)
+SENDTO_THUNKS(sendto, F_SENDTO)
+SENDTO_THUNKS(csendto, C_SENDTO)
+SENDMSG_THUNKS(sendmsg, F_SENDMSG)
+SENDMSG_THUNKS(csendmsg, C_SENDMSG)
+
+static ssize_t read_recv(int fd, void *buf, size_t len) {
+	return F_RECV(fd, buf, len, 0);
+}
+
+static ssize_t recvfrom_crecvfrom(int fd, void *buf, size_t len, int flags,
+		struct sockaddr *from, socklen_t *fromlen) {
+	return C_RECVFROM(fd, buf, len, flags, from, fromlen);
+}
+
+static ssize_t recvmsg_crecvmsg(int fd, struct msghdr *msg, int flags) {
+	return C_RECVMSG(fd, msg, flags);
+}
+
+static ssize_t write_send(int fd, const void *buf, size_t len) {
+	return F_SEND(fd, buf, len, 0);
+}
+
+static ssize_t sendto_csendto(int fd, const void *buf, size_t len, int flags,
+		const struct sockaddr *to, socklen_t tolen) {
+	return C_SENDTO(fd, buf, len, flags, to, tolen);
+}
+
+static ssize_t sendmsg_csendmsg(int fd, const struct msghdr *msg, int flags) {
+	return C_SENDMSG(fd, msg, flags);
+}
+
+/* fill the data path: the function of the stack if it exists, otherwise a thunk
+ * (NULL if the stack cannot provide the function).
+ * The context-taking functions are preferred */
+static void ioth_resolve(struct ioth *iothstack) {
+	struct ioth_functions *f = &iothstack->f;
+	struct ioth_datapath *d = &iothstack->d;
+	d->recvmsg = f->crecvmsg ? recvmsg_crecvmsg : f->recvmsg;
+	d->readv = f->crecvmsg ? readv_crecvmsg : f->readv ? f->readv :
+		f->recvmsg ? readv_recvmsg : NULL;
+	d->recvfrom = f->crecvfrom ? recvfrom_crecvfrom : f->recvfrom ? f->recvfrom :
+		f->crecvmsg ? recvfrom_crecvmsg : f->recvmsg ? recvfrom_recvmsg : NULL;
+	d->recv = f->crecvfrom ? recv_crecvfrom : f->recv ? f->recv :
+		f->recvfrom ? recv_recvfrom : f->crecvmsg ? recv_crecvmsg :
+		f->recvmsg ? recv_recvmsg : NULL;
+	d->read = f->crecvfrom ? read_crecvfrom : f->read ? f->read :
+		f->recv ? read_recv : f->recvfrom ? read_recvfrom :
+		f->crecvmsg ? read_crecvmsg : f->recvmsg ? read_recvmsg : NULL;
+	d->sendmsg = f->csendmsg ? sendmsg_csendmsg : f->sendmsg;
+	d->writev = f->csendmsg ? writev_csendmsg : f->writev ? f->writev :
+		f->sendmsg ? writev_sendmsg : NULL;
+	d->sendto = f->csendto ? sendto_csendto : f->sendto ? f->sendto :
+		f->csendmsg ? sendto_csendmsg : f->sendmsg ? sendto_sendmsg : NULL;
+	d->send = f->csendto ? send_csendto : f->send ? f->send :
+		f->sendto ? send_sendto : f->csendmsg ? send_csendmsg :
+		f->sendmsg ? send_sendmsg : NULL;
+	d->write = f->csendto ? write_csendto : f->write ? f->write :
+		f->send ? write_send : f->sendto ? write_sendto :
+		f->csendmsg ? write_csendmsg : f->sendmsg ? write_sendmsg : NULL;
+}
+
 #define gotoerr(err, label) do {errno = err; goto label;} while(0)
 
 static struct ioth *_ioth_newstackv(const char *stack, const char *options, const char *vnlv[]) {
@@ -142,30 +307,51 @@ static struct ioth *_ioth_newstackv(const char *stack, const char *options, cons
 	if (stack == NULL || *stack == '\0') {
 		*iothstack = native_iothstack;
 		iothstack->count = 0;
+		iothstack->nlseq = 0;
 	} else {
 		char **pstacklicense = NULL;
-		char *stacklicense = NULL;
-		iothstack->handle = ioth_dlopen(stack, RTLD_NOW);
+		const char *stacklicense = NULL;
+		struct ioth_ops *ops;
+		iothstack->handle = ioth_module_open(stack, RTLD_NOW);
 		// printf("dlopen %p\n", iothstack->handle);
+		/* EPERM: the license in the note of the plugin has been rejected */
 		if (iothstack->handle == NULL)
-			gotoerr (ENOTSUP, errdl);
-		iothstack->f.getstackdata = getstackdata;
-		pstacklicense = ioth_dlsym(iothstack->handle, stack, "license");
-		if (pstacklicense != NULL) stacklicense = *pstacklicense;
-		if (checklicense(proglicense, stacklicense) != 1)
+			gotoerr (errno == EPERM ? EPERM : ENOTSUP, errdl);
+		/* ABI v2: one descriptor, otherwise one symbol per function */
+		ops = ioth_dlsym(iothstack->handle, stack, "ops");
+		if (ops != NULL) {
+			if (ops->version != IOTH_OPS_VERSION)
+				gotoerr (ENOTSUP, errnoioth);
+			stacklicense = ops->license;
+		} else {
+			pstacklicense = ioth_dlsym(iothstack->handle, stack, "license");
+			if (pstacklicense != NULL) stacklicense = *pstacklicense;
+		}
+		if (ioth_module_checklicense(stacklicense) != 1)
 			gotoerr (EPERM, errnoioth);
+		if (ops != NULL) {
+			/* the table of an older plugin can be shorter: the other functions are NULL */
+			memcpy(&iothstack->f, &ops->f,
+					ops->fsize < sizeof(iothstack->f) ? ops->fsize : sizeof(iothstack->f));
+			iothstack->caps = ops->caps;
+		} else {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpedantic"
 #define __MACROFUN(X) iothstack->f.X = ioth_dlsym(iothstack->handle, stack, #X);
-		{ FOREACHDEFFUN }
+			{ FOREACHDEFFUN }
 #undef __MACROFUN
 #pragma GCC diagnostic pop
+		}
+		iothstack->f.getstackdata = getstackdata;
 		if (iothstack->f.newstack == NULL)
 			gotoerr (ENOENT, errnoioth);
 		iothstack->stackdata = iothstack->f.newstack(vnlv, options, &iothstack->f);
 		if (iothstack->stackdata == NULL)
 			goto errnoioth;
 	}
+	ioth_resolve(iothstack);
+	pthread_mutex_init(&iothstack->nlmutex, NULL);
+	iothstack->nlfd = -1;
 	return iothstack;
 errnoioth:
 	dlclose(iothstack->handle);
@@ -223,8 +409,13 @@ int ioth_delstack(struct ioth *iothstack) {
 	int retval;
 	if (iothstack == NULL)
 		return errno = EINVAL, -1;
-	if (iothstack->count > 0)
+	/* the persistent netlink socket does not keep the stack busy */
+	if (iothstack->count > (iothstack->nlfd >= 0 ? 1 : 0))
 		return errno = EBUSY, -1;
+	if (iothstack->nlfd >= 0) {
+		ioth_close(iothstack->nlfd);
+		iothstack->nlfd = -1;
+	}
 	if (iothstack->f.delstack == NULL)
 		retval = 0;
 	else
@@ -232,6 +423,7 @@ int ioth_delstack(struct ioth *iothstack) {
 	if (retval == 0) {
 		if (iothstack->handle != NULL)
 			dlclose(iothstack->handle);
+		pthread_mutex_destroy(&iothstack->nlmutex);
 		free(iothstack);
 	}
 	return retval;
@@ -248,21 +440,42 @@ struct ioth *ioth_get_defstack(void) {
 	return default_iothstack;
 }
 
+int ioth_fwstats(struct ioth *iothstack, struct ioth_fwstats *stats, int nstats) {
+	if (iothstack == NULL)
+		iothstack = default_iothstack;
+	if (iothstack->f.fwstats == NULL)
+		return errno = ENOSYS, -1;
+	return iothstack->f.fwstats(iothstack->stackdata, stats, nstats);
+}
+
+int ioth_getcaps(struct ioth *iothstack) {
+	if (iothstack == NULL)
+		iothstack = default_iothstack;
+	return iothstack->caps;
+}
+
 int ioth_msocket(struct ioth *iothstack, int domain, int type, int protocol) {
 	int fd;
 	if (iothstack == NULL)
 		iothstack = default_iothstack;
+	void *cookie = NULL;
 	iothstack->count++;
-	stackdata = iothstack->stackdata;
-	if (iothstack->f.socket == NULL)
+	setcurrent(iothstack, NULL);
+	if (iothstack->f.csocket != NULL)
+		fd = iothstack->f.csocket(iothstack->stackdata, domain, type, protocol, &cookie);
+	else if (iothstack->f.socket != NULL)
+		fd = iothstack->f.socket(domain, type, protocol);
+	else {
+		iothstack->count--;
 		return errno = ENOSYS, -1;
-	fd = iothstack->f.socket(domain, type, protocol);
+	}
 	if (fd < 0)
 		iothstack->count--;
 	else {
-		struct ioth **ioth = fduserdata_new(fdtable, fd, struct ioth *);
-		*ioth = iothstack;
-		fduserdata_put(ioth);
+		struct ioth_fd *iothfd = fduserdata_new(fdtable, fd, struct ioth_fd);
+		iothfd->stack = iothstack;
+		iothfd->cookie = cookie;
+		fduserdata_put(iothfd);
 	}
 	return fd;
 }
@@ -271,234 +484,210 @@ int ioth_socket(int domain, int type, int protocol) {
 	return ioth_msocket(NULL, domain, type, protocol);
 }
 
-/* get the ioth stack from fduserdata */
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+
+static int nlsock_open(struct ioth *iothstack) {
+	struct sockaddr_nl sanl = {AF_NETLINK, 0, 0, 0};
+	int one = 1;
+	int fd = ioth_msocket(iothstack, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+	if (ioth_bind(fd, (struct sockaddr *) &sanl, sizeof(struct sockaddr_nl)) < 0) {
+		ioth_close(fd);
+		return -1;
+	}
+	/* optional features: error acks without the request, dumps filtered by the kernel */
+	ioth_setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	ioth_setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one, sizeof(one));
+	return fd;
+}
+
+uint32_t ioth_nlsock_seq(struct ioth *iothstack, uint32_t nseq) {
+	if (iothstack == NULL)
+		iothstack = default_iothstack;
+	return (iothstack->nlseq += nseq) - nseq;
+}
+
+int ioth_nlsock_get(struct ioth *iothstack, uint32_t nseq, uint32_t *seq) {
+	if (iothstack == NULL)
+		iothstack = default_iothstack;
+	*seq = ioth_nlsock_seq(iothstack, nseq);
+	/* busy (concurrent or nested transaction): use a temporary socket */
+	if (pthread_mutex_trylock(&iothstack->nlmutex) != 0)
+		return nlsock_open(iothstack);
+	if (iothstack->nlfd < 0 && (iothstack->nlfd = nlsock_open(iothstack)) < 0) {
+		pthread_mutex_unlock(&iothstack->nlmutex);
+		return -1;
+	}
+	return iothstack->nlfd;
+}
+
+void ioth_nlsock_put(struct ioth *iothstack, int fd, int reset) {
+	int errno_save = errno;
+	if (iothstack == NULL)
+		iothstack = default_iothstack;
+	if (fd < 0)
+		return;
+	if (fd != iothstack->nlfd)
+		ioth_close(fd);
+	else {
+		if (reset) {
+			ioth_close(fd);
+			iothstack->nlfd = -1;
+		}
+		pthread_mutex_unlock(&iothstack->nlmutex);
+	}
+	errno = errno_save;
+}
+
+/* get the ioth stack from fduserdata, it becomes the current stack
+ * (and its cookie the current cookie) of the thread */
 static inline struct ioth *ioth_getstack(int fd) {
-	struct ioth **ioth = fduserdata_get(fdtable, fd);
-	if (ioth == NULL)
+	struct ioth_fd *iothfd = fduserdata_get(fdtable, fd);
+	if (iothfd == NULL)
 		return NULL;
-	struct ioth *iothstack = *ioth;
-	fduserdata_put(ioth);
-	stackdata = iothstack->stackdata;
-	return iothstack;
+	setcurrent(iothfd->stack, iothfd->cookie);
+	fduserdata_put(iothfd);
+	return current.stack;
 }
 
 /* get the ioth stack from fduserdata assign it to "iothstack"
- * and check if fun exists */
+ * and check if fun (or its context-taking version cfun) exists */
 #define IOTH_getiothstack_ck(fd, fun) \
 	struct ioth *iothstack = ioth_getstack(fd); \
 	if (iothstack == NULL) \
 	return errno = EBADF, -1; \
-	if (iothstack->f.fun == NULL) \
+	if (iothstack->f.fun == NULL && iothstack->f.c ## fun == NULL) \
 	return errno = ENOSYS, -1
 
 /* get the ioth stack from fduserdata assign it to "iothstack"
- * do not check if fun exists and call _ioth_xxx where xxx is fun stringified.
- * e.g. "IOTH_stackfun(fd, read)" calls _ioth_read.
+ * and call the data path function fun (see ioth_resolve): a single indirect call.
  * This maxro has been designed as a prefix to the arguments of the called function */
-#define IOTH_stackfun(fd, fun) \
+#define IOTH_datafun(fd, fun) \
 	struct ioth *iothstack = ioth_getstack(fd); \
 	if (iothstack == NULL) \
 	return errno = EBADF, -1; \
-	return _ioth_ ## fun
+	if (iothstack->d.fun == NULL) \
+	return errno = ENOSYS, -1; \
+	return iothstack->d.fun
+
+/* as IOTH_fwfun, the context-taking version of fun (cfun) is preferred (if defined).
+ * The arguments (except fd) follow fun */
+#define IOTH_ctxfun(fd, fun, ...) \
+	IOTH_getiothstack_ck(fd, fun); \
+	if (iothstack->f.c ## fun != NULL) \
+	return iothstack->f.c ## fun(iothstack->stackdata, fd, current.cookie, __VA_ARGS__); \
+	return iothstack->f.fun(fd, __VA_ARGS__)
 
 /* get the ioth stack from fduserdata assign it to "iothstack"
  * check if fun exists and call the implementation of fun provided by the stack.
  * This maxro has been designed as a prefix to the arguments of the called function */
 #define IOTH_fwfun(fd, fun) \
-	IOTH_getiothstack_ck(fd, fun); \
+	struct ioth *iothstack = ioth_getstack(fd); \
+	if (iothstack == NULL) \
+	return errno = EBADF, -1; \
+	if (iothstack->f.fun == NULL) \
+	return errno = ENOSYS, -1; \
 	return iothstack->f.fun
 
 int ioth_close(int fd) {
 	int retval;
-	struct ioth **ioth = fduserdata_get(fdtable, fd);
-	if (ioth == NULL)
+	struct ioth_fd *iothfd = fduserdata_get(fdtable, fd);
+	if (iothfd == NULL)
 		return errno = ENOSYS, -1;
-	struct ioth *iothstack = *ioth;
-	if (iothstack->f.close == NULL)
+	struct ioth *iothstack = iothfd->stack;
+	if (iothstack->f.cclose != NULL)
+		retval = iothstack->f.cclose(iothstack->stackdata, fd, iothfd->cookie);
+	else if (iothstack->f.close != NULL) {
+		setcurrent(iothstack, iothfd->cookie);
+		retval = iothstack->f.close(fd);
+	} else {
+		fduserdata_put(iothfd);
 		return errno = ENOSYS, -1;
-	retval = iothstack->f.close(fd);
+	}
 	if (retval == 0) {
 		iothstack->count--;
-		fduserdata_del(ioth);
+		fduserdata_del(iothfd);
 	} else
-		fduserdata_put(ioth);
+		fduserdata_put(iothfd);
 	return retval;
 }
 
 int ioth_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
 	int newfd;
+	void *newcookie = NULL;
 	IOTH_getiothstack_ck(fd, accept);
-	newfd = iothstack->f.accept(fd, addr, addrlen);
+	if (iothstack->f.caccept != NULL)
+		newfd = iothstack->f.caccept(iothstack->stackdata, fd, current.cookie, addr, addrlen, &newcookie);
+	else
+		newfd = iothstack->f.accept(fd, addr, addrlen);
 	if (newfd >= 0) {
-		struct ioth **ioth = fduserdata_new(fdtable, newfd, struct ioth *);
-		*ioth = iothstack;
+		struct ioth_fd *iothfd = fduserdata_new(fdtable, newfd, struct ioth_fd);
+		iothfd->stack = iothstack;
+		iothfd->cookie = newcookie;
 		iothstack->count++;
-		fduserdata_put(ioth);
+		fduserdata_put(iothfd);
 	}
 	return newfd;
 }
 
-static ssize_t _ioth_read(struct ioth *iothstack, int fd, void *buf, size_t len);
-static ssize_t _ioth_readv(struct ioth *iothstack, int fd, const struct iovec *iov, int iovcnt);
-static ssize_t _ioth_recv(struct ioth *iothstack, int fd, void *buf, size_t len, int flags);
-static ssize_t _ioth_recvfrom(struct ioth *iothstack, int fd, void *buf, size_t len, int flags,
-		struct sockaddr *from, socklen_t *fromlen);
-static ssize_t _ioth_recvmsg(struct ioth *iothstack, int fd, struct msghdr *msg, int flags);
-static ssize_t _ioth_write(struct ioth *iothstack, int fd, const void *buf, size_t size);
-static ssize_t _ioth_writev(struct ioth *iothstack, int fd, const struct iovec *iov, int iovcnt);
-static ssize_t _ioth_send(struct ioth *iothstack, int fd, const void *buf, size_t size, int flags);
-static ssize_t _ioth_sendto(struct ioth *iothstack, int fd, const void *buf, size_t size, int flags,
-		const struct sockaddr *to, socklen_t tolen);
-static ssize_t _ioth_sendmsg(struct ioth *iothstack, int fd, const struct msghdr *msg, int flags);
-
-static ssize_t _ioth_read(struct ioth *iothstack, int fd, void *buf, size_t len) {
-	if (iothstack->f.read)
-		return iothstack->f.read(fd, buf, len);
-	else
-		return _ioth_recv(iothstack, fd, buf, len, 0);
-}
-
-static ssize_t _ioth_readv(struct ioth *iothstack, int fd, const struct iovec *iov, int iovcnt) {
-	if (iothstack->f.readv)
-		return iothstack->f.readv(fd, iov, iovcnt);
-	else if (iothstack->f.recvmsg) {
-		struct msghdr mhdr = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt };
-		return iothstack->f.recvmsg(fd, &mhdr, 0);
-	} else // map to read
-		return errno = ENOSYS, -1;
-}
-
-static ssize_t _ioth_recv(struct ioth *iothstack, int fd, void *buf, size_t len, int flags) {
-	if (iothstack->f.recv)
-		return iothstack->f.recv(fd, buf, len, flags);
-	else
-		return _ioth_recvfrom(iothstack, fd, buf, len, flags, NULL, NULL);
-}
-
-static ssize_t _ioth_recvfrom(struct ioth *iothstack, int fd, void *buf, size_t len, int flags,
-		struct sockaddr *from, socklen_t *fromlen) {
-	if (iothstack->f.recvfrom)
-		return iothstack->f.recvfrom( fd, buf, len, flags, from, fromlen);
-	else if (iothstack->f.recvmsg) {
-		struct iovec iov[] = {{buf, len}};
-		struct msghdr mhdr = {
-			.msg_name = from,
-			.msg_namelen = (fromlen) ? *fromlen : 0,
-			.msg_iov = iov,
-			.msg_iovlen = 1};
-		ssize_t retval = iothstack->f.recvmsg(fd, &mhdr, flags);
-		if (retval >= 0 && fromlen) *fromlen = mhdr.msg_namelen;
-		return retval;
-	} else
-		return errno = ENOSYS, -1;
-}
-
-static ssize_t _ioth_recvmsg(struct ioth *iothstack, int fd, struct msghdr *msg, int flags) {
-	if (iothstack->f.recvmsg) {
-		return iothstack->f.recvmsg(fd, msg, flags);
-	} else
-		return errno = ENOSYS, -1;
-}
-
-static ssize_t _ioth_write(struct ioth *iothstack, int fd, const void *buf, size_t len) {
-	if (iothstack->f.write)
-		return iothstack->f.write(fd, buf, len);
-	else
-		return _ioth_send(iothstack, fd, buf, len, 0);
-}
-
-static ssize_t _ioth_writev(struct ioth *iothstack, int fd, const struct iovec *iov, int iovcnt) {
-	if (iothstack->f.writev)
-		return iothstack->f.writev(fd, iov, iovcnt);
-	else if (iothstack->f.sendmsg) {
-		struct msghdr mhdr = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt };
-		return iothstack->f.sendmsg(fd, &mhdr, 0);
-	} else // map to write
-		return errno = ENOSYS, -1;
-}
-
-static ssize_t _ioth_send(struct ioth *iothstack, int fd, const void *buf, size_t len, int flags) {
-	if (iothstack->f.send)
-		return iothstack->f.send(fd, buf, len, flags);
-	else
-		return _ioth_sendto(iothstack, fd, buf, len, flags, NULL, 0);
-}
-
-static ssize_t _ioth_sendto(struct ioth *iothstack, int fd, const void *buf, size_t len, int flags,
-		const struct sockaddr *to, socklen_t tolen) {
-	if (iothstack->f.sendto)
-		return iothstack->f.sendto( fd, buf, len, flags, to, tolen);
-	else if (iothstack->f.sendmsg) {
-		struct iovec iov[] = {{(void *)buf, (size_t)len}};
-		struct msghdr mhdr = {
-			.msg_name = (struct sockaddr *) to,
-			.msg_namelen = tolen,
-			.msg_iov = iov,
-			.msg_iovlen = 1};
-		return iothstack->f.sendmsg(fd, &mhdr, flags);
-	} else
-		return errno = ENOSYS, -1;
-}
-
-static ssize_t _ioth_sendmsg(struct ioth *iothstack, int fd, const struct msghdr *msg, int flags) {
-	if (iothstack->f.sendmsg) {
-		return iothstack->f.sendmsg(fd, msg, flags);
-	} else
-		return errno = ENOSYS, -1;
-}
-
 ssize_t ioth_read(int fd, void *buf, size_t len) {
-	IOTH_stackfun(fd, read) (iothstack, fd, buf, len);
+	IOTH_datafun(fd, read) (fd, buf, len);
 }
 
 ssize_t ioth_readv(int fd, const struct iovec *iov, int iovcnt) {
-	IOTH_stackfun(fd, readv) (iothstack, fd, iov, iovcnt);
+	IOTH_datafun(fd, readv) (fd, iov, iovcnt);
 }
 
 ssize_t ioth_recv(int fd, void *buf, size_t len, int flags) {
-	IOTH_stackfun(fd, recv) (iothstack, fd, buf, len, flags);
+	IOTH_datafun(fd, recv) (fd, buf, len, flags);
 }
 
 ssize_t ioth_recvfrom(int fd, void *buf, size_t len, int flags,
 		struct sockaddr *from, socklen_t *fromlen) {
-	IOTH_stackfun(fd, recvfrom) (iothstack, fd, buf, len, flags, from, fromlen);
+	IOTH_datafun(fd, recvfrom) (fd, buf, len, flags, from, fromlen);
 }
 
 ssize_t ioth_recvmsg(int fd, struct msghdr *msg, int flags) {
-	IOTH_stackfun(fd, recvmsg) (iothstack, fd, msg, flags);
+	IOTH_datafun(fd, recvmsg) (fd, msg, flags);
 }
 
 ssize_t ioth_write(int fd, const void *buf, size_t len) {
-	IOTH_stackfun(fd, write) (iothstack, fd, buf, len);
+	IOTH_datafun(fd, write) (fd, buf, len);
 }
 
 ssize_t ioth_writev(int fd, const struct iovec *iov, int iovcnt) {
-	IOTH_stackfun(fd, writev) (iothstack, fd, iov, iovcnt);
+	IOTH_datafun(fd, writev) (fd, iov, iovcnt);
 }
 
 ssize_t ioth_send(int fd, const void *buf, size_t len, int flags) {
-	IOTH_stackfun(fd, send) (iothstack, fd, buf, len, flags);
+	IOTH_datafun(fd, send) (fd, buf, len, flags);
 }
 
 ssize_t ioth_sendto(int fd, const void *buf, size_t len, int flags,
 		const struct sockaddr *to, socklen_t tolen) {
-	IOTH_stackfun(fd, sendto) (iothstack, fd, buf, len, flags, to, tolen);
+	IOTH_datafun(fd, sendto) (fd, buf, len, flags, to, tolen);
 }
 
 ssize_t ioth_sendmsg(int fd, const struct msghdr *msg, int flags) {
-	IOTH_stackfun(fd, sendmsg) (iothstack, fd, msg, flags);
+	IOTH_datafun(fd, sendmsg) (fd, msg, flags);
 }
 
 int ioth_bind(int fd, const struct sockaddr *addr, socklen_t addrlen) {
-	IOTH_fwfun(fd, bind) (fd, addr, addrlen);
+	IOTH_ctxfun(fd, bind, addr, addrlen);
 }
 
 int ioth_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
-	IOTH_fwfun(fd, connect) (fd, addr, addrlen);
+	IOTH_ctxfun(fd, connect, addr, addrlen);
 }
 
 int ioth_listen(int fd, int backlog) {
-	IOTH_fwfun(fd, listen) (fd, backlog);
+	IOTH_ctxfun(fd, listen, backlog);
 }
 
 int ioth_getsockname(int fd, struct sockaddr *addr, socklen_t *addrlen) {
@@ -1,6 +1,7 @@
 #ifndef LIBIOTH_H
 #define LIBIOTH_H
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/uio.h>
@@ -24,6 +25,10 @@ struct ioth *ioth_newstackl(const char *stack, const char *vnl, ... /* (char  *)
 struct ioth *ioth_newstackv(const char *stack, const char *vnlv[]);
 int ioth_delstack(struct ioth *iothstack);
 
+/* load the plugin of a stack in advance (and scan the plugin directories,
+	 if stack == NULL this is the only action) */
+int ioth_preload(const char *stack);
+
 void ioth_set_defstack(struct ioth *iothstack);
 struct ioth *ioth_get_defstack(void);
 
@@ -61,6 +66,88 @@ NLINLINE_LIBMULTI(ioth_)
 	int ioth_getifaddrs(struct ioth *stack, struct ifaddrs **ifap);
 	void ioth_freeifaddrs(struct ifaddrs *ifa);
 
+/* ioth_getifaddrs for the interface ifindex (all the interfaces if ifindex == 0).
+	 mask selects the elements: interfaces (AF_PACKET) and/or addresses (AF_INET, AF_INET6) */
+#define IOTH_IFADDRS_PACKET 0x1
+#define IOTH_IFADDRS_INET 0x2
+#define IOTH_IFADDRS_INET6 0x4
+#define IOTH_IFADDRS_ALL (IOTH_IFADDRS_PACKET | IOTH_IFADDRS_INET | IOTH_IFADDRS_INET6)
+int ioth_getifaddrs_filter(struct ioth *stack, int ifindex, int mask, struct ifaddrs **ifap);
+
+/* walk the interfaces (AF_PACKET) and addresses (AF_INET/AF_INET6) of a stack
+	 without building a list: cb is called for each element (valid during the call only),
+	 a non-zero return value of cb stops the walk and is returned by ioth_walkifaddrs.
+	 family: AF_UNSPEC (all), AF_PACKET, AF_INET or AF_INET6 */
+typedef int ioth_walkifaddrs_cb(const struct ifaddrs *ifa, void *arg);
+int ioth_walkifaddrs(struct ioth *stack, int family, ioth_walkifaddrs_cb *cb, void *arg);
+
+/* interface/address cache of a stack, kept up to date by netlink notifications.
+	 ioth_ifcache_getifaddrs returns the current snapshot (release it by ioth_freeifaddrs)
+	 and its version, the version changes at each update */
+struct ioth_ifcache;
+struct ioth_ifcache *ioth_ifcache_create(struct ioth *stack);
+int ioth_ifcache_getifaddrs(struct ioth_ifcache *cache, struct ifaddrs **ifap, uint64_t *version);
+uint64_t ioth_ifcache_version(struct ioth_ifcache *cache);
+int ioth_ifcache_destroy(struct ioth_ifcache *cache);
+
+/* interface counters (IFLA_STATS64, see linux/if_link.h) sampled through the
+	 netlink socket of the stack: stats[i] gets the counters of ifindex[i] */
+struct rtnl_link_stats64;
+struct ioth_linkstats;
+struct ioth_linkstats *ioth_linkstats_open(struct ioth *stack);
+int ioth_linkstats_sample(struct ioth_linkstats *ls, const int *ifindex,
+		struct rtnl_link_stats64 *stats, int n);
+int ioth_linkstats_close(struct ioth_linkstats *ls);
+
+/* batches of netlink configuration requests: each ioth_nlbatch_* call queues a request
+	 and returns its index, ioth_nlbatch_commit sends them all (packed in few datagrams),
+	 errors[index] gets the result of each request (0 or errno).
+	 ioth_nlbatch_commit returns the number of failed requests, -1 in case of error */
+struct ioth_nlbatch;
+struct ioth_nlbatch *ioth_nlbatch_new(struct ioth *stack);
+int ioth_nlbatch_linksetupdown(struct ioth_nlbatch *batch, unsigned int ifindex, int updown);
+int ioth_nlbatch_iplink_del(struct ioth_nlbatch *batch, const char *ifname, unsigned int ifindex);
+int ioth_nlbatch_ipaddr_add(struct ioth_nlbatch *batch,
+		int family, void *addr, int prefixlen, unsigned int ifindex);
+int ioth_nlbatch_ipaddr_del(struct ioth_nlbatch *batch,
+		int family, void *addr, int prefixlen, unsigned int ifindex);
+int ioth_nlbatch_iproute_add(struct ioth_nlbatch *batch, int family,
+		void *dst_addr, int dst_prefixlen, void *gw_addr, unsigned int ifindex);
+int ioth_nlbatch_iproute_del(struct ioth_nlbatch *batch, int family,
+		void *dst_addr, int dst_prefixlen, void *gw_addr, unsigned int ifindex);
+int ioth_nlbatch_commit(struct ioth_nlbatch *batch, int *errors);
+void ioth_nlbatch_free(struct ioth_nlbatch *batch);
+
+/* forwarder statistics of the virtual interfaces (e.g. vdestack).
+	 rx: from the network to the stack, tx: from the stack to the network.
+	 drops: frames lost (send/write errors, runts), short: partial writes,
+	 batches: forwarder wakeups which moved frames, maxbatch: max frames per wakeup,
+	 overflows: frames dropped by the forwarder queue (see the drop policy of the stack) */
+struct ioth_fwstats {
+	uint64_t rx_frames;
+	uint64_t rx_bytes;
+	uint64_t rx_drops;
+	uint64_t rx_short;
+	uint64_t rx_batches;
+	uint64_t rx_maxbatch;
+	uint64_t tx_frames;
+	uint64_t tx_bytes;
+	uint64_t tx_drops;
+	uint64_t tx_short;
+	uint64_t tx_batches;
+	uint64_t tx_maxbatch;
+	uint64_t rx_overflows;
+	uint64_t tx_overflows;
+};
+
+/* copy the stats of the first nstats interfaces (in vnl order),
+	 return the number of interfaces of the stack */
+int ioth_fwstats(struct ioth *iothstack, struct ioth_fwstats *stats, int nstats);
+
+/* capability flags of the stack (IOTH_CAP_*, see struct ioth_ops),
+	 0 for plugins using the legacy ABI */
+int ioth_getcaps(struct ioth *iothstack);
+
 	/* ----------------------------------- for ioth plugins */
 
 	struct ioth_functions;
@@ -68,6 +155,24 @@ NLINLINE_LIBMULTI(ioth_)
 			struct ioth_functions *ioth_f);
 int delstack_prototype(void *stackdata);
 void *getstackdata_prototype(void);
+int fwstats_prototype(void *stackdata, struct ioth_fwstats *stats, int nstats);
+/* context-taking entry points (optional): stackdata is the pointer returned by newstack,
+	 cookie the private pointer of the file descriptor, set by csocket or caccept (*cookie) */
+int csocket_prototype(void *stackdata, int domain, int type, int protocol, void **cookie);
+int caccept_prototype(void *stackdata, int fd, void *cookie,
+		struct sockaddr *addr, socklen_t *addrlen, void **newcookie);
+int cclose_prototype(void *stackdata, int fd, void *cookie);
+int cbind_prototype(void *stackdata, int fd, void *cookie,
+		const struct sockaddr *addr, socklen_t addrlen);
+int cconnect_prototype(void *stackdata, int fd, void *cookie,
+		const struct sockaddr *addr, socklen_t addrlen);
+int clisten_prototype(void *stackdata, int fd, void *cookie, int backlog);
+ssize_t crecvfrom_prototype(void *stackdata, int fd, void *cookie, void *buf, size_t len, int flags,
+		struct sockaddr *from, socklen_t *fromlen);
+ssize_t crecvmsg_prototype(void *stackdata, int fd, void *cookie, struct msghdr *msg, int flags);
+ssize_t csendto_prototype(void *stackdata, int fd, void *cookie, const void *buf, size_t len, int flags,
+		const struct sockaddr *to, socklen_t tolen);
+ssize_t csendmsg_prototype(void *stackdata, int fd, void *cookie, const struct msghdr *msg, int flags);
 
 /* libc + _GNU_SOURCE uses a transparent union for sockaddr
  * (__SOCKADDR_ARG __CONST_SOCKADDR_ARG)
@@ -103,7 +208,72 @@ struct ioth_functions {
 	typeof(send) *send;
 	typeof(ioth_sendto) *sendto;
 	typeof(sendmsg) *sendmsg;
+	typeof(fwstats_prototype) *fwstats;
+	/* context-taking entry points: when defined they are used instead of
+		 the functions above (e.g. crecvfrom for read, recv and recvfrom) */
+	typeof(csocket_prototype) *csocket;
+	typeof(caccept_prototype) *caccept;
+	typeof(cclose_prototype) *cclose;
+	typeof(cbind_prototype) *cbind;
+	typeof(cconnect_prototype) *cconnect;
+	typeof(clisten_prototype) *clisten;
+	typeof(crecvfrom_prototype) *crecvfrom;
+	typeof(crecvmsg_prototype) *crecvmsg;
+	typeof(csendto_prototype) *csendto;
+	typeof(csendmsg_prototype) *csendmsg;
+};
+
+/* plugin ABI v2: the plugin ioth_foo exports a single descriptor named ioth_foo_ops
+	 (instead of ioth_foo_license, ioth_foo_newstack, ioth_foo_socket etc.).
+	 f is the table of the functions (getstackdata is set by libioth),
+	 newstack can still modify the table of each stack.
+	 fsize is sizeof(struct ioth_functions) for the plugin: functions appended to the
+	 table later are NULL for older plugins.
+	 caps are the capability flags of the plugin */
+#define IOTH_OPS_VERSION 2
+#define IOTH_CAP_KERNELFD 0x1   // file descriptors are kernel file descriptors (poll/epoll work)
+#define IOTH_CAP_THREADSAFE 0x2 // the functions can be called concurrently by several threads
+#define IOTH_CAP_MULTISTACK 0x4 // several stacks in the same address space (as the -r plugins)
+#define IOTH_CAP_BATCHIO 0x8    // multi-message I/O
+#define IOTH_CAP_ZEROCOPY 0x10  // zero-copy I/O
+struct ioth_ops {
+	uint32_t version; // IOTH_OPS_VERSION
+	uint32_t fsize; // sizeof(struct ioth_functions)
+	uint32_t caps;
+	const char *license; // SPDX, as ioth_foo_license
+	struct ioth_functions f;
+};
+
+/* plugin metadata: IOTH_PLUGIN_NOTE(spdx, capflags) publishes the license
+	 (a string literal, as in ioth_foo_ops.license) and the capability flags of the plugin
+	 in an ELF note: libioth checks the license before loading the plugin */
+#define IOTH_NOTE_NAME "ioth"
+#define IOTH_NOTE_TYPE 1
+#define IOTH_NOTE_ALIGN(len) (((len) + 3) & ~3)
+#define IOTH_PLUGIN_NOTE(spdx, capflags) \
+	static const struct { \
+		uint32_t namesz, descsz, type; \
+		char name[IOTH_NOTE_ALIGN(sizeof(IOTH_NOTE_NAME))]; \
+		uint32_t version, caps; \
+		char license[IOTH_NOTE_ALIGN(sizeof(spdx))]; \
+	} ioth_plugin_note __attribute__((section(".note.ioth"), aligned(4), used)) = { \
+		sizeof(IOTH_NOTE_NAME), 2 * sizeof(uint32_t) + IOTH_NOTE_ALIGN(sizeof(spdx)), \
+		IOTH_NOTE_TYPE, IOTH_NOTE_NAME, IOTH_OPS_VERSION, (capflags), spdx }
+
+/* list the plugins (the first of each name in the search path) without loading them */
+#define IOTH_PLUGIN_REENTRANT 0x1 // ioth_foo-r.so
+#define IOTH_PLUGIN_HASNOTE 0x2   // license and caps come from the note
+struct ioth_plugin {
+	const char *name;
+	const char *path;
+	const char *license; // NULL if the plugin has no note
+	uint32_t caps;
+	int flags;
 };
+typedef int ioth_walkplugins_cb(const struct ioth_plugin *plugin, void *arg);
+/* cb is called for each plugin: the walk stops when cb returns a non-zero value
+	 (the return value of ioth_walkplugins), otherwise ioth_walkplugins returns 0 */
+int ioth_walkplugins(ioth_walkplugins_cb *cb, void *arg);
 
 /* ------------------ MAC address conversions --------------- */
 
@@ -16,6 +16,9 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <ifaddrs.h>
 #include <net/ethernet.h>
@@ -25,7 +28,12 @@
 #include <linux/rtnetlink.h>
 #include <linux/if_arp.h>
 
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+
 #include <ioth.h>
+#include <ioth_nlsock.h>
 
 #define FORALL_NLMSG(nlmsg, buf, len) \
 	for(nlmsg = (struct nlmsghdr *) buf; NLMSG_OK (nlmsg, len); nlmsg = NLMSG_NEXT (nlmsg, len))
@@ -47,218 +55,320 @@ static void nl_getattrs(void *attrbase, size_t attrlen, struct nlattr **attrs, i
 	}
 }
 
-/* delete a struct ifaddrs element */
-#define ck_n_free(x) if (x) free(x)
-static void _freeifaddr(struct ifaddrs *ifa) {
-	ck_n_free(ifa->ifa_name);
-	ck_n_free(ifa->ifa_addr);
-	ck_n_free(ifa->ifa_netmask);
-	ck_n_free(ifa->ifa_broadaddr);
-	ck_n_free(ifa->ifa_data);
-	free(ifa);
+/* all the elements, names and addresses of an ioth_getifaddrs result are
+ * allocated in an arena: ioth_freeifaddrs releases it as a whole */
+#define ARENA_CHUNKSIZE 16384
+#define ARENA_ALIGN(x) (((x) + (sizeof(void *) * 2) - 1) & ~((sizeof(void *) * 2) - 1))
+
+struct ifarena_chunk {
+	struct ifarena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(sizeof(void *) * 2)));
+};
+
+struct ifarena {
+	struct ifarena_chunk *chunks;
+	_Atomic unsigned int refcount; // snapshots of ioth_ifcache are shared
+};
+
+/* zeroed memory from the arena */
+static void *arena_alloc(struct ifarena *arena, size_t size) {
+	struct ifarena_chunk *chunk = arena->chunks;
+	void *retval;
+	size = ARENA_ALIGN(size);
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunksize = size > ARENA_CHUNKSIZE ? size : ARENA_CHUNKSIZE;
+		if ((chunk = malloc(sizeof(*chunk) + chunksize)) == NULL)
+			return NULL;
+		chunk->size = chunksize;
+		chunk->used = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	retval = chunk->data + chunk->used;
+	chunk->used += size;
+	return memset(retval, 0, size);
+}
+
+static void arena_free(struct ifarena *arena) {
+	while (arena->chunks != NULL) {
+		struct ifarena_chunk *next = arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks = next;
+	}
+	free(arena);
 }
 
-/* add an element at the end of the ifap list */
-static void add_ifaddrs(struct ifaddrs *new, struct ifaddrs **ifap) {
-	new->ifa_next = NULL;
-	for (; *ifap != NULL; ifap = &((*ifap)->ifa_next))
+union ifaddrs_sockaddr {
+	struct sockaddr sa;
+	struct sockaddr_ll ll;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+};
+
+/* an element of the list: it records its arena */
+struct ifaddrs_item {
+	struct ifaddrs ifa;
+	struct ifarena *arena;
+	union ifaddrs_sockaddr addr;
+	union ifaddrs_sockaddr netmask;
+	union ifaddrs_sockaddr ifu; // broadcast or destination address
+};
+
+/* index of the AF_PACKET elements: open addressing hash table, the key is if_index */
+struct ifindex_hash {
+	unsigned int size; // power of 2
+	unsigned int count;
+	struct ifaddrs **table;
+};
+
+#define IFINDEX_HASH_MINSIZE 64
+#define ifa_ifindex(ifa) (((struct sockaddr_ll *) (ifa)->ifa_addr)->sll_ifindex)
+
+static int ifindex_hash_add(struct ifindex_hash *hash, struct ifaddrs *ifa);
+
+/* double the size of the table when it is half full */
+static int ifindex_hash_grow(struct ifindex_hash *hash) {
+	struct ifindex_hash new = {.size = hash->size ? hash->size * 2 : IFINDEX_HASH_MINSIZE};
+	unsigned int i;
+	if ((new.table = calloc(new.size, sizeof(new.table[0]))) == NULL)
+		return -1;
+	for (i = 0; i < hash->size; i++) {
+		if (hash->table[i] != NULL)
+			ifindex_hash_add(&new, hash->table[i]);
+	}
+	free(hash->table);
+	*hash = new;
+	return 0;
+}
+
+static int ifindex_hash_add(struct ifindex_hash *hash, struct ifaddrs *ifa) {
+	unsigned int i;
+	if (2 * (hash->count + 1) > hash->size && ifindex_hash_grow(hash) < 0)
+		return -1;
+	for (i = ifa_ifindex(ifa) & (hash->size - 1); hash->table[i] != NULL; i = (i + 1) & (hash->size - 1))
 		;
-	*ifap = new;
+	hash->table[i] = ifa;
+	hash->count++;
+	return 0;
 }
 
-/******************** first netlink request (GETLINK/AF_PACKET) */
-/* add name */
-static char *add_ifla_ifname(struct nlattr *attr) {
-	if (attr)
-		return strndup((char *)(attr + 1), attr->nla_len);
+/* search the AF_PACKET element. Some data must be copied to AF_INET{6} fields */
+static struct ifaddrs *ifindex_hash_search(struct ifindex_hash *hash, int index) {
+	unsigned int i;
+	if (hash->size == 0)
+		return NULL;
+	for (i = index & (hash->size - 1); hash->table[i] != NULL; i = (i + 1) & (hash->size - 1)) {
+		if (ifa_ifindex(hash->table[i]) == index)
+			return hash->table[i];
+	}
 	return NULL;
 }
 
-/* add a sockaddr_ll (ifa_addr, ifa_broadaddr) */
-static void *add_sockaddr_ll(struct nlattr *attr, int ifindex, unsigned ifi_type) {
-	struct sockaddr_ll *ll;
+/******************** walk: netlink replies are parsed in place, no allocations */
+#define WALK_BUFSIZE 32768
+#define WALK_LINKBUFSIZE 8192
+#define WALK_LINKSLOTS 256
+
+/* the element being walked: all the fields point to this structure */
+struct ifaddrs_walk {
+	struct ifaddrs ifa;
+	union ifaddrs_sockaddr addr;
+	union ifaddrs_sockaddr netmask;
+	union ifaddrs_sockaddr ifu;
+	struct rtnl_link_stats stats;
+	char name[IFNAMSIZ];
+};
+
+/* filter: interface index (0 means all the interfaces) and mask of IOTH_IFADDRS_* */
+struct ifaddrs_filter {
+	int ifindex;
+	int mask;
+};
+
+/* link and addr process the elements: a non-zero return value stops the walk.
+ * lookup gets name and flags of an interface (for its addresses) */
+struct ifaddrs_walkops {
+	int (*link)(struct ifaddrs_walk *w, void *arg);
+	int (*addr)(struct ifaddrs_walk *w, void *arg);
+	int (*lookup)(int index, char *name, unsigned int *flags, void *arg);
+};
+
+/* the functions get_xxx return -1 if the attribute is missing or invalid */
+static int get_ifla_ifname(struct nlattr *attr, char *name) {
+	if (attr == NULL)
+		return -1;
+	size_t len = strnlen((char *)(attr + 1), attr->nla_len - sizeof(*attr));
+	if (len >= IFNAMSIZ)
+		len = IFNAMSIZ - 1;
+	memcpy(name, attr + 1, len);
+	name[len] = 0;
+	return 0;
+}
+
+/* sockaddr_ll (ifa_addr, ifa_broadaddr) */
+static int get_sockaddr_ll(struct nlattr *attr, int ifindex, unsigned ifi_type, struct sockaddr_ll *ll) {
 	if (attr != NULL && attr->nla_len > sizeof(*attr) &&
 			attr->nla_len <= sizeof(*attr) + sizeof(ll->sll_addr)) {
 		int halen = attr->nla_len - sizeof(*attr);
-		ll = calloc(1, sizeof(*ll));
-		if (ll) {
-			ll->sll_family = AF_PACKET;
-			ll->sll_ifindex = ifindex;
-			ll->sll_hatype = ifi_type;
-			ll->sll_halen = halen;
-			memcpy (ll->sll_addr, attr + 1, halen);
-			return ll;
-		}
+		memset(ll, 0, sizeof(*ll));
+		ll->sll_family = AF_PACKET;
+		ll->sll_ifindex = ifindex;
+		ll->sll_hatype = ifi_type;
+		ll->sll_halen = halen;
+		memcpy (ll->sll_addr, attr + 1, halen);
+		return 0;
 	}
-	return NULL;
+	return -1;
 }
 
-/* add ifa_data from IFLA_STATS */
-static void *add_ifla_data(struct nlattr *attr) {
+/* ifa_data from IFLA_STATS */
+static int get_ifla_data(struct nlattr *attr, struct rtnl_link_stats *stats) {
 	if (attr != NULL && attr->nla_len == sizeof(*attr) + sizeof(struct rtnl_link_stats)) {
-		void *data = malloc(sizeof(struct rtnl_link_stats));
-		if (data) {
-			memcpy(data, attr + 1, sizeof(struct rtnl_link_stats));
-			return data;
-		}
-	}
-	return NULL;
-}
-
-/* process a GETLINK reply item -> create an AF_PACKET ifaddrs elemet */
-static void add_af_packet(struct nlmsghdr *nlmsg, struct ifaddrs **ifap) {
-	struct ifinfomsg *info = (struct ifinfomsg *) (nlmsg + 1);
-	int32_t len = nlmsg->nlmsg_len - sizeof(*info);
-	if (len < 0)
-		return;
-	struct ifaddrs *new = calloc(1, sizeof(*new));
-	if (new) {
-		struct nlattr *attrs[IFLA_MAX + 1];
-		nl_getattrs(info + 1, len - sizeof(*info), attrs, IFLA_MAX + 1);
-		if ((new->ifa_name = add_ifla_ifname(attrs[IFLA_IFNAME])) == NULL)
-			goto err;
-		new->ifa_flags = info->ifi_flags;
-		if ((new->ifa_addr = add_sockaddr_ll(attrs[IFLA_ADDRESS], info->ifi_index, info->ifi_type)) == NULL)
-			goto err;
-		new->ifa_broadaddr = add_sockaddr_ll(attrs[IFLA_BROADCAST], info->ifi_index, info->ifi_type);
-		new->ifa_data = add_ifla_data(attrs[IFLA_STATS]);
-		add_ifaddrs(new, ifap);
+		memcpy(stats, attr + 1, sizeof(struct rtnl_link_stats));
+		return 0;
 	}
-	return;
-err:
-	_freeifaddr(new);
+	return -1;
 }
 
-/******************** second netlink request (GETADDR/AF_INET{6}) */
-/* add a sockaddr_in/AF_INET field (ifa_addr, ifa_broadaddr, ifa_dstaddr)*/
-static void *add_sockaddr_in(struct nlattr *attr) {
+/* sockaddr_in/AF_INET field (ifa_addr, ifa_broadaddr, ifa_dstaddr)*/
+static int get_sockaddr_in(struct nlattr *attr, struct sockaddr_in *in) {
 	if (attr != NULL && attr->nla_len == sizeof(*attr) + sizeof(struct in_addr)) {
-		struct sockaddr_in *in = calloc(1, sizeof(*in));
-		if (in) {
-			in->sin_family = AF_INET;
-			memcpy(&in->sin_addr, attr + 1, sizeof(struct in_addr));
-			return in;
-		}
+		memset(in, 0, sizeof(*in));
+		in->sin_family = AF_INET;
+		memcpy(&in->sin_addr, attr + 1, sizeof(struct in_addr));
+		return 0;
 	}
-	return NULL;
+	return -1;
 }
 
-/* add a sockaddr_in6/AF_INET6 field (ifa_addr, ifa_broadaddr, ifa_dstaddr)*/
-static void *add_sockaddr_in6(struct nlattr *attr, uint32_t scope_id) {
+/* sockaddr_in6/AF_INET6 field (ifa_addr, ifa_broadaddr, ifa_dstaddr)*/
+static int get_sockaddr_in6(struct nlattr *attr, uint32_t scope_id, struct sockaddr_in6 *in) {
 	if (attr != NULL && attr->nla_len == sizeof(*attr) + sizeof(struct in6_addr)) {
-		struct sockaddr_in6 *in = calloc(1, sizeof(*in));
-		if (in) {
-			in->sin6_family = AF_INET6;
-			if (IN6_IS_ADDR_LINKLOCAL(attr + 1) || IN6_IS_ADDR_MC_LINKLOCAL(attr + 1))
-				in->sin6_scope_id = scope_id;
-			memcpy(&in->sin6_addr, attr + 1, sizeof(struct in6_addr));
-			return in;
-		}
+		memset(in, 0, sizeof(*in));
+		in->sin6_family = AF_INET6;
+		if (IN6_IS_ADDR_LINKLOCAL(attr + 1) || IN6_IS_ADDR_MC_LINKLOCAL(attr + 1))
+			in->sin6_scope_id = scope_id;
+		memcpy(&in->sin6_addr, attr + 1, sizeof(struct in6_addr));
+		return 0;
 	}
-	return NULL;
+	return -1;
 }
 
-/* convert IPv4 prefix to add_sockaddr_in (ifa_netmask) */
-static void *add_sockaddr_netmask(unsigned prefixlen) {
-	struct sockaddr_in *in = calloc(1, sizeof(*in));
-	if (in) {
-		uint32_t mask = (~0U) << (32 - prefixlen);
-		in->sin_family = AF_INET;
-		in->sin_addr.s_addr = htonl(mask);
-		return in;
-	}
-	return NULL;
+/* convert IPv4 prefix to sockaddr_in (ifa_netmask) */
+static void get_sockaddr_netmask(unsigned prefixlen, struct sockaddr_in *in) {
+	uint32_t mask = prefixlen ? (~0U) << (32 - prefixlen) : 0;
+	memset(in, 0, sizeof(*in));
+	in->sin_family = AF_INET;
+	in->sin_addr.s_addr = htonl(mask);
 }
 
-/* convert IPv6 prefix to add_sockaddr_in6 (ifa_netmask) */
-static void *add_sockaddr_netmask6(unsigned prefixlen) {
-	struct sockaddr_in6 *in = calloc(1, sizeof(*in));
-	if (in) {
-		in->sin6_family = AF_INET6;
-		for (int i = 0; i < 16 && prefixlen > 0; i++, prefixlen -= 8) {
-			if (prefixlen > 7)
-				in->sin6_addr.s6_addr[i] = 0xffu;
-			else
-				in->sin6_addr.s6_addr[i] = 0xffu << (8 - prefixlen);
+/* convert IPv6 prefix to sockaddr_in6 (ifa_netmask) */
+static void get_sockaddr_netmask6(unsigned prefixlen, struct sockaddr_in6 *in) {
+	memset(in, 0, sizeof(*in));
+	in->sin6_family = AF_INET6;
+	for (int i = 0; i < 16 && prefixlen > 0; i++, prefixlen -= 8) {
+		if (prefixlen > 7)
+			in->sin6_addr.s6_addr[i] = 0xffu;
+		else {
+			in->sin6_addr.s6_addr[i] = 0xffu << (8 - prefixlen);
+			break;
 		}
-		return in;
 	}
-	return NULL;
 }
 
-/* search the AF_PACKET element, the key is if_index. Some data must be copied to AF_INET{6} fields */
-static struct ifaddrs *search_iface(int index, struct ifaddrs *scan) {
-	for (; scan != NULL; scan = scan->ifa_next) {
-		struct sockaddr_ll *addr_ll = (void *) scan->ifa_addr;
-		if (index == addr_ll->sll_ifindex)
-			return scan;
-	}
-	return NULL;
+/* GETLINK reply item -> AF_PACKET element.
+ * elements without name or address are skipped (return -1) */
+static int walk_link(struct nlmsghdr *nlmsg, struct ifaddrs_walk *w) {
+	struct ifinfomsg *info = (struct ifinfomsg *) (nlmsg + 1);
+	int32_t len = nlmsg->nlmsg_len - NLMSG_LENGTH(sizeof(*info));
+	if (len < 0)
+		return -1;
+	struct nlattr *attrs[IFLA_MAX + 1];
+	nl_getattrs(info + 1, len, attrs, IFLA_MAX + 1);
+	memset(&w->ifa, 0, sizeof(w->ifa));
+	if (get_ifla_ifname(attrs[IFLA_IFNAME], w->name) < 0 ||
+			get_sockaddr_ll(attrs[IFLA_ADDRESS], info->ifi_index, info->ifi_type, &w->addr.ll) < 0)
+		return -1;
+	w->ifa.ifa_name = w->name;
+	w->ifa.ifa_flags = info->ifi_flags;
+	w->ifa.ifa_addr = &w->addr.sa;
+	if (get_sockaddr_ll(attrs[IFLA_BROADCAST], info->ifi_index, info->ifi_type, &w->ifu.ll) == 0)
+		w->ifa.ifa_broadaddr = &w->ifu.sa;
+	if (get_ifla_data(attrs[IFLA_STATS], &w->stats) == 0)
+		w->ifa.ifa_data = &w->stats;
+	return 0;
 }
 
-/* process a GETADDR reply item -> create an AF_INET/AF_INET6 ifaddrs elemet */
-static void add_af_inet(struct nlmsghdr *nlmsg, struct ifaddrs **ifap) {
+/* GETADDR reply item -> AF_INET/AF_INET6 element.
+ * elements of unknown interfaces, without address or not matching the filter
+ * (when the kernel does not support filtering) are skipped (return -1) */
+static int walk_addr(struct nlmsghdr *nlmsg, struct ifaddrs_walk *w, const struct ifaddrs_filter *filter,
+		const struct ifaddrs_walkops *ops, void *arg) {
 	struct ifaddrmsg *info = (struct ifaddrmsg *) (nlmsg + 1);
-	int32_t len = nlmsg->nlmsg_len - sizeof(*info);
+	int32_t len = nlmsg->nlmsg_len - NLMSG_LENGTH(sizeof(*info));
+	unsigned int flags;
 	if (len < 0)
-		return;
+		return -1;
 	switch (info->ifa_family) { // select supported AF only
-		case AF_INET: break;
-		case AF_INET6: break;
-		default: return;
+		case AF_INET: if (filter->mask & IOTH_IFADDRS_INET) break; return -1;
+		case AF_INET6: if (filter->mask & IOTH_IFADDRS_INET6) break; return -1;
+		default: return -1;
 	}
-	struct ifaddrs *ifa_iface = search_iface(info->ifa_index, *ifap);
-	if (ifa_iface == NULL)
-		return;
-	struct ifaddrs *new = calloc(1, sizeof(*new));
+	if (filter->ifindex != 0 && (int) info->ifa_index != filter->ifindex)
+		return -1;
+	if (ops->lookup(info->ifa_index, w->name, &flags, arg) < 0)
+		return -1;
 	struct nlattr *attrs[IFA_MAX + 1];
 	nl_getattrs(info + 1, len, attrs, IFA_MAX + 1);
-	new->ifa_name = strdup(ifa_iface->ifa_name);
-	new->ifa_flags = ifa_iface->ifa_flags;
-
+	memset(&w->ifa, 0, sizeof(w->ifa));
+	w->ifa.ifa_name = w->name;
+	w->ifa.ifa_flags = flags;
+	w->ifa.ifa_addr = &w->addr.sa;
+	w->ifa.ifa_netmask = &w->netmask.sa;
+	int ptp = (flags & IFF_POINTOPOINT) ||
+		(info->ifa_family == AF_INET && (flags & IFF_LOOPBACK));
+	/* ptp: ifa_dstaddr, otherwise ifa_broadaddr */
 	switch (info->ifa_family) {
 		case AF_INET:
-			{
-				if (ifa_iface->ifa_flags & (IFF_POINTOPOINT | IFF_LOOPBACK)) {
-					if ((new->ifa_addr = add_sockaddr_in(attrs[IFA_LOCAL])) == NULL)
-						goto err;
-					new->ifa_dstaddr = add_sockaddr_in(attrs[IFA_ADDRESS]);
-				} else {
-					if ((new->ifa_addr = add_sockaddr_in(attrs[IFA_ADDRESS])) == NULL)
-						goto err;
-					new->ifa_broadaddr = add_sockaddr_in(attrs[IFA_BROADCAST]);
-				}
-				if ((new->ifa_netmask = add_sockaddr_netmask(info->ifa_prefixlen)) == NULL)
-					goto err;
-			}
+			if (get_sockaddr_in(attrs[ptp ? IFA_LOCAL : IFA_ADDRESS], &w->addr.in) < 0)
+				return -1;
+			if (get_sockaddr_in(attrs[ptp ? IFA_ADDRESS : IFA_BROADCAST], &w->ifu.in) == 0)
+				w->ifa.ifa_broadaddr = &w->ifu.sa;
+			get_sockaddr_netmask(info->ifa_prefixlen, &w->netmask.in);
 			break;
 		case AF_INET6:
-			{
-				if (ifa_iface->ifa_flags & IFF_POINTOPOINT) {
-					if ((new->ifa_addr = add_sockaddr_in6(attrs[IFA_LOCAL], info->ifa_index)) == NULL)
-						goto err;
-					new->ifa_dstaddr = add_sockaddr_in6(attrs[IFA_ADDRESS], info->ifa_index);
-				} else {
-					if ((new->ifa_addr = add_sockaddr_in6(attrs[IFA_ADDRESS], info->ifa_index)) == NULL)
-						goto err;
-					new->ifa_broadaddr = add_sockaddr_in6(attrs[IFA_BROADCAST], info->ifa_index);
-				}
-				if ((new->ifa_netmask = add_sockaddr_netmask6(info->ifa_prefixlen)) == NULL)
-					goto err;
-			}	
+			if (get_sockaddr_in6(attrs[ptp ? IFA_LOCAL : IFA_ADDRESS], info->ifa_index, &w->addr.in6) < 0)
+				return -1;
+			if (get_sockaddr_in6(attrs[ptp ? IFA_ADDRESS : IFA_BROADCAST], info->ifa_index, &w->ifu.in6) == 0)
+				w->ifa.ifa_broadaddr = &w->ifu.sa;
+			get_sockaddr_netmask6(info->ifa_prefixlen, &w->netmask.in6);
 			break;
 	}
-	add_ifaddrs(new, ifap);
-	return;
-err:
-	_freeifaddr(new);
+	return 0;
 }
 
-typedef void add_af_generic(struct nlmsghdr *nlmsg, struct ifaddrs **ifap);
+/* set errno from a NLMSG_ERROR message */
+static int nl_error(struct nlmsghdr *nlmsg) {
+	struct nlmsgerr *nlerr = (struct nlmsgerr *)(nlmsg + 1);
+	if (nlmsg->nlmsg_len < NLMSG_LENGTH (sizeof (*nlerr)))
+		errno = EIO;
+	else
+		errno = -nlerr->error;
+	return -1;
+}
 
-/* ioth_getifaddrs, see getifaddrs(3) */
-int ioth_getifaddrs(struct ioth *stack, struct ifaddrs **ifap) {
-	struct sockaddr_nl sanl = {AF_NETLINK, 0, 0, 0};
+/* dump links (GETLINK/AF_PACKET) and then addresses (GETADDR/AF_INET{6}).
+ * ops->link gets all the links (of filter->ifindex if not zero) as they are needed
+ * by the lookup of the addresses, ops->addr gets the addresses matching the filter.
+ * Filtering by ifindex uses a single link request and, if the stack supports
+ * strict checking, dump requests filtered by the kernel.
+ * The same buffer is used for all the chunks of the replies.
+ * return 0 at the end of the walk, -1 in case of error, the return value of
+ * ops->link or ops->addr if it is not zero */
+static int ifaddrs_walk(struct ioth *stack, const struct ifaddrs_filter *filter,
+		const struct ifaddrs_walkops *ops, void *arg) {
 	/* pre-baked netlink request packets */
 	struct {
 		struct nlmsghdr h;
@@ -266,9 +376,10 @@ int ioth_getifaddrs(struct ioth *stack, struct ifaddrs **ifap) {
 	} ifquery = {
 		.h.nlmsg_len = sizeof(ifquery),
 		.h.nlmsg_type = RTM_GETLINK,
-		.h.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
-		.h.nlmsg_seq = 1,
+		.h.nlmsg_flags = filter->ifindex ? NLM_F_REQUEST : NLM_F_REQUEST | NLM_F_DUMP,
+		.i.ifi_index = filter->ifindex,
 	};
+	int addrmask = filter->mask & (IOTH_IFADDRS_INET | IOTH_IFADDRS_INET6);
 	struct {
 		struct nlmsghdr h;
 		struct ifaddrmsg i;
@@ -276,64 +387,428 @@ int ioth_getifaddrs(struct ioth *stack, struct ifaddrs **ifap) {
 		.h.nlmsg_len = sizeof(adquery),
 		.h.nlmsg_type = RTM_GETADDR,
 		.h.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
-		.h.nlmsg_seq = 2,
+		.i.ifa_family = (addrmask == IOTH_IFADDRS_INET) ? AF_INET :
+			(addrmask == IOTH_IFADDRS_INET6) ? AF_INET6 : AF_UNSPEC,
+		.i.ifa_index = filter->ifindex,
 	};
 	struct nlmsghdr *query[] = {&ifquery.h, &adquery.h};
-	add_af_generic *add_af[] = {add_af_packet, add_af_inet};
-
-#define NQR (sizeof(query)/sizeof(query[0]))
-	int fd;
-	ssize_t replylen;
-	*ifap = NULL;
-
-	if ((fd  = ioth_msocket(stack, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0)
+	int nqueries = addrmask ? 2 : 1;
+	struct ifaddrs_walk w;
+	char buf[WALK_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+	int retval = 0;
+	uint32_t seq;
+	/* the kernel filters the dump by ifa_index in strict mode only (otherwise it is
+		 ignored), the socket of the stack has strict checking enabled (if supported) */
+	int fd = ioth_nlsock_get(stack, 2, &seq);
+	if (fd < 0)
 		return -1;
-	if (ioth_bind(fd, (struct sockaddr *) &sanl, sizeof(struct sockaddr_nl)) < 0)
-		goto err;
+	ifquery.h.nlmsg_seq = seq + 1;
+	adquery.h.nlmsg_seq = seq + 2;
 
 	// first request: GETLINK
 	// second request: GETADDR
-	for (int nq = 0; nq < 2; nq++) {
+	for (int nq = 0; nq < nqueries && retval == 0; nq++) {
+		int done = 0;
 		if (ioth_send(fd, query[nq], query[nq]->nlmsg_len, 0) < 0)
 			goto err;
-		while (1) {
-			if ((replylen = ioth_recv(fd, NULL, 0, MSG_PEEK|MSG_TRUNC)) < 0)
-				replylen = 16384;
-			unsigned char replybuf[replylen];
-			if ((replylen = ioth_recv(fd, replybuf, replylen, 0)) < 0)
+		while (!done && retval == 0) {
+			ssize_t replylen = ioth_recv(fd, buf, WALK_BUFSIZE, MSG_TRUNC);
+			if (replylen < 0)
+				goto err;
+			if (replylen > WALK_BUFSIZE) {
+				errno = EMSGSIZE;
 				goto err;
+			}
 			struct nlmsghdr *nlmsg;
-			FORALL_NLMSG(nlmsg, replybuf, replylen) {
-				if (nlmsg->nlmsg_type == NLMSG_DONE)
+			FORALL_NLMSG(nlmsg, buf, replylen) {
+				/* stale replies */
+				if (nlmsg->nlmsg_seq != query[nq]->nlmsg_seq)
+					continue;
+				if (nlmsg->nlmsg_type == NLMSG_DONE) {
+					done = 1;
 					break;
+				}
 				if (nlmsg->nlmsg_type == NLMSG_ERROR) {
-					struct nlmsgerr *nlerr = (struct nlmsgerr *)(nlmsg + 1);
-					if (nlmsg->nlmsg_len < NLMSG_LENGTH (sizeof (*nlerr)))
-						errno = EIO;
-					else
-						errno = -nlerr->error;
-					goto err;
+					/* the error ends the request: the socket can be reused */
+					nl_error(nlmsg);
+					ioth_nlsock_put(stack, fd, 0);
+					return -1;
+				}
+				if (nq == 0) {
+					if (walk_link(nlmsg, &w) == 0)
+						retval = ops->link(&w, arg);
+				} else {
+					if (walk_addr(nlmsg, &w, filter, ops, arg) == 0)
+						retval = ops->addr(&w, arg);
 				}
-				add_af[nq](nlmsg, ifap);
+				/* a single reply (no NLMSG_DONE) to a request which is not a dump */
+				if (!(query[nq]->nlmsg_flags & NLM_F_DUMP))
+					done = 1;
+				if (retval != 0 || done)
+					break;
 			}
-			if (nlmsg->nlmsg_type == NLMSG_DONE)
-				break;
 		}
 	}
-	close(fd);
-	return 0;
+	/* a walk stopped by ops->link or ops->addr leaves the dump unfinished */
+	ioth_nlsock_put(stack, fd, retval != 0);
+	return retval;
 err:
-	close(fd);
-	ioth_freeifaddrs(*ifap);
+	ioth_nlsock_put(stack, fd, 1);
+	return -1;
+}
+
+/******************** ioth_walkifaddrs */
+/* name and flags of the interfaces, for their addresses.
+ * slot collisions (or more than WALK_LINKSLOTS interfaces) are solved by GETLINK queries */
+struct walkifaddrs_link {
+	int index;
+	unsigned int flags;
+	char name[IFNAMSIZ];
+};
+
+struct walkifaddrs_arg {
+	struct ioth *stack;
+	int mask;
+	ioth_walkifaddrs_cb *cb;
+	void *arg;
+	int fd; // socket for GETLINK queries, opened when needed
+	int pending; // the reply to the last query has not been read
+	struct walkifaddrs_link slot[WALK_LINKSLOTS];
+};
+
+static void walkifaddrs_setslot(struct walkifaddrs_arg *a, struct ifaddrs_walk *w) {
+	struct walkifaddrs_link *slot = &a->slot[w->addr.ll.sll_ifindex % WALK_LINKSLOTS];
+	slot->index = w->addr.ll.sll_ifindex;
+	slot->flags = w->ifa.ifa_flags;
+	memcpy(slot->name, w->name, IFNAMSIZ);
+}
+
+static int walkifaddrs_link(struct ifaddrs_walk *w, void *arg) {
+	struct walkifaddrs_arg *a = arg;
+	walkifaddrs_setslot(a, w);
+	if (a->mask & IOTH_IFADDRS_PACKET)
+		return a->cb(&w->ifa, a->arg);
+	return 0;
+}
+
+static int walkifaddrs_addr(struct ifaddrs_walk *w, void *arg) {
+	struct walkifaddrs_arg *a = arg;
+	return a->cb(&w->ifa, a->arg);
+}
+
+/* get a single link */
+static int walkifaddrs_getlink(struct walkifaddrs_arg *a, int index) {
+	struct {
+		struct nlmsghdr h;
+		struct ifinfomsg i;
+	} ifquery = {
+		.h.nlmsg_len = sizeof(ifquery),
+		.h.nlmsg_type = RTM_GETLINK,
+		.h.nlmsg_flags = NLM_F_REQUEST,
+		.i.ifi_index = index,
+	};
+	struct ifaddrs_walk w;
+	char buf[WALK_LINKBUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nlmsg = (struct nlmsghdr *) buf;
+	ssize_t replylen;
+	uint32_t seq;
+	/* the walk is using the socket of the stack: this is a temporary socket
+		 kept until the end of the walk. Each query has its own sequence number */
+	if (a->fd < 0) {
+		if ((a->fd = ioth_nlsock_get(a->stack, 1, &seq)) < 0)
+			return -1;
+	} else
+		seq = ioth_nlsock_seq(a->stack, 1);
+	ifquery.h.nlmsg_seq = seq + 1;
+	a->pending = 1;
+	if (ioth_send(a->fd, &ifquery, sizeof(ifquery), 0) < 0)
+		return -1;
+	do {
+		if ((replylen = ioth_recv(a->fd, buf, WALK_LINKBUFSIZE, MSG_TRUNC)) < 0)
+			return -1;
+	} while (NLMSG_OK(nlmsg, replylen) && nlmsg->nlmsg_seq != ifquery.h.nlmsg_seq);
+	if (NLMSG_OK(nlmsg, replylen))
+		a->pending = 0;
+	if (replylen > WALK_LINKBUFSIZE || !NLMSG_OK(nlmsg, replylen) ||
+			nlmsg->nlmsg_type != RTM_NEWLINK || walk_link(nlmsg, &w) < 0)
+		return -1;
+	walkifaddrs_setslot(a, &w);
+	return 0;
+}
+
+static int walkifaddrs_lookup(int index, char *name, unsigned int *flags, void *arg) {
+	struct walkifaddrs_arg *a = arg;
+	struct walkifaddrs_link *slot = &a->slot[index % WALK_LINKSLOTS];
+	if (slot->index != index && walkifaddrs_getlink(a, index) < 0)
+		return -1;
+	memcpy(name, slot->name, IFNAMSIZ);
+	*flags = slot->flags;
+	return 0;
+}
+
+static const struct ifaddrs_walkops walkifaddrs_ops = {
+	.link = walkifaddrs_link,
+	.addr = walkifaddrs_addr,
+	.lookup = walkifaddrs_lookup,
+};
+
+int ioth_walkifaddrs(struct ioth *stack, int family, ioth_walkifaddrs_cb *cb, void *arg) {
+	struct walkifaddrs_arg a = {
+		.stack = stack,
+		.cb = cb,
+		.arg = arg,
+		.fd = -1,
+	};
+	struct ifaddrs_filter filter = {.ifindex = 0};
+	int retval;
+	switch (family) {
+		case AF_UNSPEC: filter.mask = IOTH_IFADDRS_ALL; break;
+		case AF_PACKET: filter.mask = IOTH_IFADDRS_PACKET; break;
+		case AF_INET: filter.mask = IOTH_IFADDRS_INET; break;
+		case AF_INET6: filter.mask = IOTH_IFADDRS_INET6; break;
+		default:
+			return errno = EAFNOSUPPORT, -1;
+	}
+	a.mask = filter.mask;
+	retval = ifaddrs_walk(stack, &filter, &walkifaddrs_ops, &a);
+	/* the socket can be reused unless a query was interrupted */
+	ioth_nlsock_put(stack, a.fd, a.pending);
+	return retval;
+}
+
+/******************** ioth_getifaddrs */
+/* status of ioth_getifaddrs while the list is being built */
+struct ifaddrs_build {
+	struct ifarena *arena;
+	struct ifaddrs *head;
+	struct ifaddrs **tail;
+	struct ifindex_hash hash;
+	int mask;
+};
+
+/* copy the walked element in the arena and add it at the end of the list
+ * (links are always copied for the lookup, listed only if requested) */
+static struct ifaddrs *build_ifaddrs(struct ifaddrs_walk *w, struct ifaddrs_build *b, int listed) {
+	struct ifaddrs_item *new = arena_alloc(b->arena, sizeof(*new));
+	size_t namelen = strlen(w->name) + 1;
+	if (new == NULL || (new->ifa.ifa_name = arena_alloc(b->arena, namelen)) == NULL)
+		return NULL;
+	new->arena = b->arena;
+	memcpy(new->ifa.ifa_name, w->name, namelen);
+	new->ifa.ifa_flags = w->ifa.ifa_flags;
+	new->addr = w->addr;
+	new->ifa.ifa_addr = &new->addr.sa;
+	if (w->ifa.ifa_netmask) {
+		new->netmask = w->netmask;
+		new->ifa.ifa_netmask = &new->netmask.sa;
+	}
+	if (w->ifa.ifa_broadaddr) {
+		new->ifu = w->ifu;
+		new->ifa.ifa_broadaddr = &new->ifu.sa;
+	}
+	if (w->ifa.ifa_data) {
+		if ((new->ifa.ifa_data = arena_alloc(b->arena, sizeof(w->stats))) == NULL)
+			return NULL;
+		memcpy(new->ifa.ifa_data, &w->stats, sizeof(w->stats));
+	}
+	new->ifa.ifa_next = NULL;
+	if (listed) {
+		*b->tail = &new->ifa;
+		b->tail = &new->ifa.ifa_next;
+	}
+	return &new->ifa;
+}
+
+static int build_link(struct ifaddrs_walk *w, void *arg) {
+	struct ifaddrs_build *b = arg;
+	struct ifaddrs *new = build_ifaddrs(w, b, b->mask & IOTH_IFADDRS_PACKET);
+	if (new == NULL || ifindex_hash_add(&b->hash, new) < 0)
+		return errno = ENOMEM, -1;
+	return 0;
+}
+
+static int build_addr(struct ifaddrs_walk *w, void *arg) {
+	struct ifaddrs_build *b = arg;
+	if (build_ifaddrs(w, b, 1) == NULL)
+		return errno = ENOMEM, -1;
+	return 0;
+}
+
+/* search the AF_PACKET element: some data must be copied to AF_INET{6} fields */
+static int build_lookup(int index, char *name, unsigned int *flags, void *arg) {
+	struct ifaddrs_build *b = arg;
+	struct ifaddrs *ifa_iface = ifindex_hash_search(&b->hash, index);
+	if (ifa_iface == NULL)
+		return -1;
+	snprintf(name, IFNAMSIZ, "%s", ifa_iface->ifa_name);
+	*flags = ifa_iface->ifa_flags;
+	return 0;
+}
+
+static const struct ifaddrs_walkops build_ops = {
+	.link = build_link,
+	.addr = build_addr,
+	.lookup = build_lookup,
+};
+
+/* ioth_getifaddrs_filter: the elements of an interface (all if ifindex == 0)
+ * selected by mask */
+int ioth_getifaddrs_filter(struct ioth *stack, int ifindex, int mask, struct ifaddrs **ifap) {
+	struct ifaddrs_build build = {.mask = mask};
+	struct ifaddrs_filter filter = {.ifindex = ifindex, .mask = mask};
 	*ifap = NULL;
+
+	if (ifindex < 0 || (mask & ~IOTH_IFADDRS_ALL) != 0)
+		return errno = EINVAL, -1;
+	if ((build.arena = calloc(1, sizeof(*build.arena))) == NULL)
+		return -1;
+	build.arena->refcount = 1;
+	build.tail = &build.head;
+	if (ifaddrs_walk(stack, &filter, &build_ops, &build) < 0)
+		goto err;
+	free(build.hash.table);
+	if ((*ifap = build.head) == NULL)
+		arena_free(build.arena);
+	return 0;
+err:
+	free(build.hash.table);
+	arena_free(build.arena);
 	return -1;
 }
 
-/* ioth_freeifaddrs:  see freeifaddrs(3) */
+/* ioth_getifaddrs, see getifaddrs(3) */
+int ioth_getifaddrs(struct ioth *stack, struct ifaddrs **ifap) {
+	return ioth_getifaddrs_filter(stack, 0, IOTH_IFADDRS_ALL, ifap);
+}
+
+/* ioth_freeifaddrs:  see freeifaddrs(3).
+ * ifa must be the head of a list returned by ioth_getifaddrs */
 void ioth_freeifaddrs(struct ifaddrs *ifa) {
-	while (ifa != NULL) {
-		struct ifaddrs *next = ifa->ifa_next;
-		_freeifaddr(ifa);
-		ifa = next;
+	if (ifa != NULL) {
+		struct ifarena *arena = ((struct ifaddrs_item *) ifa)->arena;
+		if (--arena->refcount == 0)
+			arena_free(arena);
 	}
 }
+
+/******************** ioth_ifcache: ioth_getifaddrs snapshots updated by netlink notifications */
+#define IFCACHE_GROUPS (RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR)
+#define IFCACHE_BUFSIZE 16384
+#define IFCACHE_RETRY 1000 // ms, retry period of failed updates
+
+struct ioth_ifcache {
+	struct ioth *stack;
+	int fd; // netlink socket subscribed to IFCACHE_GROUPS
+	int wakefd; // eventfd: ioth_ifcache_destroy wakes up the thread
+	pthread_t thread;
+	pthread_mutex_t mutex; // protects ifa/version (never held during netlink operations)
+	struct ifaddrs *ifa;
+	_Atomic uint64_t version;
+	_Atomic int terminate;
+};
+
+/* replace the snapshot */
+static int ifcache_update(struct ioth_ifcache *cache) {
+	struct ifaddrs *ifa, *old;
+	if (ioth_getifaddrs(cache->stack, &ifa) < 0)
+		return -1;
+	pthread_mutex_lock(&cache->mutex);
+	old = cache->ifa;
+	cache->ifa = ifa;
+	cache->version++;
+	pthread_mutex_unlock(&cache->mutex);
+	ioth_freeifaddrs(old);
+	return 0;
+}
+
+/* wait for notifications: pending notifications are coalesced in one update.
+ * ENOBUFS (lost notifications) requires an update, too.
+ * A failed update is retried every IFCACHE_RETRY ms */
+static void *ifcache_thread(void *arg) {
+	struct ioth_ifcache *cache = arg;
+	char buf[IFCACHE_BUFSIZE];
+	int failed = 0;
+	while (!cache->terminate) {
+		struct pollfd pfd[] = {{cache->fd, POLLIN, 0}, {cache->wakefd, POLLIN, 0}};
+		int changed = failed;
+		ssize_t n;
+		if (poll(pfd, 2, failed ? IFCACHE_RETRY : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (cache->terminate)
+			break;
+		while ((n = ioth_recv(cache->fd, buf, IFCACHE_BUFSIZE, MSG_DONTWAIT)) >= 0 || errno == ENOBUFS)
+			changed = 1;
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			break;
+		if (changed)
+			failed = ifcache_update(cache) < 0;
+	}
+	return NULL;
+}
+
+struct ioth_ifcache *ioth_ifcache_create(struct ioth *stack) {
+	struct sockaddr_nl sanl = {.nl_family = AF_NETLINK, .nl_groups = IFCACHE_GROUPS};
+	struct ioth_ifcache *cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		goto err_cache;
+	cache->stack = stack;
+	if ((cache->fd = ioth_msocket(stack, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0)
+		goto err_fd;
+	if (ioth_bind(cache->fd, (struct sockaddr *) &sanl, sizeof(sanl)) < 0)
+		goto err_bind;
+	if ((cache->wakefd = eventfd(0, EFD_CLOEXEC)) < 0)
+		goto err_bind;
+	pthread_mutex_init(&cache->mutex, NULL);
+	/* first snapshot: the socket has been already subscribed,
+		 no changes can be lost */
+	if (ifcache_update(cache) < 0)
+		goto err_update;
+	if ((errno = pthread_create(&cache->thread, NULL, ifcache_thread, cache)) != 0)
+		goto err_thread;
+	return cache;
+err_thread:
+	ioth_freeifaddrs(cache->ifa);
+err_update:
+	pthread_mutex_destroy(&cache->mutex);
+	close(cache->wakefd);
+err_bind:
+	ioth_close(cache->fd);
+err_fd:
+	free(cache);
+err_cache:
+	return NULL;
+}
+
+/* get a reference to the current snapshot (to be released by ioth_freeifaddrs) */
+int ioth_ifcache_getifaddrs(struct ioth_ifcache *cache, struct ifaddrs **ifap, uint64_t *version) {
+	if (cache == NULL || ifap == NULL)
+		return errno = EINVAL, -1;
+	pthread_mutex_lock(&cache->mutex);
+	if ((*ifap = cache->ifa) != NULL)
+		((struct ifaddrs_item *) cache->ifa)->arena->refcount++;
+	if (version)
+		*version = cache->version;
+	pthread_mutex_unlock(&cache->mutex);
+	return 0;
+}
+
+uint64_t ioth_ifcache_version(struct ioth_ifcache *cache) {
+	return cache->version;
+}
+
+int ioth_ifcache_destroy(struct ioth_ifcache *cache) {
+	if (cache == NULL)
+		return errno = EINVAL, -1;
+	cache->terminate = 1;
+	eventfd_write(cache->wakefd, 1);
+	pthread_join(cache->thread, NULL);
+	close(cache->wakefd);
+	ioth_close(cache->fd);
+	pthread_mutex_destroy(&cache->mutex);
+	ioth_freeifaddrs(cache->ifa);
+	free(cache);
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ *   libioth: choose your networking library as a plugin at run time.
+ *   ioth_linkstats: sampling of the interface counters (IFLA_STATS64)
+ *
+ *   Copyright (C) 2021  Renzo Davoli <renzo@cs.unibo.it> VirtualSquare team.
+ *
+ *   This library is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or (at
+ *   your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+
+#include <ioth.h>
+#include <ioth_nlsock.h>
+
+/* requests sent in a single datagram */
+#define LINKSTATS_BATCH 64
+#define LINKSTATS_BUFSIZE 1024
+
+#define FORALL_NLMSG(nlmsg, buf, len) \
+	for(nlmsg = (struct nlmsghdr *) buf; NLMSG_OK (nlmsg, len); nlmsg = NLMSG_NEXT (nlmsg, len))
+
+struct ioth_linkstats {
+	struct ioth *stack;
+};
+
+struct linkstats_req {
+	struct nlmsghdr h;
+	struct if_stats_msg i;
+};
+
+/* the requests use the netlink socket of the stack (see ioth_nlsock_get) */
+struct ioth_linkstats *ioth_linkstats_open(struct ioth *stack) {
+	struct ioth_linkstats *ls = malloc(sizeof(*ls));
+	if (ls == NULL)
+		return NULL;
+	ls->stack = stack;
+	return ls;
+}
+
+int ioth_linkstats_close(struct ioth_linkstats *ls) {
+	if (ls == NULL)
+		return errno = EINVAL, -1;
+	free(ls);
+	return 0;
+}
+
+/* copy IFLA_STATS_LINK_64 from a RTM_NEWSTATS reply */
+static void linkstats_get(struct nlmsghdr *nlmsg, struct rtnl_link_stats64 *stats) {
+	struct rtattr *attr = (struct rtattr *) ((char *) NLMSG_DATA(nlmsg) + NLMSG_ALIGN(sizeof(struct if_stats_msg)));
+	int len = nlmsg->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(sizeof(struct if_stats_msg)));
+	for (; RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+		if (attr->rta_type == IFLA_STATS_LINK_64) {
+			size_t size = RTA_PAYLOAD(attr);
+			memcpy(stats, RTA_DATA(attr), size < sizeof(*stats) ? size : sizeof(*stats));
+			return;
+		}
+	}
+}
+
+/* one datagram of requests, then the replies (matched by sequence number,
+ * stale replies are discarded).
+ * *error is set to the error of the first failed request (if *error is 0).
+ * return -1 in case of communication error */
+static int linkstats_batch(int fd, uint32_t seq0, const int *ifindex,
+		struct rtnl_link_stats64 *stats, int n, int *error) {
+	struct linkstats_req req[LINKSTATS_BATCH];
+	int pending;
+	memset(req, 0, n * sizeof(req[0]));
+	for (int k = 0; k < n; k++) {
+		req[k].h.nlmsg_len = sizeof(req[k]);
+		req[k].h.nlmsg_type = RTM_GETSTATS;
+		req[k].h.nlmsg_flags = NLM_F_REQUEST;
+		req[k].h.nlmsg_seq = seq0 + k;
+		req[k].i.ifindex = ifindex[k];
+		req[k].i.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+	}
+	if (ioth_send(fd, req, n * sizeof(req[0]), 0) < 0)
+		return -1;
+	for (pending = n; pending > 0; ) {
+		char buf[LINKSTATS_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+		ssize_t len = ioth_recv(fd, buf, LINKSTATS_BUFSIZE, 0);
+		struct nlmsghdr *nlmsg;
+		if (len < 0)
+			return -1;
+		FORALL_NLMSG(nlmsg, buf, len) {
+			uint32_t k = nlmsg->nlmsg_seq - seq0;
+			if (k >= (uint32_t) n)
+				continue;
+			pending--;
+			if (nlmsg->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *nlerr = (struct nlmsgerr *)(nlmsg + 1);
+				if (*error == 0)
+					*error = (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(*nlerr))) ? EIO : -nlerr->error;
+			} else if (nlmsg->nlmsg_type == RTM_NEWSTATS)
+				linkstats_get(nlmsg, &stats[k]);
+		}
+	}
+	return 0;
+}
+
+/* sample the counters of n interfaces: stats[i] is the counters of ifindex[i].
+ * The counters of the interfaces which cannot be sampled are zeroed */
+int ioth_linkstats_sample(struct ioth_linkstats *ls, const int *ifindex,
+		struct rtnl_link_stats64 *stats, int n) {
+	int error = 0;
+	int reset = 0;
+	uint32_t seq;
+	int fd;
+	if (ls == NULL || n < 0)
+		return errno = EINVAL, -1;
+	memset(stats, 0, n * sizeof(stats[0]));
+	if ((fd = ioth_nlsock_get(ls->stack, n, &seq)) < 0)
+		return -1;
+	for (int i = 0; i < n; i += LINKSTATS_BATCH) {
+		int nbatch = (n - i < LINKSTATS_BATCH) ? n - i : LINKSTATS_BATCH;
+		if (linkstats_batch(fd, seq + 1 + i, ifindex + i, stats + i, nbatch, &error) < 0) {
+			error = errno;
+			reset = 1;
+			break;
+		}
+	}
+	ioth_nlsock_put(ls->stack, fd, reset);
+	if (error != 0)
+		return errno = error, -1;
+	return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ *   libioth: choose your networking library as a plugin at run time.
+ *   ioth_module: search path and index of the plugin modules
+ *
+ *   Copyright (C) 2021  Renzo Davoli <renzo@cs.unibo.it> VirtualSquare team.
+ *
+ *   This library is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or (at
+ *   your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <link.h>
+#include <limits.h>
+#include <pthread.h>
+#include <config.h>
+
+#include <ioth.h>
+#include <ioth_module.h>
+#include <checklicense.h>
+
+#ifndef USER_IOTH_PATH
+#define USER_IOTH_PATH "/.ioth"
+#endif
+/* this whould be defind by cmake in config.h */
+#ifndef SYSTEM_IOTH_PATH
+#define SYSTEM_IOTH_PATH "/usr/local/lib/ioth"
+#endif
+
+#define MODULE_PREFIX "ioth_"
+#define MODULE_SUFFIX ".so"
+#define MODULE_RSUFFIX "-r.so"
+#define MODULE_NOTEMAX 4096
+#if __ELF_NATIVE_CLASS == 64
+#define MODULE_ELFCLASS ELFCLASS64
+#else
+#define MODULE_ELFCLASS ELFCLASS32
+#endif
+
+/* one entry for each stack name: the first module found in the search path,
+ * in the same directory ioth_foo-r.so is preferred to ioth_foo.so */
+struct ioth_module {
+	char *name;
+	char *path;
+	int reentrant;
+	int dirindex;
+	int hasnote;
+	uint32_t version; // from the note
+	uint32_t caps;
+	char *license;
+	void *handle; // preloaded (reentrant modules only)
+};
+
+static pthread_once_t modindex_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t modindex_mutex = PTHREAD_MUTEX_INITIALIZER; // preloaded handles
+static struct ioth_module *modindex;
+static int modindex_count;
+static const char *proglicense;
+
+void ioth_set_license(const char *license) {
+	proglicense = license;
+}
+
+int ioth_module_checklicense(const char *liblicense) {
+	return checklicense(proglicense, liblicense);
+}
+
+static inline char *gethomedir(void) {
+	char *homedir = getenv("HOME");
+	/* If there is no home directory, use CWD */
+	if (!homedir)
+		homedir = ".";
+	return homedir;
+}
+
+static struct ioth_module *modindex_find(const char *name) {
+	for (int i = 0; i < modindex_count; i++) {
+		if (strcmp(modindex[i].name, name) == 0)
+			return &modindex[i];
+	}
+	return NULL;
+}
+
+/* add the module dir/filename, if it is a plugin */
+static void modindex_add(const char *dir, const char *filename, int dirindex) {
+	size_t prefixlen = sizeof(MODULE_PREFIX) - 1;
+	size_t len = strlen(filename);
+	size_t namelen;
+	int reentrant;
+	struct ioth_module *mod;
+	char *path;
+	if (strncmp(filename, MODULE_PREFIX, prefixlen) != 0)
+		return;
+	if (len > prefixlen + sizeof(MODULE_RSUFFIX) - 1 &&
+			strcmp(filename + len - (sizeof(MODULE_RSUFFIX) - 1), MODULE_RSUFFIX) == 0) {
+		reentrant = 1;
+		namelen = len - prefixlen - (sizeof(MODULE_RSUFFIX) - 1);
+	} else if (len > prefixlen + sizeof(MODULE_SUFFIX) - 1 &&
+			strcmp(filename + len - (sizeof(MODULE_SUFFIX) - 1), MODULE_SUFFIX) == 0) {
+		reentrant = 0;
+		namelen = len - prefixlen - (sizeof(MODULE_SUFFIX) - 1);
+	} else
+		return;
+	char name[namelen + 1];
+	snprintf(name, namelen + 1, "%s", filename + prefixlen);
+	mod = modindex_find(name);
+	if (mod != NULL && (mod->dirindex < dirindex || mod->reentrant || !reentrant))
+		return;
+	if (asprintf(&path, "%s/%s", dir, filename) < 0)
+		return;
+	if (mod == NULL) {
+		struct ioth_module *newindex = realloc(modindex, (modindex_count + 1) * sizeof(*modindex));
+		if (newindex == NULL)
+			goto err;
+		modindex = newindex;
+		mod = &modindex[modindex_count];
+		if ((mod->name = strdup(name)) == NULL)
+			goto err;
+		mod->hasnote = 0;
+		mod->version = 0;
+		mod->caps = 0;
+		mod->license = NULL;
+		mod->handle = NULL;
+		modindex_count++;
+	} else
+		free(mod->path);
+	mod->path = path;
+	mod->reentrant = reentrant;
+	mod->dirindex = dirindex;
+	return;
+err:
+	free(path);
+}
+
+static void modindex_scandir(const char *dir, int dirindex) {
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL)
+		modindex_add(dir, de->d_name, dirindex);
+	closedir(d);
+}
+
+/* search the note IOTH_NOTE_NAME/IOTH_NOTE_TYPE in the SHT_NOTE sections of the plugin:
+ * the file is read, not loaded */
+static void modindex_readnote(struct ioth_module *mod) {
+	ElfW(Ehdr) ehdr;
+	int fd = open(mod->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+			memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+			ehdr.e_ident[EI_CLASS] != MODULE_ELFCLASS ||
+			ehdr.e_shentsize != sizeof(ElfW(Shdr)))
+		goto close;
+	for (int i = 0; i < ehdr.e_shnum && !mod->hasnote; i++) {
+		ElfW(Shdr) shdr;
+		if (pread(fd, &shdr, sizeof(shdr), ehdr.e_shoff + i * sizeof(shdr)) != sizeof(shdr))
+			break;
+		if (shdr.sh_type != SHT_NOTE || shdr.sh_size == 0 || shdr.sh_size > MODULE_NOTEMAX)
+			continue;
+		char buf[shdr.sh_size] __attribute__((aligned(4)));
+		if (pread(fd, buf, shdr.sh_size, shdr.sh_offset) != (ssize_t) shdr.sh_size)
+			continue;
+		for (size_t off = 0; off + sizeof(ElfW(Nhdr)) <= shdr.sh_size; ) {
+			ElfW(Nhdr) *nhdr = (ElfW(Nhdr) *) (buf + off);
+			/* sizes aligned in size_t (no wrap around), checked against the section:
+				 corrupted or malicious notes */
+			size_t left = shdr.sh_size - off - sizeof(*nhdr);
+			size_t namesz = IOTH_NOTE_ALIGN((size_t) nhdr->n_namesz);
+			if (namesz > left || nhdr->n_descsz > left - namesz)
+				break;
+			char *name = (char *) (nhdr + 1);
+			uint32_t *desc = (uint32_t *) (name + namesz);
+			size_t next = off + sizeof(*nhdr) + namesz + IOTH_NOTE_ALIGN((size_t) nhdr->n_descsz);
+			if (nhdr->n_type == IOTH_NOTE_TYPE && nhdr->n_descsz > 2 * sizeof(uint32_t) &&
+					nhdr->n_namesz == sizeof(IOTH_NOTE_NAME) &&
+					memcmp(name, IOTH_NOTE_NAME, sizeof(IOTH_NOTE_NAME)) == 0) {
+				mod->license = strndup((char *) (desc + 2), nhdr->n_descsz - 2 * sizeof(uint32_t));
+				if (mod->license == NULL)
+					break;
+				mod->version = desc[0];
+				mod->caps = desc[1];
+				mod->hasnote = 1;
+				break;
+			}
+			off = next;
+		}
+	}
+close:
+	close(fd);
+}
+
+/* search path: IOTH_PATH (colon separated list of directories), ~/.ioth, system directory */
+static void modindex_build(void) {
+	char *iothpath = getenv("IOTH_PATH");
+	char userpath[PATH_MAX];
+	int dirindex = 0;
+	if (iothpath != NULL) {
+		char pathcopy[strlen(iothpath) + 1];
+		char *dir, *saveptr;
+		snprintf(pathcopy, sizeof(pathcopy), "%s", iothpath);
+		for (dir = strtok_r(pathcopy, ":", &saveptr); dir != NULL;
+				dir = strtok_r(NULL, ":", &saveptr))
+			modindex_scandir(dir, dirindex++);
+	}
+	snprintf(userpath, PATH_MAX, "%s%s", gethomedir(), USER_IOTH_PATH);
+	modindex_scandir(userpath, dirindex++);
+	modindex_scandir(SYSTEM_IOTH_PATH, dirindex++);
+#ifdef DEBUG
+	modindex_scandir(".", dirindex++);
+#endif
+	for (int i = 0; i < modindex_count; i++)
+		modindex_readnote(&modindex[i]);
+}
+
+/* checks based on the note, before loading the module */
+static int modindex_check(struct ioth_module *mod) {
+	if (!mod->hasnote)
+		return 0;
+	if (mod->version != IOTH_OPS_VERSION)
+		return errno = ENOTSUP, -1;
+	if (checklicense(proglicense, mod->license) != 1)
+		return errno = EPERM, -1;
+	return 0;
+}
+
+/* the index does not change once it has been built */
+void *ioth_module_open(const char *modname, int flags) {
+	struct ioth_module *mod;
+	pthread_once(&modindex_once, modindex_build);
+	if ((mod = modindex_find(modname)) == NULL)
+		return errno = ENOENT, NULL;
+	if (modindex_check(mod) < 0)
+		return NULL;
+	return dlmopen(mod->reentrant ? LM_ID_BASE : LM_ID_NEWLM, mod->path, flags);
+}
+
+int ioth_walkplugins(ioth_walkplugins_cb *cb, void *arg) {
+	pthread_once(&modindex_once, modindex_build);
+	for (int i = 0; i < modindex_count; i++) {
+		struct ioth_module *mod = &modindex[i];
+		struct ioth_plugin plugin = {
+			.name = mod->name,
+			.path = mod->path,
+			.license = mod->license,
+			.caps = mod->caps,
+			.flags = (mod->reentrant ? IOTH_PLUGIN_REENTRANT : 0) |
+				(mod->hasnote ? IOTH_PLUGIN_HASNOTE : 0),
+		};
+		int retval = cb(&plugin, arg);
+		if (retval != 0)
+			return retval;
+	}
+	return 0;
+}
+
+int ioth_preload(const char *stack) {
+	struct ioth_module *mod;
+	int retval = 0;
+	pthread_once(&modindex_once, modindex_build);
+	if (stack == NULL)
+		return 0;
+	/* "name,options": the options are not used here */
+	size_t namelen = strcspn(stack, ",");
+	char name[namelen + 1];
+	snprintf(name, namelen + 1, "%s", stack);
+	pthread_mutex_lock(&modindex_mutex);
+	if ((mod = modindex_find(name)) == NULL)
+		retval = (errno = ENOENT, -1);
+	else if (modindex_check(mod) < 0)
+		retval = -1;
+	/* non reentrant modules are loaded in a new namespace for each stack */
+	else if (mod->reentrant && mod->handle == NULL &&
+			(mod->handle = dlmopen(LM_ID_BASE, mod->path, RTLD_NOW)) == NULL)
+		retval = (errno = ENOTSUP, -1);
+	pthread_mutex_unlock(&modindex_mutex);
+	return retval;
+}
+
+__attribute__((destructor))
+	static void fini(void) {
+		for (int i = 0; i < modindex_count; i++) {
+			if (modindex[i].handle != NULL)
+				dlclose(modindex[i].handle);
+			free(modindex[i].name);
+			free(modindex[i].path);
+			free(modindex[i].license);
+		}
+		free(modindex);
+	}
@@ -0,0 +1,16 @@
+#ifndef IOTH_MODULE_H
+#define IOTH_MODULE_H
+
+/* plugin modules of libioth.
+ * The directories of the plugins (IOTH_PATH, ~/.ioth, the system directory) are
+ * scanned once: ioth_module_open loads the module of a stack with a single dlmopen
+ * (reentrant "-r" modules in the base namespace, the others in a new namespace).
+ * It returns NULL if the module does not exist or cannot be loaded */
+void *ioth_module_open(const char *modname, int flags);
+
+/* when the plugin publishes its license and version in an ELF note (IOTH_PLUGIN_NOTE)
+ * these are checked before loading it: ioth_module_open fails with EPERM or ENOTSUP.
+ * ioth_module_checklicense checks the license of a loaded plugin (1 = ok) */
+int ioth_module_checklicense(const char *liblicense);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ *   libioth: choose your networking library as a plugin at run time.
+ *   ioth_nlbatch: batches of netlink configuration requests
+ *
+ *   Copyright (C) 2021  Renzo Davoli <renzo@cs.unibo.it> VirtualSquare team.
+ *
+ *   This library is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or (at
+ *   your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <ioth.h>
+#include <ioth_nlsock.h>
+
+/* requests sent before collecting their acks: the acks must fit in the
+ * receive buffer of the socket, otherwise they are dropped (ENOBUFS) */
+#define NLBATCH_WINDOW 128
+#define NLBATCH_MSGSIZE 128
+#define NLBATCH_BUFSIZE 4096
+
+#define FORALL_NLMSG(nlmsg, buf, len) \
+	for(nlmsg = (struct nlmsghdr *) buf; NLMSG_OK (nlmsg, len); nlmsg = NLMSG_NEXT (nlmsg, len))
+
+struct ioth_nlbatch {
+	struct ioth *stack;
+	char *buf; // queued requests
+	size_t len;
+	size_t size;
+	int count;
+};
+
+struct ioth_nlbatch *ioth_nlbatch_new(struct ioth *stack) {
+	struct ioth_nlbatch *batch = calloc(1, sizeof(*batch));
+	if (batch == NULL)
+		return NULL;
+	batch->stack = stack;
+	return batch;
+}
+
+void ioth_nlbatch_free(struct ioth_nlbatch *batch) {
+	if (batch != NULL) {
+		free(batch->buf);
+		free(batch);
+	}
+}
+
+/* the space for a new request (NLBATCH_MSGSIZE bytes at most), NULL if there is no memory */
+static struct nlmsghdr *nlbatch_newmsg(struct ioth_nlbatch *batch, uint16_t type, uint16_t flags,
+		void *payload, size_t payloadlen) {
+	struct nlmsghdr *msg;
+	if (batch->len + NLBATCH_MSGSIZE > batch->size) {
+		size_t newsize = batch->size ? batch->size * 2 : NLBATCH_BUFSIZE;
+		char *newbuf = realloc(batch->buf, newsize);
+		if (newbuf == NULL)
+			return errno = ENOMEM, NULL;
+		batch->buf = newbuf;
+		batch->size = newsize;
+	}
+	msg = (struct nlmsghdr *) (batch->buf + batch->len);
+	memset(msg, 0, NLBATCH_MSGSIZE);
+	msg->nlmsg_len = NLMSG_LENGTH(payloadlen);
+	msg->nlmsg_type = type;
+	msg->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	memcpy(NLMSG_DATA(msg), payload, payloadlen);
+	return msg;
+}
+
+static void nlbatch_addattr(struct nlmsghdr *msg, uint16_t type, const void *data, size_t len) {
+	struct rtattr *rta = (struct rtattr *) ((char *) msg + NLMSG_ALIGN(msg->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	msg->nlmsg_len = NLMSG_ALIGN(msg->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/* the request is complete: return its index in the batch */
+static int nlbatch_queue(struct ioth_nlbatch *batch, struct nlmsghdr *msg) {
+	batch->len += NLMSG_ALIGN(msg->nlmsg_len);
+	return batch->count++;
+}
+
+static int nlbatch_addrlen(int family) {
+	switch (family) {
+		case AF_INET: return 4;
+		case AF_INET6: return 16;
+		default: return errno = EAFNOSUPPORT, -1;
+	}
+}
+
+int ioth_nlbatch_linksetupdown(struct ioth_nlbatch *batch, unsigned int ifindex, int updown) {
+	struct ifinfomsg ifinfo = {
+		.ifi_family = AF_UNSPEC,
+		.ifi_index = ifindex,
+		.ifi_flags = updown ? IFF_UP : 0,
+		.ifi_change = IFF_UP,
+	};
+	struct nlmsghdr *msg = nlbatch_newmsg(batch, RTM_NEWLINK, 0, &ifinfo, sizeof(ifinfo));
+	if (msg == NULL)
+		return -1;
+	return nlbatch_queue(batch, msg);
+}
+
+int ioth_nlbatch_iplink_del(struct ioth_nlbatch *batch, const char *ifname, unsigned int ifindex) {
+	struct ifinfomsg ifinfo = {
+		.ifi_family = AF_UNSPEC,
+		.ifi_index = ifindex,
+	};
+	struct nlmsghdr *msg;
+	if (ifname != NULL && strlen(ifname) >= IFNAMSIZ)
+		return errno = EINVAL, -1;
+	if ((msg = nlbatch_newmsg(batch, RTM_DELLINK, 0, &ifinfo, sizeof(ifinfo))) == NULL)
+		return -1;
+	if (ifname != NULL)
+		nlbatch_addattr(msg, IFLA_IFNAME, ifname, strlen(ifname) + 1);
+	return nlbatch_queue(batch, msg);
+}
+
+static int nlbatch_ipaddr(struct ioth_nlbatch *batch, uint16_t type, uint16_t flags,
+		int family, void *addr, int prefixlen, unsigned int ifindex) {
+	struct ifaddrmsg ifaddr = {
+		.ifa_family = family,
+		.ifa_prefixlen = prefixlen,
+		.ifa_index = ifindex,
+	};
+	int addrlen = nlbatch_addrlen(family);
+	struct nlmsghdr *msg;
+	if (addrlen < 0)
+		return -1;
+	if ((msg = nlbatch_newmsg(batch, type, flags, &ifaddr, sizeof(ifaddr))) == NULL)
+		return -1;
+	nlbatch_addattr(msg, IFA_LOCAL, addr, addrlen);
+	nlbatch_addattr(msg, IFA_ADDRESS, addr, addrlen);
+	return nlbatch_queue(batch, msg);
+}
+
+int ioth_nlbatch_ipaddr_add(struct ioth_nlbatch *batch,
+		int family, void *addr, int prefixlen, unsigned int ifindex) {
+	return nlbatch_ipaddr(batch, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL,
+			family, addr, prefixlen, ifindex);
+}
+
+int ioth_nlbatch_ipaddr_del(struct ioth_nlbatch *batch,
+		int family, void *addr, int prefixlen, unsigned int ifindex) {
+	return nlbatch_ipaddr(batch, RTM_DELADDR, 0,
+			family, addr, prefixlen, ifindex);
+}
+
+static int nlbatch_iproute(struct ioth_nlbatch *batch, uint16_t type, uint16_t flags,
+		int family, void *dst_addr, int dst_prefixlen, void *gw_addr, unsigned int ifindex) {
+	struct rtmsg rt = {
+		.rtm_family = family,
+		.rtm_dst_len = dst_prefixlen,
+		.rtm_table = RT_TABLE_MAIN,
+		.rtm_protocol = RTPROT_BOOT,
+		.rtm_scope = gw_addr ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK,
+		.rtm_type = RTN_UNICAST,
+	};
+	int addrlen = nlbatch_addrlen(family);
+	struct nlmsghdr *msg;
+	if (addrlen < 0)
+		return -1;
+	if ((msg = nlbatch_newmsg(batch, type, flags, &rt, sizeof(rt))) == NULL)
+		return -1;
+	if (dst_addr != NULL && dst_prefixlen > 0)
+		nlbatch_addattr(msg, RTA_DST, dst_addr, addrlen);
+	if (gw_addr != NULL)
+		nlbatch_addattr(msg, RTA_GATEWAY, gw_addr, addrlen);
+	if (ifindex > 0)
+		nlbatch_addattr(msg, RTA_OIF, &ifindex, sizeof(ifindex));
+	return nlbatch_queue(batch, msg);
+}
+
+int ioth_nlbatch_iproute_add(struct ioth_nlbatch *batch, int family,
+		void *dst_addr, int dst_prefixlen, void *gw_addr, unsigned int ifindex) {
+	return nlbatch_iproute(batch, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL,
+			family, dst_addr, dst_prefixlen, gw_addr, ifindex);
+}
+
+int ioth_nlbatch_iproute_del(struct ioth_nlbatch *batch, int family,
+		void *dst_addr, int dst_prefixlen, void *gw_addr, unsigned int ifindex) {
+	return nlbatch_iproute(batch, RTM_DELROUTE, 0,
+			family, dst_addr, dst_prefixlen, gw_addr, ifindex);
+}
+
+/* send the requests from index "first" (at offset "off"): up to NLBATCH_WINDOW requests
+ * in one datagram (sequence numbers from seq0 + first), then collect their acks
+ * (failures are counted in *nfail).
+ * return the number of requests sent, -1 in case of error */
+static int nlbatch_window(int fd, struct ioth_nlbatch *batch, uint32_t seq0, int first, size_t *off,
+		int *errors, int *nfail) {
+	char *start = batch->buf + *off;
+	size_t len = 0;
+	int n, pending;
+	for (n = 0; n < NLBATCH_WINDOW && first + n < batch->count; n++) {
+		struct nlmsghdr *msg = (struct nlmsghdr *) (start + len);
+		msg->nlmsg_seq = seq0 + first + n;
+		len += NLMSG_ALIGN(msg->nlmsg_len);
+	}
+	if (ioth_send(fd, start, len, 0) < 0)
+		return -1;
+	*off += len;
+	for (pending = n; pending > 0; ) {
+		char buf[NLBATCH_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+		ssize_t replylen = ioth_recv(fd, buf, NLBATCH_BUFSIZE, 0);
+		struct nlmsghdr *nlmsg;
+		if (replylen < 0)
+			return -1;
+		FORALL_NLMSG(nlmsg, buf, replylen) {
+			struct nlmsgerr *nlerr = (struct nlmsgerr *)(nlmsg + 1);
+			uint32_t index = nlmsg->nlmsg_seq - (seq0 + first);
+			int error;
+			if (nlmsg->nlmsg_type != NLMSG_ERROR || index >= (uint32_t) n)
+				continue;
+			pending--;
+			error = (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(*nlerr))) ? EIO : -nlerr->error;
+			if (error != 0)
+				(*nfail)++;
+			if (errors != NULL)
+				errors[first + index] = error;
+		}
+	}
+	return n;
+}
+
+/* send all the queued requests and empty the batch.
+ * errors[i] (if errors is not NULL) is the result (0 or errno) of the i-th request.
+ * return the number of failed requests, -1 in case of communication error */
+int ioth_nlbatch_commit(struct ioth_nlbatch *batch, int *errors) {
+	size_t off = 0;
+	uint32_t seq;
+	int first, n, fd;
+	int retval = 0;
+	if (batch == NULL)
+		return errno = EINVAL, -1;
+	if ((fd = ioth_nlsock_get(batch->stack, batch->count, &seq)) < 0)
+		goto err;
+	if (errors != NULL)
+		memset(errors, 0, batch->count * sizeof(errors[0]));
+	for (first = 0; first < batch->count; first += n) {
+		if ((n = nlbatch_window(fd, batch, seq + 1, first, &off, errors, &retval)) < 0)
+			goto err_put;
+	}
+	ioth_nlsock_put(batch->stack, fd, 0);
+	batch->len = 0;
+	batch->count = 0;
+	return retval;
+err_put:
+	ioth_nlsock_put(batch->stack, fd, 1);
+err:
+	batch->len = 0;
+	batch->count = 0;
+	return -1;
+}
@@ -0,0 +1,19 @@
+#ifndef IOTH_NLSOCK_H
+#define IOTH_NLSOCK_H
+#include <stdint.h>
+
+struct ioth;
+
+/* netlink (NETLINK_ROUTE) socket for the control-plane helpers of libioth.
+ * ioth_nlsock_get returns the persistent socket of the stack (created at the first use)
+ * or, if it is in use by another transaction, a temporary socket.
+ * nseq sequence numbers are reserved for the transaction: *seq + 1 ... *seq + nseq.
+ * ioth_nlsock_put ends the transaction: reset != 0 if some replies have not been
+ * read (e.g. an interrupted dump), the persistent socket is closed.
+ * ioth_nlsock_seq reserves nseq more sequence numbers (for transactions whose number
+ * of requests is not known in advance): it returns *seq as defined above. */
+int ioth_nlsock_get(struct ioth *iothstack, uint32_t nseq, uint32_t *seq);
+uint32_t ioth_nlsock_seq(struct ioth *iothstack, uint32_t nseq);
+void ioth_nlsock_put(struct ioth *iothstack, int fd, int reset);
+
+#endif
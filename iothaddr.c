@@ -15,29 +15,196 @@
  *
  */
 
-#include <mhash.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <time.h>
+#include <sys/timerfd.h>
 #include <iothaddr.h>
 
+/* multi-buffer MD5: MD5_LANES messages hashed in parallel (one per vector lane).
+ * vectors are gcc/clang generic vectors: on x86_64 there are an AVX2 and
+ * a default (SSE2) version selected at run time, other architectures use
+ * what the compiler provides (at worst scalar code). */
+#define MD5_LANES 8
+typedef uint32_t md5_vec __attribute__((vector_size(MD5_LANES * sizeof(uint32_t))));
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MD5_TARGET_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define MD5_TARGET_CLONES
+#endif
+
+/* a message is the concatenation of (up to) three parts: name, passwd, otiptime */
+#define MD5_MSGPARTS 3
+struct md5_msg {
+	const void *part[MD5_MSGPARTS];
+	size_t partlen[MD5_MSGPARTS];
+	size_t len;
+};
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+
+static size_t md5_nblocks(size_t len) {
+	return (len + 8) / 64 + 1;
+}
+
+/* the block number "block" of the padded message */
+/* copy the bytes of the message from start to start + size in buf (zero padded) */
+static void md5_msgcopy(const struct md5_msg *m, size_t start, uint8_t *buf, size_t size) {
+	size_t off = 0;
+	memset(buf, 0, size);
+	for (int i = 0; i < MD5_MSGPARTS; off += m->partlen[i], i++) {
+		size_t from = off > start ? off : start;
+		size_t to = off + m->partlen[i] < start + size ? off + m->partlen[i] : start + size;
+		if (from < to)
+			memcpy(buf + (from - start), (const uint8_t *) m->part[i] + (from - off), to - from);
+	}
+}
+
+static void md5_getblock(const struct md5_msg *m, size_t block, uint8_t *buf) {
+	size_t start = block * 64;
+	md5_msgcopy(m, start, buf, 64);
+	if (m->len >= start && m->len < start + 64)
+		buf[m->len - start] = 0x80;
+	if (block == md5_nblocks(m->len) - 1) {
+		uint64_t bits = (uint64_t) m->len << 3;
+		for (int i = 0; i < 8; i++)
+			buf[56 + i] = bits >> (8 * i);
+	}
+}
+
+#define MD5_ROTL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD5_F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x, y, z) (((z) & (x)) | (~(z) & (y)))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+/* W(g) is the g-th word of the block */
+#define MD5_STEP(F, a, b, c, d, x, i, s) \
+	a += F(b, c, d) + md5_k[i] + (x); \
+	a = b + MD5_ROTL(a, s)
+#define MD5_4STEPS(W, F, i, g0, g1, g2, g3, s0, s1, s2, s3) \
+	MD5_STEP(F, a, b, c, d, W(g0), i, s0); \
+	MD5_STEP(F, d, a, b, c, W(g1), i + 1, s1); \
+	MD5_STEP(F, c, d, a, b, W(g2), i + 2, s2); \
+	MD5_STEP(F, b, c, d, a, W(g3), i + 3, s3)
+#define MD5_ROUNDS(W) \
+	MD5_4STEPS(W, MD5_F, 0, 0, 1, 2, 3, 7, 12, 17, 22); \
+	MD5_4STEPS(W, MD5_F, 4, 4, 5, 6, 7, 7, 12, 17, 22); \
+	MD5_4STEPS(W, MD5_F, 8, 8, 9, 10, 11, 7, 12, 17, 22); \
+	MD5_4STEPS(W, MD5_F, 12, 12, 13, 14, 15, 7, 12, 17, 22); \
+	MD5_4STEPS(W, MD5_G, 16, 1, 6, 11, 0, 5, 9, 14, 20); \
+	MD5_4STEPS(W, MD5_G, 20, 5, 10, 15, 4, 5, 9, 14, 20); \
+	MD5_4STEPS(W, MD5_G, 24, 9, 14, 3, 8, 5, 9, 14, 20); \
+	MD5_4STEPS(W, MD5_G, 28, 13, 2, 7, 12, 5, 9, 14, 20); \
+	MD5_4STEPS(W, MD5_H, 32, 5, 8, 11, 14, 4, 11, 16, 23); \
+	MD5_4STEPS(W, MD5_H, 36, 1, 4, 7, 10, 4, 11, 16, 23); \
+	MD5_4STEPS(W, MD5_H, 40, 13, 0, 3, 6, 4, 11, 16, 23); \
+	MD5_4STEPS(W, MD5_H, 44, 9, 12, 15, 2, 4, 11, 16, 23); \
+	MD5_4STEPS(W, MD5_I, 48, 0, 7, 14, 5, 6, 10, 15, 21); \
+	MD5_4STEPS(W, MD5_I, 52, 12, 3, 10, 1, 6, 10, 15, 21); \
+	MD5_4STEPS(W, MD5_I, 56, 8, 15, 6, 13, 6, 10, 15, 21); \
+	MD5_4STEPS(W, MD5_I, 60, 4, 11, 2, 9, 6, 10, 15, 21)
+#define MD5_WVEC(g) w.v[g]
+#define MD5_WSCALAR(g) le32toh(w[g])
+
+/* digest of a single message (no allocation, no vectors) */
+static void md5(const struct md5_msg *m, uint8_t digest[16]) {
+	uint32_t a = 0x67452301, b = 0xefcdab89, c = 0x98badcfe, d = 0x10325476;
+	size_t nblocks = md5_nblocks(m->len);
+	uint32_t w[16];
+	for (size_t block = 0; block < nblocks; block++) {
+		uint32_t aa = a, bb = b, cc = c, dd = d;
+		md5_getblock(m, block, (uint8_t *) w);
+		MD5_ROUNDS(MD5_WSCALAR);
+		a += aa; b += bb; c += cc; d += dd;
+	}
+	uint32_t h[4] = {a, b, c, d};
+	for (int i = 0; i < 16; i++)
+		digest[i] = h[i >> 2] >> (8 * (i & 3));
+}
+
+/* digest of n (<= MD5_LANES) messages */
+MD5_TARGET_CLONES
+static void md5_lanes(const struct md5_msg *m, int n, uint8_t digest[][16]) {
+	md5_vec a = {0}, b = {0}, c = {0}, d = {0};
+	md5_vec nblocks = {0};
+	size_t maxblocks = 0;
+	uint32_t blk[16];
+	a += 0x67452301; b += 0xefcdab89; c += 0x98badcfe; d += 0x10325476;
+	for (int lane = 0; lane < n; lane++) {
+		size_t nb = md5_nblocks(m[lane].len);
+		nblocks[lane] = nb;
+		if (nb > maxblocks) maxblocks = nb;
+	}
+	for (size_t block = 0; block < maxblocks; block++) {
+		/* w.v[j] is the j-th word of the block of all the lanes */
+		union {
+			md5_vec v[16];
+			uint32_t u[16][MD5_LANES];
+		} w = {{{0}}};
+		md5_vec aa = a, bb = b, cc = c, dd = d;
+		md5_vec active = (md5_vec) (nblocks > (uint32_t) block);
+		for (int lane = 0; lane < n; lane++) {
+			if (block >= nblocks[lane])
+				continue;
+			md5_getblock(&m[lane], block, (uint8_t *) blk);
+			for (int j = 0; j < 16; j++)
+				w.u[j][lane] = le32toh(blk[j]);
+		}
+		MD5_ROUNDS(MD5_WVEC);
+		/* the lanes whose message has no more blocks keep their state */
+		a = aa + (a & active); b = bb + (b & active);
+		c = cc + (c & active); d = dd + (d & active);
+	}
+	for (int lane = 0; lane < n; lane++) {
+		uint32_t h[4] = {a[lane], b[lane], c[lane], d[lane]};
+		for (int i = 0; i < 16; i++)
+			digest[lane][i] = h[i >> 2] >> (8 * (i & 3));
+	}
+}
+
+/* the message: name (without the trailing dot), passwd (if not NULL), otiptime (if not NULL) */
+static void iothaddr_msg(struct md5_msg *m, const char *name, const char *passwd,
+		const uint32_t *otiptime_n) {
+	size_t namelen = strlen(name);
+	if (namelen > 0 && name[namelen-1] == '.') namelen--;
+	m->part[0] = name;
+	m->partlen[0] = namelen;
+	m->part[1] = passwd;
+	m->partlen[1] = passwd ? strlen(passwd) : 0;
+	m->part[2] = otiptime_n;
+	m->partlen[2] = otiptime_n ? sizeof(*otiptime_n) : 0;
+	m->len = m->partlen[0] + m->partlen[1] + m->partlen[2];
+}
+
+/* md5 of up to MD5_LANES messages */
+static void iothaddr_md5v(const char **namev, const char **passwdv,
+		const uint32_t *otiptime_n, int n, uint8_t digest[][16]) {
+	struct md5_msg m[MD5_LANES];
+	for (int lane = 0; lane < n; lane++)
+		iothaddr_msg(&m[lane], namev[lane], passwdv ? passwdv[lane] : NULL, otiptime_n);
+	md5_lanes(m, n, digest);
+}
+
 void iothaddr_hash(void *addr, const char *name, const char *passwd, uint32_t otiptime) {
 	struct in6_addr *addr6 = addr;
-	size_t namelen = strlen(name);
-	MHASH td;
-	char out[mhash_get_block_size(MHASH_MD5)];
+	uint32_t otiptime_n = htonl(otiptime);
+	struct md5_msg m;
+	uint8_t out[16];
 	int i;
-	memset(out, 0, mhash_get_block_size(MHASH_MD5));
-	if (name[namelen-1] == '.') namelen--;
-	td=mhash_init(MHASH_MD5);
-	mhash(td, name, namelen);
-	if (passwd != NULL)
-		mhash(td, passwd, strlen(passwd));
-	if (otiptime != 0) {
-		uint32_t otiptime_n = htonl(otiptime);
-		mhash(td, &otiptime_n, sizeof(otiptime_n));
-	}
-	mhash_deinit(td, out);
+	iothaddr_msg(&m, name, passwd, otiptime != 0 ? &otiptime_n : NULL);
+	md5(&m, out);
 	for (i=8; i<16; i++)
 		addr6->s6_addr[i] ^= out[i-8];
 	addr6->s6_addr[8] &= ~0x3;   // locally adm, unicast
@@ -45,23 +212,186 @@ void iothaddr_hash(void *addr, const char *name, const char *passwd, uint32_t ot
 
 void iothaddr_hashmac(void *mac, const char *name, const char *passwd) {
 	unsigned char *umac = mac;
-	size_t namelen = strlen(name);
-	MHASH td;
-	char out[mhash_get_block_size(MHASH_MD5)];
+	struct md5_msg m;
+	uint8_t out[16];
+	int i;
+	iothaddr_msg(&m, name, passwd, NULL);
+	md5(&m, out);
+	for (i=0; i<3; i++)
+		umac[i] = out[i];
+	for (i=3; i<6; i++)
+		umac[i] = out[i+2];
+	umac[0] |= 0x2; // locally adm
+	umac[0] &= ~0x1; // unicast
+}
+
+/* keyed hashes: 8 byte digest of the message (see iothaddr_msg) */
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v) do { \
+	v[0] += v[1]; v[1] = SIP_ROTL(v[1], 13); v[1] ^= v[0]; v[0] = SIP_ROTL(v[0], 32); \
+	v[2] += v[3]; v[3] = SIP_ROTL(v[3], 16); v[3] ^= v[2]; \
+	v[0] += v[3]; v[3] = SIP_ROTL(v[3], 21); v[3] ^= v[0]; \
+	v[2] += v[1]; v[1] = SIP_ROTL(v[1], 17); v[1] ^= v[2]; v[2] = SIP_ROTL(v[2], 32); \
+} while (0)
+
+/* SipHash-2-4, 16 byte key */
+static void siphash(const struct md5_msg *m, const uint8_t *key, uint8_t out[8]) {
+	uint64_t k0, k1, mw;
+	uint64_t v[4];
+	size_t off;
+	memcpy(&k0, key, 8);
+	memcpy(&k1, key + 8, 8);
+	k0 = le64toh(k0);
+	k1 = le64toh(k1);
+	v[0] = k0 ^ 0x736f6d6570736575ULL;
+	v[1] = k1 ^ 0x646f72616e646f6dULL;
+	v[2] = k0 ^ 0x6c7967656e657261ULL;
+	v[3] = k1 ^ 0x7465646279746573ULL;
+	for (off = 0; off + 8 <= m->len; off += 8) {
+		md5_msgcopy(m, off, (uint8_t *) &mw, 8);
+		mw = le64toh(mw);
+		v[3] ^= mw;
+		SIP_ROUND(v); SIP_ROUND(v);
+		v[0] ^= mw;
+	}
+	md5_msgcopy(m, off, (uint8_t *) &mw, 8);
+	mw = le64toh(mw) | ((uint64_t) m->len << 56);
+	v[3] ^= mw;
+	SIP_ROUND(v); SIP_ROUND(v);
+	v[0] ^= mw;
+	v[2] ^= 0xff;
+	SIP_ROUND(v); SIP_ROUND(v); SIP_ROUND(v); SIP_ROUND(v);
+	mw = htole64(v[0] ^ v[1] ^ v[2] ^ v[3]);
+	memcpy(out, &mw, 8);
+}
+
+static const uint32_t blake2s_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint8_t blake2s_sigma[10][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+	{11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+	{7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+	{9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+	{2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+	{12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+	{13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+	{6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+	{10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+};
+
+#define B2S_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define B2S_G(a, b, c, d, x, y) do { \
+	v[a] += v[b] + (x); v[d] = B2S_ROTR(v[d] ^ v[a], 16); \
+	v[c] += v[d]; v[b] = B2S_ROTR(v[b] ^ v[c], 12); \
+	v[a] += v[b] + (y); v[d] = B2S_ROTR(v[d] ^ v[a], 8); \
+	v[c] += v[d]; v[b] = B2S_ROTR(v[b] ^ v[c], 7); \
+} while (0)
+
+static void blake2s_compress(uint32_t h[8], const uint8_t *block, uint64_t t, int last) {
+	uint32_t w[16], v[16];
+	memcpy(w, block, 64);
+	for (int i = 0; i < 16; i++)
+		w[i] = le32toh(w[i]);
+	for (int i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = blake2s_iv[i];
+	}
+	v[12] ^= (uint32_t) t;
+	v[13] ^= (uint32_t) (t >> 32);
+	if (last)
+		v[14] = ~v[14];
+	for (int r = 0; r < 10; r++) {
+		const uint8_t *s = blake2s_sigma[r];
+		B2S_G(0, 4, 8, 12, w[s[0]], w[s[1]]);
+		B2S_G(1, 5, 9, 13, w[s[2]], w[s[3]]);
+		B2S_G(2, 6, 10, 14, w[s[4]], w[s[5]]);
+		B2S_G(3, 7, 11, 15, w[s[6]], w[s[7]]);
+		B2S_G(0, 5, 10, 15, w[s[8]], w[s[9]]);
+		B2S_G(1, 6, 11, 12, w[s[10]], w[s[11]]);
+		B2S_G(2, 7, 8, 13, w[s[12]], w[s[13]]);
+		B2S_G(3, 4, 9, 14, w[s[14]], w[s[15]]);
+	}
+	for (int i = 0; i < 8; i++)
+		h[i] ^= v[i] ^ v[i + 8];
+}
+
+/* BLAKE2s with 8 byte output, key up to 32 bytes */
+static void blake2s(const struct md5_msg *m, const uint8_t *key, size_t keylen, uint8_t out[8]) {
+	uint32_t h[8];
+	uint8_t block[64];
+	size_t off;
+	memcpy(h, blake2s_iv, sizeof(h));
+	h[0] ^= 0x01010000 ^ (keylen << 8) ^ 8;
+	if (keylen > 0) {
+		memset(block, 0, 64);
+		memcpy(block, key, keylen);
+		blake2s_compress(h, block, 64, m->len == 0);
+	}
+	for (off = 0; off + 64 < m->len; off += 64) {
+		md5_msgcopy(m, off, block, 64);
+		blake2s_compress(h, block, (keylen > 0 ? 64 : 0) + off + 64, 0);
+	}
+	if (m->len > 0 || keylen == 0) {
+		md5_msgcopy(m, off, block, 64);
+		blake2s_compress(h, block, (keylen > 0 ? 64 : 0) + m->len, 1);
+	}
+	h[0] = htole32(h[0]);
+	h[1] = htole32(h[1]);
+	memcpy(out, h, 8);
+}
+
+static int iothaddr_keyed(uint8_t out[8], int algo, const void *key, size_t keylen,
+		const char *name, const uint32_t *otiptime_n) {
+	struct md5_msg m;
+	iothaddr_msg(&m, name, NULL, otiptime_n);
+	switch (algo) {
+		case IOTHADDR_SIPHASH:
+			if (keylen != 16)
+				return errno = EINVAL, -1;
+			siphash(&m, key, out);
+			break;
+		case IOTHADDR_BLAKE2S:
+			if (keylen > 32 || (keylen > 0 && key == NULL))
+				return errno = EINVAL, -1;
+			blake2s(&m, key, keylen, out);
+			break;
+		default:
+			return errno = EINVAL, -1;
+	}
+	return 0;
+}
+
+int iothaddr_hash_keyed(void *addr, int algo, const void *key, size_t keylen,
+		const char *name, uint32_t otiptime) {
+	struct in6_addr *addr6 = addr;
+	uint32_t otiptime_n = htonl(otiptime);
+	uint8_t out[8];
+	int i;
+	if (iothaddr_keyed(out, algo, key, keylen, name, otiptime != 0 ? &otiptime_n : NULL) < 0)
+		return -1;
+	for (i=8; i<16; i++)
+		addr6->s6_addr[i] ^= out[i-8];
+	addr6->s6_addr[8] &= ~0x3;   // locally adm, unicast
+	return 0;
+}
+
+int iothaddr_hashmac_keyed(void *mac, int algo, const void *key, size_t keylen,
+		const char *name) {
+	unsigned char *umac = mac;
+	uint8_t out[8];
 	int i;
-	memset(out, 0, mhash_get_block_size(MHASH_MD5));
-	if (name[namelen-1] == '.') namelen--;
-	td=mhash_init(MHASH_MD5);
-	mhash(td, name, namelen);
-	if (passwd != NULL)
-		mhash(td, passwd, strlen(passwd));
-	mhash_deinit(td, out);
+	if (iothaddr_keyed(out, algo, key, keylen, name, NULL) < 0)
+		return -1;
 	for (i=0; i<3; i++)
 		umac[i] = out[i];
 	for (i=3; i<6; i++)
 		umac[i] = out[i+2];
 	umac[0] |= 0x2; // locally adm
 	umac[0] &= ~0x1; // unicast
+	return 0;
 }
 
 void iothaddr_eui64(void *addr, void *mac) {
@@ -82,3 +412,460 @@ void iothaddr_hasheui64(void *addr, const char *name, const char *passwd) {
 	iothaddr_hashmac(mac, name, passwd);
 	iothaddr_eui64(addr, mac);
 }
+
+void iothaddr_hashv(void *addrv, const char **namev, const char **passwdv,
+		uint32_t otiptime, size_t n) {
+	struct in6_addr *addr6 = addrv;
+	uint32_t otiptime_n = htonl(otiptime);
+	uint8_t out[MD5_LANES][16];
+	for (size_t k = 0; k < n; k += MD5_LANES) {
+		int nl = (n - k < MD5_LANES) ? n - k : MD5_LANES;
+		iothaddr_md5v(namev + k, passwdv ? passwdv + k : NULL,
+				otiptime != 0 ? &otiptime_n : NULL, nl, out);
+		for (int lane = 0; lane < nl; lane++) {
+			for (int i=8; i<16; i++)
+				addr6[k + lane].s6_addr[i] ^= out[lane][i-8];
+			addr6[k + lane].s6_addr[8] &= ~0x3;   // locally adm, unicast
+		}
+	}
+}
+
+void iothaddr_hashmacv(void *macv, const char **namev, const char **passwdv, size_t n) {
+	unsigned char (*umac)[6] = macv;
+	uint8_t out[MD5_LANES][16];
+	for (size_t k = 0; k < n; k += MD5_LANES) {
+		int nl = (n - k < MD5_LANES) ? n - k : MD5_LANES;
+		iothaddr_md5v(namev + k, passwdv ? passwdv + k : NULL, NULL, nl, out);
+		for (int lane = 0; lane < nl; lane++) {
+			int i;
+			for (i=0; i<3; i++)
+				umac[k + lane][i] = out[lane][i];
+			for (i=3; i<6; i++)
+				umac[k + lane][i] = out[lane][i+2];
+			umac[k + lane][0] |= 0x2; // locally adm
+			umac[k + lane][0] &= ~0x1; // unicast
+		}
+	}
+}
+
+void iothaddr_hasheui64v(void *addrv, const char **namev, const char **passwdv, size_t n) {
+	struct in6_addr *addr6 = addrv;
+	unsigned char mac[MD5_LANES][6];
+	for (size_t k = 0; k < n; k += MD5_LANES) {
+		int nl = (n - k < MD5_LANES) ? n - k : MD5_LANES;
+		iothaddr_hashmacv(mac, namev + k, passwdv ? passwdv + k : NULL, nl);
+		for (int lane = 0; lane < nl; lane++)
+			iothaddr_eui64(&addr6[k + lane], mac[lane]);
+	}
+}
+
+/* OTIP context: the addresses of the periods current - 1, current, current + 1
+	 are in slot[otiptime % OTIP_SLOTS]. The extra slot is the one written by
+	 iothaddr_otip_update (current + 2) while the others can be read */
+#define OTIP_SLOTS 4
+struct iothaddr_otip_slot {
+	uint32_t otiptime;
+	struct in6_addr addr;
+};
+
+struct iothaddr_otip {
+	struct in6_addr prefix;
+	char *name;
+	char *passwd;
+	int period;
+	int offset;
+	int fd;
+	_Atomic uint32_t current;
+	struct iothaddr_otip_slot slot[OTIP_SLOTS];
+};
+
+static void otip_compute(struct iothaddr_otip *otip, uint32_t otiptime) {
+	struct iothaddr_otip_slot *slot = &otip->slot[otiptime % OTIP_SLOTS];
+	slot->addr = otip->prefix;
+	iothaddr_hash(&slot->addr, otip->name, otip->passwd, otiptime);
+	slot->otiptime = otiptime;
+}
+
+/* time(2) may lag behind the timer (coarse clock) */
+static uint32_t otip_now(struct iothaddr_otip *otip) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint32_t) ((now.tv_sec + otip->offset) / otip->period);
+}
+
+/* the timer expires at the beginning of each period */
+static int otip_settimer(struct iothaddr_otip *otip, uint32_t current) {
+	struct itimerspec timer = {
+		.it_interval.tv_sec = otip->period,
+		.it_value.tv_sec = (time_t) (current + 1) * otip->period - otip->offset,
+	};
+	return timerfd_settime(otip->fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+struct iothaddr_otip *iothaddr_otip_create(const void *prefix, const char *name, const char *passwd,
+		int otip_period, int otip_offset) {
+	struct iothaddr_otip *otip;
+	uint32_t current;
+	if (name == NULL || otip_period <= 0)
+		return errno = EINVAL, NULL;
+	if ((otip = calloc(1, sizeof(*otip))) == NULL)
+		goto err;
+	memcpy(&otip->prefix, prefix, sizeof(otip->prefix));
+	otip->period = otip_period;
+	otip->offset = otip_offset;
+	if ((otip->name = strdup(name)) == NULL)
+		goto err_name;
+	if (passwd != NULL && (otip->passwd = strdup(passwd)) == NULL)
+		goto err_passwd;
+	if ((otip->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		goto err_passwd;
+	current = otip_now(otip);
+	if (otip_settimer(otip, current) < 0)
+		goto err_timer;
+	otip_compute(otip, current - 1);
+	otip_compute(otip, current);
+	otip_compute(otip, current + 1);
+	otip->current = current;
+	return otip;
+err_timer:
+	close(otip->fd);
+err_passwd:
+	free(otip->passwd);
+	free(otip->name);
+err_name:
+	free(otip);
+err:
+	return NULL;
+}
+
+int iothaddr_otip_fd(struct iothaddr_otip *otip) {
+	return otip->fd;
+}
+
+uint32_t iothaddr_otip_get(struct iothaddr_otip *otip, int delta, void *addr) {
+	uint32_t otiptime = otip->current + (delta < 0 ? -1 : delta > 0 ? 1 : 0);
+	struct iothaddr_otip_slot *slot = &otip->slot[otiptime % OTIP_SLOTS];
+	memcpy(addr, &slot->addr, sizeof(slot->addr));
+	return otiptime;
+}
+
+int iothaddr_otip_update(struct iothaddr_otip *otip) {
+	uint64_t expirations;
+	uint32_t current = otip->current;
+	uint32_t now = otip_now(otip);
+	/* clear the notification */
+	if (read(otip->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return -1;
+	if (now == current)
+		return 0;
+	if (now == current + 1)
+		/* the next address has been computed in advance */
+		otip_compute(otip, now + 1);
+	else {
+		/* periods skipped or clock changed */
+		otip_compute(otip, now - 1);
+		otip_compute(otip, now);
+		otip_compute(otip, now + 1);
+		if (otip_settimer(otip, now) < 0)
+			return -1;
+	}
+	otip->current = now;
+	return 1;
+}
+
+void iothaddr_otip_destroy(struct iothaddr_otip *otip) {
+	if (otip != NULL) {
+		close(otip->fd);
+		free(otip->passwd);
+		free(otip->name);
+		free(otip);
+	}
+}
+
+/* reverse index: interface ID (the rightmost 64 bits of the address) or
+	 mac address -> name. Open addressing, linear probing. */
+#define INDEX_MINSIZE 64
+#define INDEX_OTIPWINDOW 3 // current - 1, current, current + 1
+#define INDEX_BATCH 64
+
+struct iothaddr_index_entry {
+	uint64_t key;
+	uint32_t name; // index + 1, 0 = free
+	uint32_t otiptime;
+};
+
+struct iothaddr_index_table {
+	struct iothaddr_index_entry *entry;
+	size_t size; // power of 2
+	size_t count;
+};
+
+struct iothaddr_index {
+	struct in6_addr prefix;
+	int period;
+	int offset;
+	uint32_t current;
+	size_t nnames;
+	size_t maxnames;
+	const char **namev;
+	const char **passwdv;
+	void **datav;
+	uint64_t (*iid)[INDEX_OTIPWINDOW]; // iid[name][otiptime % INDEX_OTIPWINDOW]
+	struct iothaddr_index_table addr;
+	struct iothaddr_index_table mac;
+};
+
+static inline size_t index_slot(struct iothaddr_index_table *t, uint64_t key) {
+	return (key * 0x9e3779b97f4a7c15ULL) >> 32 & (t->size - 1);
+}
+
+static inline uint64_t index_iid(const struct in6_addr *addr) {
+	uint64_t key;
+	memcpy(&key, &addr->s6_addr[8], sizeof(key));
+	return key;
+}
+
+static inline uint64_t index_mackey(const unsigned char *mac) {
+	uint64_t key = 0;
+	memcpy(&key, mac, 6);
+	return key;
+}
+
+static int index_table_resize(struct iothaddr_index_table *t, size_t size) {
+	struct iothaddr_index_table new = {.size = size, .count = t->count};
+	if ((new.entry = calloc(size, sizeof(*new.entry))) == NULL)
+		return -1;
+	for (size_t i = 0; i < t->size; i++) {
+		if (t->entry[i].name != 0) {
+			size_t slot = index_slot(&new, t->entry[i].key);
+			while (new.entry[slot].name != 0)
+				slot = (slot + 1) & (size - 1);
+			new.entry[slot] = t->entry[i];
+		}
+	}
+	free(t->entry);
+	*t = new;
+	return 0;
+}
+
+static int index_table_add(struct iothaddr_index_table *t, uint64_t key, uint32_t name, uint32_t otiptime) {
+	size_t slot;
+	/* load factor <= 1/2 */
+	if ((t->count + 1) * 2 > t->size &&
+			index_table_resize(t, t->size ? t->size * 2 : INDEX_MINSIZE) < 0)
+		return -1;
+	slot = index_slot(t, key);
+	while (t->entry[slot].name != 0)
+		slot = (slot + 1) & (t->size - 1);
+	t->entry[slot] = (struct iothaddr_index_entry) {key, name, otiptime};
+	t->count++;
+	return 0;
+}
+
+static struct iothaddr_index_entry *index_table_find(struct iothaddr_index_table *t, uint64_t key) {
+	if (t->size == 0)
+		return NULL;
+	for (size_t slot = index_slot(t, key); t->entry[slot].name != 0; slot = (slot + 1) & (t->size - 1)) {
+		if (t->entry[slot].key == key)
+			return &t->entry[slot];
+	}
+	return NULL;
+}
+
+/* backward shift deletion: no tombstones */
+static void index_table_del(struct iothaddr_index_table *t, uint64_t key, uint32_t name, uint32_t otiptime) {
+	size_t mask = t->size - 1;
+	size_t slot;
+	if (t->size == 0)
+		return;
+	for (slot = index_slot(t, key); t->entry[slot].name != 0; slot = (slot + 1) & mask) {
+		struct iothaddr_index_entry *e = &t->entry[slot];
+		if (e->key == key && e->name == name && e->otiptime == otiptime)
+			break;
+	}
+	if (t->entry[slot].name == 0)
+		return;
+	for (size_t next = (slot + 1) & mask; t->entry[next].name != 0; next = (next + 1) & mask) {
+		size_t home = index_slot(t, t->entry[next].key);
+		/* move the entry if its home slot is not in (slot, next] */
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			t->entry[slot] = t->entry[next];
+			slot = next;
+		}
+	}
+	t->entry[slot].name = 0;
+	t->count--;
+}
+
+/* compute and add the addresses of the names [first, first + n) for otiptime */
+static int index_addperiod(struct iothaddr_index *idx, size_t first, size_t n, uint32_t otiptime) {
+	struct in6_addr addr[INDEX_BATCH];
+	for (size_t k = 0; k < n; k += INDEX_BATCH) {
+		size_t nb = (n - k < INDEX_BATCH) ? n - k : INDEX_BATCH;
+		for (size_t i = 0; i < nb; i++)
+			addr[i] = idx->prefix;
+		iothaddr_hashv(addr, idx->namev + first + k, idx->passwdv + first + k, otiptime, nb);
+		for (size_t i = 0; i < nb; i++) {
+			size_t name = first + k + i;
+			idx->iid[name][otiptime % INDEX_OTIPWINDOW] = index_iid(&addr[i]);
+			if (index_table_add(&idx->addr, index_iid(&addr[i]), name + 1, otiptime) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static void index_delperiod(struct iothaddr_index *idx, uint32_t otiptime) {
+	for (size_t name = 0; name < idx->nnames; name++)
+		index_table_del(&idx->addr, idx->iid[name][otiptime % INDEX_OTIPWINDOW], name + 1, otiptime);
+}
+
+static uint32_t index_now(struct iothaddr_index *idx) {
+	struct timespec now;
+	if (idx->period == 0)
+		return 0;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint32_t) ((now.tv_sec + idx->offset) / idx->period);
+}
+
+/* the addresses of the names [first, first + n) for all the periods of the window */
+static int index_addnames(struct iothaddr_index *idx, size_t first, size_t n) {
+	if (idx->period == 0)
+		return index_addperiod(idx, first, n, 0);
+	for (int i = -1; i <= 1; i++) {
+		if (index_addperiod(idx, first, n, idx->current + i) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+struct iothaddr_index *iothaddr_index_create(const void *prefix, int otip_period, int otip_offset) {
+	struct iothaddr_index *idx;
+	if (otip_period < 0)
+		return errno = EINVAL, NULL;
+	if ((idx = calloc(1, sizeof(*idx))) == NULL)
+		return NULL;
+	if (prefix != NULL)
+		memcpy(&idx->prefix, prefix, sizeof(idx->prefix));
+	idx->period = otip_period;
+	idx->offset = otip_offset;
+	idx->current = index_now(idx);
+	return idx;
+}
+
+int iothaddr_index_add(struct iothaddr_index *idx, const char *name, const char *passwd, void *data) {
+	size_t n = idx->nnames;
+	unsigned char mac[6];
+	if (n == idx->maxnames) {
+		size_t maxnames = n ? n * 2 : INDEX_BATCH;
+		const char **namev = realloc(idx->namev, maxnames * sizeof(*namev));
+		if (namev) idx->namev = namev;
+		const char **passwdv = realloc(idx->passwdv, maxnames * sizeof(*passwdv));
+		if (passwdv) idx->passwdv = passwdv;
+		void **datav = realloc(idx->datav, maxnames * sizeof(*datav));
+		if (datav) idx->datav = datav;
+		uint64_t (*iid)[INDEX_OTIPWINDOW] = realloc(idx->iid, maxnames * sizeof(*iid));
+		if (iid) idx->iid = iid;
+		if (!namev || !passwdv || !datav || !iid)
+			return errno = ENOMEM, -1;
+		idx->maxnames = maxnames;
+	}
+	if ((idx->namev[n] = strdup(name)) == NULL)
+		return -1;
+	if (passwd == NULL)
+		idx->passwdv[n] = NULL;
+	else if ((idx->passwdv[n] = strdup(passwd)) == NULL)
+		goto err_passwd;
+	idx->datav[n] = data;
+	idx->nnames++;
+	iothaddr_hashmac(mac, name, passwd);
+	if (index_table_add(&idx->mac, index_mackey(mac), n + 1, 0) < 0 ||
+			index_addnames(idx, n, 1) < 0)
+		goto err_table;
+	return 0;
+err_table:
+	/* remove the entries of this name (if any) */
+	index_table_del(&idx->mac, index_mackey(mac), n + 1, 0);
+	if (idx->period == 0)
+		index_table_del(&idx->addr, idx->iid[n][0], n + 1, 0);
+	else {
+		for (int i = -1; i <= 1; i++)
+			index_table_del(&idx->addr, idx->iid[n][(idx->current + i) % INDEX_OTIPWINDOW], n + 1, idx->current + i);
+	}
+	idx->nnames--;
+	free((char *) idx->passwdv[n]);
+err_passwd:
+	free((char *) idx->namev[n]);
+	return errno = ENOMEM, -1;
+}
+
+int iothaddr_index_update(struct iothaddr_index *idx) {
+	uint32_t now = index_now(idx);
+	if (now == idx->current)
+		return 0;
+	if (now == idx->current + 1) {
+		/* rollover: current - 1 expires, current + 2 becomes the next period */
+		index_delperiod(idx, idx->current - 1);
+		idx->current = now;
+		if (index_addperiod(idx, 0, idx->nnames, now + 1) < 0)
+			goto err;
+	} else {
+		/* periods skipped or clock changed: rebuild */
+		if (idx->addr.entry != NULL)
+			memset(idx->addr.entry, 0, idx->addr.size * sizeof(idx->addr.entry[0]));
+		idx->addr.count = 0;
+		idx->current = now;
+		if (index_addnames(idx, 0, idx->nnames) < 0)
+			goto err;
+	}
+	return 1;
+err:
+	/* the next update rebuilds the index */
+	idx->current = now - INDEX_OTIPWINDOW;
+	return -1;
+}
+
+const char *iothaddr_index_lookup(struct iothaddr_index *idx, const void *addr,
+		uint32_t *otiptime, void **data) {
+	const struct in6_addr *addr6 = addr;
+	struct iothaddr_index_entry *e = index_table_find(&idx->addr, index_iid(addr6));
+	if (e == NULL && addr6->s6_addr[11] == 0xff && addr6->s6_addr[12] == 0xfe) {
+		/* EUI64 address (iothaddr_hasheui64) */
+		unsigned char mac[6];
+		for (int i = 0; i < 3; i++)
+			mac[i] = addr6->s6_addr[i + 8];
+		mac[0] ^= 0x2;
+		for (int i = 3; i < 6; i++)
+			mac[i] = addr6->s6_addr[i + 10] ^ idx->prefix.s6_addr[i + 10];
+		e = index_table_find(&idx->mac, index_mackey(mac));
+	}
+	if (e == NULL)
+		return NULL;
+	if (otiptime) *otiptime = e->otiptime;
+	if (data) *data = idx->datav[e->name - 1];
+	return idx->namev[e->name - 1];
+}
+
+const char *iothaddr_index_lookupmac(struct iothaddr_index *idx, const void *mac, void **data) {
+	struct iothaddr_index_entry *e = index_table_find(&idx->mac, index_mackey(mac));
+	if (e == NULL)
+		return NULL;
+	if (data) *data = idx->datav[e->name - 1];
+	return idx->namev[e->name - 1];
+}
+
+void iothaddr_index_destroy(struct iothaddr_index *idx) {
+	if (idx != NULL) {
+		for (size_t i = 0; i < idx->nnames; i++) {
+			free((char *) idx->namev[i]);
+			free((char *) idx->passwdv[i]);
+		}
+		free(idx->namev);
+		free(idx->passwdv);
+		free(idx->datav);
+		free(idx->iid);
+		free(idx->addr.entry);
+		free(idx->mac.entry);
+		free(idx);
+	}
+}
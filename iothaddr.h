@@ -1,6 +1,7 @@
 #ifndef IOTHADDR_H
 #define IOTHADDR_H
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 
 /* hash based IPv6 address:
@@ -25,6 +26,44 @@ static inline uint32_t iothaddr_otiptime(int otip_period, int otip_offset) {
 	return (uint32_t) ((time(NULL) + otip_offset) / otip_period);
 }
 
+/* OTIP context: the OTIP addresses (see iothaddr_hash) of the previous, current and next
+	 periods of name/passwd, computed in advance.
+	 prefix is the IPv6 prefix (16 bytes, as addr of iothaddr_hash),
+	 otip_period and otip_offset as in iothaddr_otiptime (otip_period must be > 0).
+	 iothaddr_otip_get copies in addr the address of the previous (delta < 0), current (delta == 0)
+	 or next (delta > 0) period and returns its otiptime: it does not call time nor compute hashes.
+	 iothaddr_otip_fd returns a file descriptor which is readable (poll/select) when a new period
+	 begins: then iothaddr_otip_update must be called. It switches to the new period, computes the
+	 address of the period after it and returns 1 (0 if the period has not changed, -1 in case
+	 of error). The application should then bind the new current address. */
+struct iothaddr_otip;
+struct iothaddr_otip *iothaddr_otip_create(const void *prefix, const char *name, const char *passwd,
+		int otip_period, int otip_offset);
+uint32_t iothaddr_otip_get(struct iothaddr_otip *otip, int delta, void *addr);
+int iothaddr_otip_fd(struct iothaddr_otip *otip);
+int iothaddr_otip_update(struct iothaddr_otip *otip);
+void iothaddr_otip_destroy(struct iothaddr_otip *otip);
+
+/* reverse index: from a hash based address (or mac address) to the name.
+	 prefix is the IPv6 prefix of the addresses (NULL means ::).
+	 otip_period and otip_offset as in iothaddr_otiptime, otip_period == 0 means no OTIP.
+	 The index includes, for each name, the addresses of the previous, current and next
+	 OTIP periods: iothaddr_index_update must be called when a new period begins
+	 (see iothaddr_otip_fd); it returns 1 if the period has changed, 0 otherwise, -1 on error.
+	 iothaddr_index_lookup finds the name of an address computed by iothaddr_hash
+	 (*otiptime is its OTIP period) or by iothaddr_hasheui64 (*otiptime is 0),
+	 iothaddr_index_lookupmac the name of a mac address computed by iothaddr_hashmac.
+	 Both return NULL if the address is unknown, *data is the data argument of iothaddr_index_add.
+	 otiptime and data can be NULL. */
+struct iothaddr_index;
+struct iothaddr_index *iothaddr_index_create(const void *prefix, int otip_period, int otip_offset);
+int iothaddr_index_add(struct iothaddr_index *idx, const char *name, const char *passwd, void *data);
+int iothaddr_index_update(struct iothaddr_index *idx);
+const char *iothaddr_index_lookup(struct iothaddr_index *idx, const void *addr,
+		uint32_t *otiptime, void **data);
+const char *iothaddr_index_lookupmac(struct iothaddr_index *idx, const void *mac, void **data);
+void iothaddr_index_destroy(struct iothaddr_index *idx);
+
 /* hash based mac address
 	 Let H be the md5sum of the concatenation of:
  * name
@@ -34,11 +73,25 @@ static inline uint32_t iothaddr_otiptime(int otip_period, int otip_offset) {
  (the first byte has the 7th bit set and the 8th cleared: locally adm unicast address)
  e.g. name = "test.v2.cs.unibo.it", passwd = NULL
  the md5sum of "test.v2.cs.unibo.it" is 69d62fac095a5a2ee4c2c79f211e57e3
- the mac address is: 69:d6:2f:5a:5a:2e */
+ the mac address is: 6a:d6:2f:5a:5a:2e */
 /* Hash based defined MAC address can avoid delays due to old info in arp tables
 	 for process migration or restarting */
 void iothaddr_hashmac(void *mac, const char *name, const char *passwd);
 
+/* keyed hash based addresses, for deployments which do not need the compatibility
+	 with the md5 based addresses above.
+	 The 8 byte digest (IOTHADDR_SIPHASH: SipHash-2-4, key is 16 bytes long;
+	 IOTHADDR_BLAKE2S: BLAKE2s with 8 byte output, key is up to 32 bytes long)
+	 of name (without the trailing dot) followed by the big-endian 4 byte representation
+	 of otiptime (if otiptime != 0) replaces the md5sum in iothaddr_hash and iothaddr_hashmac.
+	 They return 0, or -1 and errno = EINVAL if algo or keylen are not valid. */
+#define IOTHADDR_SIPHASH 1
+#define IOTHADDR_BLAKE2S 2
+int iothaddr_hash_keyed(void *addr, int algo, const void *key, size_t keylen,
+		const char *name, uint32_t otiptime);
+int iothaddr_hashmac_keyed(void *mac, int algo, const void *key, size_t keylen,
+		const char *name);
+
 /* compute the EUI64 based IPv6 address from the mac address.
 	 the rightmost 64 bits of the address are XORed with the EUI64 extension
 	 of the 6 bytes mac address. */
@@ -48,8 +101,18 @@ void iothaddr_eui64(void *addr, void *mac);
 	 This function computes iothaddr_eui64 on the result of iothaddr_hashmac */
 /* e.g. addr: 2000:760::/64, name = "test.v2.cs.unibo.it", passwd = NULL
 	 the md5sum of "test.v2.cs.unibo.it" is 69d62fac095a5a2ee4c2c79f211e57e3
-	 the mac address is: 69:d6:2f:5a:5a:2e
+	 the mac address is: 6a:d6:2f:5a:5a:2e
 	 The resulting address is 2000:760::68d6:2fff:fe5a:5a2e */
 void iothaddr_hasheui64(void *addr, const char *name, const char *passwd);
 
+/* bulk versions: n addresses computed by a multi-buffer (SIMD) MD5.
+	 addrv is an array of n IPv6 addresses (16 bytes each, initialized to the prefixes),
+	 macv an array of n mac addresses (6 bytes each).
+	 namev is an array of n names, passwdv an array of n passwords (NULL elements allowed)
+	 or NULL (no passwords). The results are the same as those of the functions above. */
+void iothaddr_hashv(void *addrv, const char **namev, const char **passwdv,
+		uint32_t otiptime, size_t n);
+void iothaddr_hashmacv(void *macv, const char **namev, const char **passwdv, size_t n);
+void iothaddr_hasheui64v(void *addrv, const char **namev, const char **passwdv, size_t n);
+
 #endif
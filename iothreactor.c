@@ -0,0 +1,490 @@
+/*
+ *   libioth: choose your networking library as a plugin at run time.
+ *   iothreactor: event loops for ioth sockets
+ *
+ *   Copyright (C) 2021  Renzo Davoli <renzo@cs.unibo.it> VirtualSquare team.
+ *
+ *   This library is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or (at
+ *   your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <ioth.h>
+#include <iothreactor.h>
+
+#define REACTOR_MAXEVENTS 64
+#define REACTOR_BUFSIZE 65536
+#define REACTOR_ACCEPTBATCH 16 // accept at most this number of connections per event
+#define REACTOR_RUNBATCH 64    // run at most this number of connections between two epoll_wait
+
+/* a connection (or a listening socket, if accept_cb != NULL).
+ * A ready connection is owned by the thread which runs it until it is armed again
+ * (EPOLLONESHOT) */
+struct iothreactor_conn {
+	struct iothreactor *reactor;
+	struct iothreactor_loop *loop; // the conn is in the epoll set of this loop
+	int fd;
+	uint32_t revents;
+	int armed;
+	int closing;
+	iothreactor_accept_cb *accept_cb;
+	void *arg;
+	iothreactor_read_cb *read_cb;
+	void *data;
+	char *outbuf; // pending output: outbuf[outoff..outlen)
+	size_t outoff;
+	size_t outlen;
+	size_t outsize;
+	struct iothreactor_conn *runnext;
+	struct iothreactor_conn *prev, *next; // all the conns of the reactor
+};
+
+struct iothreactor_loop {
+	struct iothreactor *reactor;
+	pthread_t thread;
+	int epfd;
+	int wakefd;
+	int idle; // waiting for events, it can be woken up to steal work
+	pthread_mutex_t mutex; // run queue
+	struct iothreactor_conn *head, *tail;
+	char buf[REACTOR_BUFSIZE];
+};
+
+struct iothreactor {
+	int stop;
+	pthread_mutex_t mutex; // conns
+	struct iothreactor_conn *conns;
+	cpu_set_t cpus;
+	int nloops;
+	struct iothreactor_loop loops[];
+};
+
+static int setnonblock(int fd) {
+	int flags = ioth_fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	return ioth_fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* conns */
+static struct iothreactor_conn *conn_new(struct iothreactor *reactor,
+		struct iothreactor_loop *loop, int fd) {
+	struct iothreactor_conn *conn = calloc(1, sizeof(*conn));
+	if (conn == NULL)
+		return NULL;
+	conn->reactor = reactor;
+	conn->loop = loop;
+	conn->fd = fd;
+	pthread_mutex_lock(&reactor->mutex);
+	conn->next = reactor->conns;
+	if (reactor->conns != NULL)
+		reactor->conns->prev = conn;
+	reactor->conns = conn;
+	pthread_mutex_unlock(&reactor->mutex);
+	return conn;
+}
+
+static void conn_unlink(struct iothreactor_conn *conn) {
+	struct iothreactor *reactor = conn->reactor;
+	pthread_mutex_lock(&reactor->mutex);
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		reactor->conns = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+	pthread_mutex_unlock(&reactor->mutex);
+}
+
+static void conn_free(struct iothreactor_conn *conn) {
+	conn_unlink(conn);
+	if (conn->armed)
+		epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	ioth_close(conn->fd);
+	free(conn->outbuf);
+	free(conn);
+}
+
+/* the pending output cannot be sent any more */
+static void conn_drop(struct iothreactor_conn *conn) {
+	conn->outoff = conn->outlen = 0;
+	conn->closing = 1;
+}
+
+static int conn_arm(struct iothreactor_conn *conn) {
+	int reading = conn->read_cb != NULL && !conn->closing;
+	struct epoll_event ev = {
+		.events = EPOLLONESHOT | (reading ? EPOLLIN | EPOLLRDHUP : 0) |
+			(conn->outoff < conn->outlen ? EPOLLOUT : 0),
+		.data.ptr = conn,
+	};
+	int op = conn->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	conn->armed = 1;
+	return epoll_ctl(conn->loop->epfd, op, conn->fd, &ev);
+}
+
+/* the callbacks of conn have been run: close it or wait for its next events.
+ * conn must not be used after this call */
+static void conn_done(struct iothreactor_conn *conn) {
+	if (conn->closing && conn->outoff == conn->outlen)
+		conn_free(conn);
+	else if (conn_arm(conn) < 0)
+		conn_free(conn);
+}
+
+/* send the pending output: 0 if all sent or the socket is not writable, -1 in case of error */
+static int conn_flush(struct iothreactor_conn *conn) {
+	while (conn->outoff < conn->outlen) {
+		ssize_t n = ioth_send(conn->fd, conn->outbuf + conn->outoff,
+				conn->outlen - conn->outoff, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		conn->outoff += n;
+	}
+	conn->outoff = conn->outlen = 0;
+	return 0;
+}
+
+static void conn_read(struct iothreactor_conn *conn, char *buf) {
+	ssize_t n = ioth_recv(conn->fd, buf, REACTOR_BUFSIZE, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	conn->read_cb(conn, buf, n);
+	if (n <= 0)
+		conn->closing = 1;
+}
+
+static void conn_run(struct iothreactor_loop *loop, struct iothreactor_conn *conn) {
+	uint32_t revents = conn->revents;
+	if ((revents & EPOLLOUT) && conn_flush(conn) < 0)
+		conn_drop(conn);
+	if (conn->read_cb != NULL && !conn->closing &&
+			(revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		conn_read(conn, loop->buf);
+	else if (revents & (EPOLLHUP | EPOLLERR))
+		conn_drop(conn);
+	conn_done(conn);
+}
+
+/* run queues */
+static void runq_push(struct iothreactor_loop *loop, struct iothreactor_conn *conn) {
+	conn->runnext = NULL;
+	pthread_mutex_lock(&loop->mutex);
+	if (loop->tail != NULL)
+		loop->tail->runnext = conn;
+	else
+		__atomic_store_n(&loop->head, conn, __ATOMIC_SEQ_CST);
+	loop->tail = conn;
+	pthread_mutex_unlock(&loop->mutex);
+}
+
+static struct iothreactor_conn *runq_pop(struct iothreactor_loop *loop) {
+	struct iothreactor_conn *conn;
+	if (__atomic_load_n(&loop->head, __ATOMIC_SEQ_CST) == NULL)
+		return NULL;
+	pthread_mutex_lock(&loop->mutex);
+	conn = loop->head;
+	if (conn != NULL) {
+		__atomic_store_n(&loop->head, conn->runnext, __ATOMIC_SEQ_CST);
+		if (loop->head == NULL)
+			loop->tail = NULL;
+	}
+	pthread_mutex_unlock(&loop->mutex);
+	return conn;
+}
+
+/* take a ready conn from the run queue of another loop */
+static struct iothreactor_conn *loop_steal(struct iothreactor_loop *loop) {
+	struct iothreactor *reactor = loop->reactor;
+	int index = loop - reactor->loops;
+	for (int i = 1; i < reactor->nloops; i++) {
+		struct iothreactor_conn *conn = runq_pop(&reactor->loops[(index + i) % reactor->nloops]);
+		if (conn != NULL)
+			return conn;
+	}
+	return NULL;
+}
+
+static void loop_wake(struct iothreactor_loop *loop) {
+	uint64_t one = 1;
+	if (write(loop->wakefd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/* loop has queued more conns than it can run: wake up an idle loop */
+static void loop_wakeidle(struct iothreactor_loop *loop) {
+	struct iothreactor *reactor = loop->reactor;
+	for (int i = 0; i < reactor->nloops; i++) {
+		struct iothreactor_loop *other = &reactor->loops[i];
+		if (other != loop && __atomic_exchange_n(&other->idle, 0, __ATOMIC_SEQ_CST)) {
+			loop_wake(other);
+			return;
+		}
+	}
+}
+
+static void loop_accept(struct iothreactor_loop *loop, struct iothreactor_conn *listener) {
+	for (int i = 0; i < REACTOR_ACCEPTBATCH; i++) {
+		struct iothreactor_conn *conn;
+		int fd = ioth_accept(listener->fd, NULL, NULL);
+		if (fd < 0)
+			return;
+		if (setnonblock(fd) < 0 ||
+				(conn = conn_new(loop->reactor, loop, fd)) == NULL) {
+			ioth_close(fd);
+			continue;
+		}
+		listener->accept_cb(conn, listener->arg);
+		conn_done(conn);
+	}
+}
+
+static void *loop_main(void *arg) {
+	struct iothreactor_loop *loop = arg;
+	struct iothreactor *reactor = loop->reactor;
+	struct epoll_event events[REACTOR_MAXEVENTS];
+	struct iothreactor_conn *conn;
+	while (!__atomic_load_n(&reactor->stop, __ATOMIC_SEQ_CST)) {
+		int timeout = 0;
+		int n, queued = 0;
+		/* nothing to run: steal or wait (idle loops can be woken up by busy loops) */
+		if (__atomic_load_n(&loop->head, __ATOMIC_SEQ_CST) == NULL) {
+			__atomic_store_n(&loop->idle, 1, __ATOMIC_SEQ_CST);
+			if ((conn = loop_steal(loop)) != NULL) {
+				__atomic_store_n(&loop->idle, 0, __ATOMIC_SEQ_CST);
+				conn_run(loop, conn);
+				continue;
+			}
+			timeout = -1;
+		}
+		n = epoll_wait(loop->epfd, events, REACTOR_MAXEVENTS, timeout);
+		__atomic_store_n(&loop->idle, 0, __ATOMIC_SEQ_CST);
+		for (int i = 0; i < n; i++) {
+			conn = events[i].data.ptr;
+			if (conn == NULL) {
+				uint64_t count;
+				if (read(loop->wakefd, &count, sizeof(count)) < 0)
+					continue;
+			} else if (conn->accept_cb != NULL)
+				loop_accept(loop, conn);
+			else {
+				conn->revents = events[i].events;
+				runq_push(loop, conn);
+				queued++;
+			}
+		}
+		if (queued > 1)
+			loop_wakeidle(loop);
+		for (int i = 0; i < REACTOR_RUNBATCH && (conn = runq_pop(loop)) != NULL; i++)
+			conn_run(loop, conn);
+	}
+	return NULL;
+}
+
+/* reactor */
+struct iothreactor *iothreactor_new(int nloops) {
+	struct iothreactor *reactor;
+	cpu_set_t cpus;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+		return NULL;
+	if (nloops <= 0)
+		nloops = CPU_COUNT(&cpus);
+	reactor = calloc(1, sizeof(*reactor) + nloops * sizeof(reactor->loops[0]));
+	if (reactor == NULL)
+		return NULL;
+	pthread_mutex_init(&reactor->mutex, NULL);
+	reactor->cpus = cpus;
+	reactor->nloops = nloops;
+	for (int i = 0; i < nloops; i++) {
+		struct iothreactor_loop *loop = &reactor->loops[i];
+		loop->reactor = reactor;
+		loop->epfd = loop->wakefd = -1;
+		pthread_mutex_init(&loop->mutex, NULL);
+	}
+	for (int i = 0; i < nloops; i++) {
+		struct iothreactor_loop *loop = &reactor->loops[i];
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+		if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			goto err;
+		if ((loop->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+			goto err;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) < 0)
+			goto err;
+	}
+	return reactor;
+err:
+	iothreactor_free(reactor);
+	return NULL;
+}
+
+int iothreactor_listen(struct iothreactor *reactor, int fd, iothreactor_accept_cb *cb, void *arg) {
+	struct iothreactor_conn *listener;
+	/* EPOLLEXCLUSIVE: each connection request wakes up one loop (or a few) */
+	struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE};
+	int i;
+	if (cb == NULL)
+		return errno = EINVAL, -1;
+	if (setnonblock(fd) < 0)
+		return -1;
+	if ((listener = conn_new(reactor, NULL, fd)) == NULL)
+		return -1;
+	listener->accept_cb = cb;
+	listener->arg = arg;
+	ev.data.ptr = listener;
+	for (i = 0; i < reactor->nloops; i++) {
+		if (epoll_ctl(reactor->loops[i].epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			goto err;
+	}
+	return 0;
+err:
+	while (i-- > 0)
+		epoll_ctl(reactor->loops[i].epfd, EPOLL_CTL_DEL, fd, NULL);
+	conn_unlink(listener);
+	free(listener);
+	return -1;
+}
+
+/* the thread of the i-th loop runs on the i-th allowed processor */
+int iothreactor_run(struct iothreactor *reactor) {
+	int ncpus = CPU_COUNT(&reactor->cpus);
+	int cpu = -1;
+	int i, retval = 0;
+	for (i = 0; i < reactor->nloops; i++) {
+		pthread_attr_t attr;
+		cpu_set_t cpuset;
+		pthread_attr_init(&attr);
+		if (i % ncpus == 0)
+			cpu = -1;
+		while (!CPU_ISSET(++cpu, &reactor->cpus))
+			;
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+		retval = pthread_create(&reactor->loops[i].thread, &attr, loop_main, &reactor->loops[i]);
+		pthread_attr_destroy(&attr);
+		if (retval != 0) {
+			iothreactor_stop(reactor);
+			break;
+		}
+	}
+	while (i-- > 0)
+		pthread_join(reactor->loops[i].thread, NULL);
+	if (retval != 0)
+		return errno = retval, -1;
+	return 0;
+}
+
+void iothreactor_stop(struct iothreactor *reactor) {
+	__atomic_store_n(&reactor->stop, 1, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < reactor->nloops; i++)
+		loop_wake(&reactor->loops[i]);
+}
+
+void iothreactor_free(struct iothreactor *reactor) {
+	struct iothreactor_conn *conn, *next;
+	if (reactor == NULL)
+		return;
+	for (conn = reactor->conns; conn != NULL; conn = next) {
+		next = conn->next;
+		ioth_close(conn->fd);
+		free(conn->outbuf);
+		free(conn);
+	}
+	for (int i = 0; i < reactor->nloops; i++) {
+		struct iothreactor_loop *loop = &reactor->loops[i];
+		if (loop->epfd >= 0)
+			close(loop->epfd);
+		if (loop->wakefd >= 0)
+			close(loop->wakefd);
+		pthread_mutex_destroy(&loop->mutex);
+	}
+	pthread_mutex_destroy(&reactor->mutex);
+	free(reactor);
+}
+
+/* conn */
+int iothreactor_read_start(struct iothreactor_conn *conn, iothreactor_read_cb *cb) {
+	if (cb == NULL)
+		return errno = EINVAL, -1;
+	conn->read_cb = cb;
+	return 0;
+}
+
+void iothreactor_read_stop(struct iothreactor_conn *conn) {
+	conn->read_cb = NULL;
+}
+
+int iothreactor_write(struct iothreactor_conn *conn, const void *buf, size_t len) {
+	const char *data = buf;
+	if (conn->closing)
+		return errno = EPIPE, -1;
+	/* nothing pending: try to send now */
+	while (len > 0 && conn->outoff == conn->outlen) {
+		ssize_t n = ioth_send(conn->fd, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			conn_drop(conn);
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	if (len > 0) {
+		if (conn->outoff > 0) {
+			memmove(conn->outbuf, conn->outbuf + conn->outoff, conn->outlen - conn->outoff);
+			conn->outlen -= conn->outoff;
+			conn->outoff = 0;
+		}
+		if (conn->outlen + len > conn->outsize) {
+			size_t newsize = conn->outsize ? conn->outsize : REACTOR_BUFSIZE;
+			char *newbuf;
+			while (newsize < conn->outlen + len)
+				newsize *= 2;
+			if ((newbuf = realloc(conn->outbuf, newsize)) == NULL)
+				return errno = ENOMEM, -1;
+			conn->outbuf = newbuf;
+			conn->outsize = newsize;
+		}
+		memcpy(conn->outbuf + conn->outlen, data, len);
+		conn->outlen += len;
+	}
+	return 0;
+}
+
+void iothreactor_close(struct iothreactor_conn *conn) {
+	conn->closing = 1;
+}
+
+int iothreactor_fd(struct iothreactor_conn *conn) {
+	return conn->fd;
+}
+
+void iothreactor_setdata(struct iothreactor_conn *conn, void *data) {
+	conn->data = data;
+}
+
+void *iothreactor_getdata(struct iothreactor_conn *conn) {
+	return conn->data;
+}
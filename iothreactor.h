@@ -0,0 +1,50 @@
+#ifndef IOTHREACTOR_H
+#define IOTHREACTOR_H
+#include <sys/types.h>
+
+/* reactor: event loops serving the connections of ioth sockets (of any stack)
+	 using a few threads, instead of a thread per connection.
+	 There is an event loop for each thread (nloops, 0 = one for each processor)
+	 whose threads are bound to the processors. Each loop waits for the events of
+	 its connections by epoll (ioth file descriptors are real file descriptors):
+	 a ready connection is queued in the run queue of its loop, idle loops steal
+	 ready connections from the run queues of the busy ones.
+	 The callbacks of a connection are never run concurrently (but they can be
+	 run by different threads): the stacks must be thread safe (IOTH_CAP_THREADSAFE). */
+struct iothreactor;
+struct iothreactor_conn;
+
+/* a new connection has been accepted: typically the callback sets the private
+	 data of the connection and calls iothreactor_read_start */
+typedef void iothreactor_accept_cb(struct iothreactor_conn *conn, void *arg);
+/* data received: len > 0 bytes in buf (valid during the call only),
+	 len == 0 end of file, len == -1 error (errno).
+	 After end of file or error the reactor closes the connection
+	 (the data already passed to iothreactor_write is sent before closing) */
+typedef void iothreactor_read_cb(struct iothreactor_conn *conn, void *buf, ssize_t len);
+
+struct iothreactor *iothreactor_new(int nloops);
+/* fd is a listening ioth socket (see ioth_listen), it is set non-blocking.
+	 Each accepted connection is assigned to the loop that accepted it */
+int iothreactor_listen(struct iothreactor *reactor, int fd, iothreactor_accept_cb *cb, void *arg);
+/* run the loops, return when iothreactor_stop is called */
+int iothreactor_run(struct iothreactor *reactor);
+/* can be called by any thread or callback */
+void iothreactor_stop(struct iothreactor *reactor);
+/* close all the connections and the listening sockets */
+void iothreactor_free(struct iothreactor *reactor);
+
+/* the following functions can be called only by the callbacks of conn
+	 (or by the accept callback which created it) */
+int iothreactor_read_start(struct iothreactor_conn *conn, iothreactor_read_cb *cb);
+void iothreactor_read_stop(struct iothreactor_conn *conn);
+/* send the data, what cannot be sent now is copied and sent when
+	 the socket is writable. return 0 or -1 (errno) */
+int iothreactor_write(struct iothreactor_conn *conn, const void *buf, size_t len);
+/* close conn when all the pending data has been sent */
+void iothreactor_close(struct iothreactor_conn *conn);
+int iothreactor_fd(struct iothreactor_conn *conn);
+void iothreactor_setdata(struct iothreactor_conn *conn, void *data);
+void *iothreactor_getdata(struct iothreactor_conn *conn);
+
+#endif
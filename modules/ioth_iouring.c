@@ -0,0 +1,482 @@
+/*
+ *   libioth: choose your networking library as a plugin at run time.
+ *   plugin for the kernel stack using io_uring for the data path
+ *
+ *   Copyright (C) 2020  Renzo Davoli <renzo@cs.unibo.it> VirtualSquare team.
+ *
+ *   This library is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or (at
+ *   your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <ioth.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* io_uring ring per thread (and per stack):
+ * "iouring" or e.g. "iouring,sqpoll,entries=64"
+ * sqpoll[=idle_ms]: a kernel thread polls the submission queue,
+ *   completions are polled for a while before waiting in io_uring_enter.
+ * entries=n: size of the submission queue. */
+
+#define DEFAULT_ENTRIES 8
+#define MAX_ENTRIES 4096
+#define DEFAULT_SQPOLL_IDLE 1000 // ms
+#define SQPOLL_SPIN 4096 // completion polling iterations (sqpoll)
+
+struct uring {
+	struct uring *next;
+	struct iouring *stack;
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_flags;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring_ptr;
+	size_t ring_size;
+	size_t sqes_size;
+	uint64_t seq;
+};
+
+struct iouring {
+	pthread_key_t key;
+	pthread_mutex_t mutex;
+	struct uring *rings; // the rings of all the threads
+	unsigned int entries;
+	int sqpoll;
+	unsigned int sqpoll_idle;
+};
+
+static typeof(getstackdata_prototype) *getstackdata;
+
+static inline int io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_free(struct uring *r) {
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->ring_ptr, r->ring_size);
+	close(r->fd);
+	free(r);
+}
+
+static struct uring *uring_new(struct iouring *stack) {
+	struct io_uring_params p;
+	struct uring *r = calloc(1, sizeof(*r));
+	char *ptr;
+	if (r == NULL)
+		goto err_uring;
+	memset(&p, 0, sizeof(p));
+	if (stack->sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = stack->sqpoll_idle;
+		/* all the rings of the stack share the same kernel polling thread */
+		if (stack->rings != NULL) {
+			p.flags |= IORING_SETUP_ATTACH_WQ;
+			p.wq_fd = stack->rings->fd;
+		}
+	}
+	if ((r->fd = io_uring_setup(stack->entries, &p)) < 0)
+		goto err_setup;
+	/* sq and cq rings share the same mapping (IORING_FEAT_SINGLE_MMAP, linux >= 5.4) */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS;
+		goto err_mmap;
+	}
+	r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	if (r->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		r->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ring_ptr = mmap(0, r->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->ring_ptr == MAP_FAILED)
+		goto err_mmap;
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(0, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_sqes;
+	ptr = r->ring_ptr;
+	r->sq_entries = p.sq_entries;
+	r->sq_head = (void *) (ptr + p.sq_off.head);
+	r->sq_tail = (void *) (ptr + p.sq_off.tail);
+	r->sq_mask = (void *) (ptr + p.sq_off.ring_mask);
+	r->sq_flags = (void *) (ptr + p.sq_off.flags);
+	r->sq_array = (void *) (ptr + p.sq_off.array);
+	r->cq_head = (void *) (ptr + p.cq_off.head);
+	r->cq_tail = (void *) (ptr + p.cq_off.tail);
+	r->cq_mask = (void *) (ptr + p.cq_off.ring_mask);
+	r->cqes = (void *) (ptr + p.cq_off.cqes);
+	r->stack = stack;
+	return r;
+err_sqes:
+	munmap(r->ring_ptr, r->ring_size);
+err_mmap:
+	close(r->fd);
+err_setup:
+	free(r);
+err_uring:
+	return NULL;
+}
+
+/* thread termination: delete the ring of the thread */
+static void uring_destructor(void *arg) {
+	struct uring *r = arg;
+	struct iouring *stack = r->stack;
+	struct uring **scan;
+	int found = 0;
+	pthread_mutex_lock(&stack->mutex);
+	for (scan = &stack->rings; *scan != NULL; scan = &((*scan)->next)) {
+		if (*scan == r) {
+			*scan = r->next;
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stack->mutex);
+	/* otherwise ioth_iouring_delstack has already freed it */
+	if (found)
+		uring_free(r);
+}
+
+/* the ring of the current thread, NULL if io_uring is not available */
+static struct uring *uring_get(void) {
+	struct iouring *stack = getstackdata();
+	struct uring *r = pthread_getspecific(stack->key);
+	if (r == NULL) {
+		pthread_mutex_lock(&stack->mutex);
+		if ((r = uring_new(stack)) != NULL) {
+			r->next = stack->rings;
+			stack->rings = r;
+			pthread_setspecific(stack->key, r);
+		}
+		pthread_mutex_unlock(&stack->mutex);
+	}
+	return r;
+}
+
+static void uring_queue(struct uring *r, struct io_uring_sqe *sqe) {
+	unsigned int tail = *r->sq_tail;
+	unsigned int index = tail & *r->sq_mask;
+	r->sqes[index] = *sqe;
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* search the completion of user_data, other completions are discarded */
+static int uring_reap(struct uring *r, uint64_t user_data, int *res) {
+	unsigned int head = *r->cq_head;
+	int found = 0;
+	while (!found && head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		if (cqe->user_data == user_data) {
+			*res = cqe->res;
+			found = 1;
+		}
+		head++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return found;
+}
+
+/* submit and wait in a single io_uring_enter.
+ * sqpoll: no system call is needed to submit, completions are polled
+ * for a while before waiting */
+static int uring_wait(struct uring *r, uint64_t user_data, int *res) {
+	int spin;
+	for (spin = 0; r->stack->sqpoll && spin < SQPOLL_SPIN; spin++) {
+		if (uring_reap(r, user_data, res))
+			return 0;
+	}
+	for (;;) {
+		unsigned int flags = IORING_ENTER_GETEVENTS;
+		unsigned int to_submit = 0;
+		int n;
+		if (uring_reap(r, user_data, res))
+			return 0;
+		if (r->stack->sqpoll) {
+			/* the new tail must be visible before checking if the poller sleeps */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+				flags |= IORING_ENTER_SQ_WAKEUP;
+		} else
+			to_submit = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		if ((n = io_uring_enter(r->fd, to_submit, 1, flags)) < 0)
+			return -1;
+		/* when some requests have been submitted the interruption of the
+			 wait is not reported: the completion queue is empty */
+		if (n > 0 && *r->cq_head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+			return errno = EINTR, -1;
+	}
+}
+
+/* run a single operation and wait for its completion (system call semantics).
+ * A signal cancels the operation: EINTR, as the system call would do */
+static long uring_op(struct uring *r, struct io_uring_sqe *sqe) {
+	int res;
+	sqe->user_data = ++r->seq;
+	uring_queue(r, sqe);
+	if (uring_wait(r, sqe->user_data, &res) < 0) {
+		struct io_uring_sqe cancel = {
+			.opcode = IORING_OP_ASYNC_CANCEL,
+			.fd = -1,
+			.addr = sqe->user_data,
+			.user_data = ++r->seq
+		};
+		int err = errno;
+		uring_queue(r, &cancel);
+		while (uring_wait(r, sqe->user_data, &res) < 0) {
+			if (errno != EINTR)
+				return -1;
+		}
+		if (res == -ECANCELED)
+			return errno = err, -1;
+	}
+	if (res < 0)
+		return errno = -res, -1;
+	return res;
+}
+
+#define URING_OR_NATIVE(call) \
+	struct uring *r = uring_get(); \
+	if (r == NULL) \
+		return call
+
+static ssize_t iouring_read(int fd, void *buf, size_t count) {
+	URING_OR_NATIVE(read(fd, buf, count));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_READ, .fd = fd,
+		.off = -1, .addr = (uintptr_t) buf, .len = count};
+	return uring_op(r, &sqe);
+}
+
+static ssize_t iouring_write(int fd, const void *buf, size_t count) {
+	URING_OR_NATIVE(write(fd, buf, count));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_WRITE, .fd = fd,
+		.off = -1, .addr = (uintptr_t) buf, .len = count};
+	return uring_op(r, &sqe);
+}
+
+static ssize_t iouring_readv(int fd, const struct iovec *iov, int iovcnt) {
+	URING_OR_NATIVE(readv(fd, iov, iovcnt));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_READV, .fd = fd,
+		.off = -1, .addr = (uintptr_t) iov, .len = iovcnt};
+	return uring_op(r, &sqe);
+}
+
+static ssize_t iouring_writev(int fd, const struct iovec *iov, int iovcnt) {
+	URING_OR_NATIVE(writev(fd, iov, iovcnt));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_WRITEV, .fd = fd,
+		.off = -1, .addr = (uintptr_t) iov, .len = iovcnt};
+	return uring_op(r, &sqe);
+}
+
+static ssize_t iouring_recv(int fd, void *buf, size_t len, int flags) {
+	if (flags == 0)
+		return iouring_read(fd, buf, len);
+	URING_OR_NATIVE(recv(fd, buf, len, flags));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_RECV, .fd = fd,
+		.addr = (uintptr_t) buf, .len = len, .msg_flags = flags};
+	return uring_op(r, &sqe);
+}
+
+static ssize_t iouring_send(int fd, const void *buf, size_t len, int flags) {
+	if (flags == 0)
+		return iouring_write(fd, buf, len);
+	URING_OR_NATIVE(send(fd, buf, len, flags));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_SEND, .fd = fd,
+		.addr = (uintptr_t) buf, .len = len, .msg_flags = flags};
+	return uring_op(r, &sqe);
+}
+
+static ssize_t iouring_recvmsg(int fd, struct msghdr *msg, int flags) {
+	URING_OR_NATIVE(recvmsg(fd, msg, flags));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_RECVMSG, .fd = fd,
+		.addr = (uintptr_t) msg, .len = 1, .msg_flags = flags};
+	return uring_op(r, &sqe);
+}
+
+static ssize_t iouring_sendmsg(int fd, const struct msghdr *msg, int flags) {
+	URING_OR_NATIVE(sendmsg(fd, msg, flags));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_SENDMSG, .fd = fd,
+		.addr = (uintptr_t) msg, .len = 1, .msg_flags = flags};
+	return uring_op(r, &sqe);
+}
+
+static ssize_t iouring_recvfrom(int fd, void *buf, size_t len, int flags,
+		struct sockaddr *src_addr, socklen_t *addrlen) {
+	struct iovec iov = {buf, len};
+	struct msghdr msg = {
+		.msg_name = src_addr,
+		.msg_namelen = (src_addr && addrlen) ? *addrlen : 0,
+		.msg_iov = &iov,
+		.msg_iovlen = 1
+	};
+	ssize_t n = iouring_recvmsg(fd, &msg, flags);
+	if (n >= 0 && src_addr && addrlen)
+		*addrlen = msg.msg_namelen;
+	return n;
+}
+
+static ssize_t iouring_sendto(int fd, const void *buf, size_t len, int flags,
+		const struct sockaddr *dest_addr, socklen_t addrlen) {
+	struct iovec iov = {(void *) buf, len};
+	struct msghdr msg = {
+		.msg_name = (void *) dest_addr,
+		.msg_namelen = dest_addr ? addrlen : 0,
+		.msg_iov = &iov,
+		.msg_iovlen = 1
+	};
+	return iouring_sendmsg(fd, &msg, flags);
+}
+
+static int iouring_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+	URING_OR_NATIVE(accept(fd, addr, addrlen));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_ACCEPT, .fd = fd,
+		.addr = (uintptr_t) addr, .addr2 = (uintptr_t) addrlen};
+	return uring_op(r, &sqe);
+}
+
+static int iouring_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+	URING_OR_NATIVE(connect(fd, addr, addrlen));
+	struct io_uring_sqe sqe = {.opcode = IORING_OP_CONNECT, .fd = fd,
+		.addr = (uintptr_t) addr, .off = addrlen};
+	return uring_op(r, &sqe);
+}
+
+static int iouring_parseopts(const char *options, struct iouring *stack) {
+	char optbuf[strlen(options) + 1];
+	char *tok, *saveptr;
+	stack->entries = DEFAULT_ENTRIES;
+	stack->sqpoll_idle = DEFAULT_SQPOLL_IDLE;
+	snprintf(optbuf, sizeof(optbuf), "%s", options);
+	for (tok = strtok_r(optbuf, ",", &saveptr); tok != NULL;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(tok, '=');
+		char *end = "";
+		if (value != NULL)
+			*value++ = '\0';
+		if (strcmp(tok, "sqpoll") == 0) {
+			stack->sqpoll = 1;
+			if (value)
+				stack->sqpoll_idle = strtoul(value, &end, 10);
+		} else if (strcmp(tok, "entries") == 0 && value) {
+			stack->entries = strtoul(value, &end, 10);
+			if (stack->entries == 0 || stack->entries > MAX_ENTRIES)
+				return errno = EINVAL, -1;
+		} else
+			return errno = EINVAL, -1;
+		if (*end != '\0')
+			return errno = EINVAL, -1;
+	}
+	return 0;
+}
+
+void *ioth_iouring_newstack(const char *vnlv[], const char *options,
+		struct ioth_functions *ioth_f) {
+	struct iouring *stack = calloc(1, sizeof(*stack));
+	struct uring *r;
+	(void) vnlv;
+	if (stack == NULL)
+		goto err_stack;
+	if (iouring_parseopts(options ? options : "", stack) < 0)
+		goto err_opts;
+	if (pthread_mutex_init(&stack->mutex, NULL) != 0)
+		goto err_opts;
+	if ((errno = pthread_key_create(&stack->key, uring_destructor)) != 0)
+		goto err_key;
+	/* check that io_uring is available (and the options are supported) */
+	if ((r = uring_new(stack)) == NULL)
+		goto err_uring;
+	uring_free(r);
+	getstackdata = ioth_f->getstackdata;
+	return stack;
+err_uring:
+	pthread_key_delete(stack->key);
+err_key:
+	pthread_mutex_destroy(&stack->mutex);
+err_opts:
+	free(stack);
+err_stack:
+	return NULL;
+}
+
+/* the stack cannot be used any more: delete the rings of all the threads */
+int ioth_iouring_delstack(void *stackdata) {
+	struct iouring *stack = stackdata;
+	pthread_key_delete(stack->key);
+	/* exiting threads may be running uring_destructor */
+	pthread_mutex_lock(&stack->mutex);
+	while (stack->rings != NULL) {
+		struct uring *r = stack->rings;
+		stack->rings = r->next;
+		uring_free(r);
+	}
+	pthread_mutex_unlock(&stack->mutex);
+	pthread_mutex_destroy(&stack->mutex);
+	free(stack);
+	return 0;
+}
+
+#define IOURING_LICENSE "SPDX-License-Identifier: LGPL-2.1-or-later"
+#define IOURING_CAPS (IOTH_CAP_KERNELFD | IOTH_CAP_THREADSAFE | IOTH_CAP_MULTISTACK)
+IOTH_PLUGIN_NOTE(IOURING_LICENSE, IOURING_CAPS);
+
+const struct ioth_ops ioth_iouring_ops = {
+	.version = IOTH_OPS_VERSION,
+	.fsize = sizeof(struct ioth_functions),
+	.caps = IOURING_CAPS,
+	.license = IOURING_LICENSE,
+	.f = {
+		.newstack = ioth_iouring_newstack,
+		.delstack = ioth_iouring_delstack,
+		.socket = socket,
+		.close = close,
+		.bind = bind,
+		.connect = iouring_connect,
+		.listen = listen,
+		.accept = iouring_accept,
+		.getsockname = getsockname,
+		.getpeername = getpeername,
+		.setsockopt = setsockopt,
+		.getsockopt = getsockopt,
+		.shutdown = shutdown,
+		.ioctl = ioctl,
+		.fcntl = fcntl,
+		.read = iouring_read,
+		.readv = iouring_readv,
+		.recv = iouring_recv,
+		.recvfrom = iouring_recvfrom,
+		.recvmsg = iouring_recvmsg,
+		.write = iouring_write,
+		.writev = iouring_writev,
+		.send = iouring_send,
+		.sendto = iouring_sendto,
+		.sendmsg = iouring_sendmsg,
+	},
+};
+
+extern const struct ioth_ops ioth_iouring_n_ops
+	__attribute__ ((alias ("ioth_iouring_ops")));
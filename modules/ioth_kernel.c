@@ -15,39 +15,228 @@
  */
 
 #include <ioth.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <errno.h>
+#include <pthread.h>
 
-const char *ioth_kernel_license = "SPDX-License-Identifier: LGPL-2.1-or-later";
+/* retval == NULL means error! */
+#define NATIVE_STACKDATA ((void *) 42)
+
+/* "kernel,netns=/path/of/netns" or "kernel,netns=pid":
+ * the sockets are created in an existing network namespace by a helper
+ * thread which has joined it (the network namespace is per-thread).
+ * Everything else is native: all data stays in the kernel. */
+enum nsstate {NS_IDLE, NS_REQUEST, NS_REPLY, NS_TERMINATE};
+
+struct kernelns {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int nsfd;
+	enum nsstate state;
+	int domain;
+	int type;
+	int protocol;
+	int rval;
+	int err;
+};
+
+static typeof(getstackdata_prototype) *getstackdata;
+
+static void *kernelns_thread(void *arg) {
+	struct kernelns *ns = arg;
+	int ok;
+	pthread_mutex_lock(&ns->mutex);
+	/* the first reply is the outcome of setns */
+	ok = (ns->rval = setns(ns->nsfd, CLONE_NEWNET)) == 0;
+	ns->err = errno;
+	ns->state = NS_REPLY;
+	pthread_cond_broadcast(&ns->cond);
+	while (ok) {
+		while (ns->state != NS_REQUEST && ns->state != NS_TERMINATE)
+			pthread_cond_wait(&ns->cond, &ns->mutex);
+		if (ns->state == NS_TERMINATE)
+			break;
+		ns->rval = socket(ns->domain, ns->type, ns->protocol);
+		ns->err = errno;
+		ns->state = NS_REPLY;
+		pthread_cond_broadcast(&ns->cond);
+	}
+	pthread_mutex_unlock(&ns->mutex);
+	return NULL;
+}
+
+/* wait for the reply of the helper thread (ns->mutex locked) */
+static int kernelns_wait(struct kernelns *ns) {
+	int rval;
+	while (ns->state != NS_REPLY)
+		pthread_cond_wait(&ns->cond, &ns->mutex);
+	rval = ns->rval;
+	errno = ns->err;
+	ns->state = NS_IDLE;
+	pthread_cond_broadcast(&ns->cond);
+	return rval;
+}
+
+static int kernelns_open(const char *netns) {
+	char path[PATH_MAX];
+	char *end;
+	long pid = strtol(netns, &end, 10);
+	if (*end == '\0' && pid > 0) {
+		snprintf(path, PATH_MAX, "/proc/%ld/ns/net", pid);
+		netns = path;
+	}
+	return open(netns, O_RDONLY | O_CLOEXEC);
+}
+
+static struct kernelns *kernelns_new(const char *netns) {
+	struct kernelns *ns = calloc(1, sizeof(*ns));
+	if (ns == NULL)
+		goto err_ns;
+	if ((ns->nsfd = kernelns_open(netns)) < 0)
+		goto err_nsfd;
+	if (pthread_mutex_init(&ns->mutex, NULL) != 0)
+		goto err_mutex;
+	if (pthread_cond_init(&ns->cond, NULL) != 0)
+		goto err_cond;
+	ns->state = NS_IDLE;
+	pthread_mutex_lock(&ns->mutex);
+	if ((errno = pthread_create(&ns->thread, NULL, kernelns_thread, ns)) != 0) {
+		pthread_mutex_unlock(&ns->mutex);
+		goto err_thread;
+	}
+	if (kernelns_wait(ns) < 0) {
+		pthread_mutex_unlock(&ns->mutex);
+		pthread_join(ns->thread, NULL);
+		goto err_thread;
+	}
+	pthread_mutex_unlock(&ns->mutex);
+	return ns;
+err_thread:
+	pthread_cond_destroy(&ns->cond);
+err_cond:
+	pthread_mutex_destroy(&ns->mutex);
+err_mutex:
+	close(ns->nsfd);
+err_nsfd:
+	free(ns);
+err_ns:
+	return NULL;
+}
+
+static void kernelns_del(struct kernelns *ns) {
+	pthread_mutex_lock(&ns->mutex);
+	while (ns->state != NS_IDLE)
+		pthread_cond_wait(&ns->cond, &ns->mutex);
+	ns->state = NS_TERMINATE;
+	pthread_cond_broadcast(&ns->cond);
+	pthread_mutex_unlock(&ns->mutex);
+	pthread_join(ns->thread, NULL);
+	pthread_cond_destroy(&ns->cond);
+	pthread_mutex_destroy(&ns->mutex);
+	close(ns->nsfd);
+	free(ns);
+}
+
+static int kernelns_socket(int domain, int type, int protocol) {
+	struct kernelns *ns = getstackdata();
+	int rval;
+	pthread_mutex_lock(&ns->mutex);
+	while (ns->state != NS_IDLE)
+		pthread_cond_wait(&ns->cond, &ns->mutex);
+	ns->domain = domain;
+	ns->type = type;
+	ns->protocol = protocol;
+	ns->state = NS_REQUEST;
+	pthread_cond_broadcast(&ns->cond);
+	rval = kernelns_wait(ns);
+	pthread_mutex_unlock(&ns->mutex);
+	return rval;
+}
+
+/* parse the options, return the netns (or NULL if not defined) */
+static const char *kernel_parseopts(const char *options, char *buf, size_t bufsize) {
+	const char *netns = NULL;
+	char *tok, *saveptr;
+	if (options == NULL || *options == '\0')
+		return NULL;
+	snprintf(buf, bufsize, "%s", options);
+	for (tok = strtok_r(buf, ",", &saveptr); tok != NULL;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		if (strncmp(tok, "netns=", 6) == 0 && tok[6] != '\0')
+			netns = tok + 6;
+		else
+			return errno = EINVAL, NULL;
+	}
+	return netns;
+}
 
 void *ioth_kernel_newstack(const char *vnlv[], const char *options,
 		struct ioth_functions *ioth_f) {
+	void *stackdata = NATIVE_STACKDATA;
+	char optbuf[options ? strlen(options) + 1 : 1];
+	const char *netns;
 	(void) vnlv;
-	(void) options;
-	ioth_f->socket = socket;
-	ioth_f->close = close;
-	ioth_f->bind = bind;
-	ioth_f->connect = connect;
-	ioth_f->listen = listen;
-	ioth_f->accept = accept;
-	ioth_f->getsockname = getsockname;
-	ioth_f->getpeername = getpeername;
-	ioth_f->setsockopt = setsockopt;
-	ioth_f->getsockopt = getsockopt;
-	ioth_f->shutdown = shutdown;
-	ioth_f->ioctl = ioctl;
-	ioth_f->fcntl = fcntl;
-	ioth_f->read = read;
-	ioth_f->readv = readv;
-	ioth_f->recv = recv;
-	ioth_f->recvfrom = recvfrom;
-	ioth_f->recvmsg = recvmsg;
-	ioth_f->write = write;
-	ioth_f->writev = writev;
-	ioth_f->send = send;
-	ioth_f->sendto = sendto;
-	ioth_f->sendmsg = sendmsg;
-	return (void *) 42; // useless, but retval == NULL means error!
-}
-
-void *ioth_kernel_n_newstack(const char *vnlv[], const char *options,
-		struct ioth_functions *ioth_f)
-	__attribute__ ((alias ("ioth_kernel_newstack")));
+	errno = 0;
+	if ((netns = kernel_parseopts(options, optbuf, sizeof(optbuf))) == NULL && errno != 0)
+		return NULL;
+	if (netns != NULL) {
+		if ((stackdata = kernelns_new(netns)) == NULL)
+			return NULL;
+		getstackdata = ioth_f->getstackdata;
+		ioth_f->socket = kernelns_socket;
+	}
+	return stackdata;
+}
+
+int ioth_kernel_delstack(void *stackdata) {
+	if (stackdata != NATIVE_STACKDATA)
+		kernelns_del(stackdata);
+	return 0;
+}
+
+#define KERNEL_LICENSE "SPDX-License-Identifier: LGPL-2.1-or-later"
+#define KERNEL_CAPS (IOTH_CAP_KERNELFD | IOTH_CAP_THREADSAFE | IOTH_CAP_MULTISTACK)
+IOTH_PLUGIN_NOTE(KERNEL_LICENSE, KERNEL_CAPS);
+
+const struct ioth_ops ioth_kernel_ops = {
+	.version = IOTH_OPS_VERSION,
+	.fsize = sizeof(struct ioth_functions),
+	.caps = KERNEL_CAPS,
+	.license = KERNEL_LICENSE,
+	.f = {
+		.newstack = ioth_kernel_newstack,
+		.delstack = ioth_kernel_delstack,
+		.socket = socket,
+		.close = close,
+		.bind = bind,
+		.connect = connect,
+		.listen = listen,
+		.accept = accept,
+		.getsockname = getsockname,
+		.getpeername = getpeername,
+		.setsockopt = setsockopt,
+		.getsockopt = getsockopt,
+		.shutdown = shutdown,
+		.ioctl = ioctl,
+		.fcntl = fcntl,
+		.read = read,
+		.readv = readv,
+		.recv = recv,
+		.recvfrom = recvfrom,
+		.recvmsg = recvmsg,
+		.write = write,
+		.writev = writev,
+		.send = send,
+		.sendto = sendto,
+		.sendmsg = sendmsg,
+	},
+};
+
+extern const struct ioth_ops ioth_kernel_n_ops
+	__attribute__ ((alias ("ioth_kernel_ops")));
@@ -24,12 +24,24 @@
 #include <errno.h>
 #include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
 #include <linux/if_tun.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/veth.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <libvdeplug.h>
 
 #define POLLTERM (POLLHUP | POLLERR | POLLNVAL)
@@ -40,24 +52,226 @@
 #define DEFAULT_IF_NAME "vde0"
 #define POLLING_TIMEOUT 10000
 #define ETH_HEADER_SIZE 14
+#define VLAN_TAG_SIZE 4
+#define MAX_MTU 65535
+
+/* forwarder: each direction of each interface has a bounded queue,
+ * at most FWD_BUDGET frames per direction are read at each wakeup */
+#define DEFAULT_QLEN 64
+#define MAX_QLEN 4096
+#define FWD_BUDGET 64
 
 #define CHILD_STACK_SIZE (256 * 1024)
 
-const char *ioth_vdestack_license = "SPDX-License-Identifier: LGPL-2.1-or-later";
+/* shared forwarder (forwarder=shared): one broker process creates the
+ * namespaces, the taps and the sockets of all the stacks, a pool of
+ * worker threads forwards the frames */
+#define DEFAULT_FWTHREADS 2
+#define MAX_FWTHREADS 64
+#define FWD_EVENTS 64
+#define BROKER_MSGSIZE 4096
+#define BROKER_NEWNS 0
+#define BROKER_SOCKET 1
+#define MAX_BUFSIZE (MAX_MTU + ETH_HEADER_SIZE + VLAN_TAG_SIZE)
+
+/* tpacket backend (backend=tpacket): each interface is a veth whose peer
+ * is accessed by the forwarder through TPACKET_V3 mmap'd rings */
+#define TPACKET_PEER_NAME "vdefw%d"
+#define TPACKET_BLOCK_MIN (1 << 16)
+#define TPACKET_RX_BLOCKS 8
+#define TPACKET_TX_BLOCKS 4
+#define TPACKET_RETIRE_TOV 1 // ms
+
+#define RING_VNL_PREFIX "ring://"
+#define RING_VNL_PREFIXLEN (sizeof(RING_VNL_PREFIX) - 1)
+#define RING_SLOTS 128
+#define RING_NAMESIZE 64
+#define CACHELINE_SIZE 64
+
+/* in-process interconnect: two stacks of the same process using the
+ * same "ring://name" vnl are connected back to back.
+ * Frames are exchanged through a pair of lock-free single producer/single
+ * consumer rings in shared memory (mapped before the forwarders are cloned,
+ * so it is shared by the processes of both stacks).
+ * The ring ring[side] is read by the endpoint "side" and written by the other,
+ * efd[side] notifies the endpoint "side" that ring[side] is not empty or
+ * that ring[!side] is no longer full. */
+struct ringslot {
+	uint32_t len;
+	char data[VDE_ETHBUFSIZE];
+};
+
+struct ringbuf {
+	_Atomic uint32_t head __attribute__((aligned(CACHELINE_SIZE))); // consumer
+	_Atomic uint32_t tail __attribute__((aligned(CACHELINE_SIZE))); // producer
+	_Atomic int waiting; // the producer waits for free slots
+	_Atomic int sleeping; // the consumer found the ring empty and waits for a notification
+	struct ringslot slot[RING_SLOTS];
+};
+
+struct ringlink {
+	struct ringlink *next;
+	int refcount;
+	int used[2]; // endpoints in use
+	int efd[2];
+	struct ringbuf *ring;
+	char name[RING_NAMESIZE];
+};
+
+static struct ringlink *ringlinks;
+static pthread_mutex_t ringlinks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* sysctls which can be set by options (tag=value) in the stack namespace */
+enum {
+	SYSCTL_RMEM_MAX,
+	SYSCTL_WMEM_MAX,
+	SYSCTL_RMEM_DEFAULT,
+	SYSCTL_WMEM_DEFAULT,
+	SYSCTL_TCP_CC,
+	SYSCTL_TCP_RMEM,
+	SYSCTL_TCP_WMEM,
+	SYSCTL_NUM
+};
+
+static const struct {
+	const char *tag;
+	const char *path;
+} vdesysctl[SYSCTL_NUM] = {
+	[SYSCTL_RMEM_MAX] = {"rmem_max", "/proc/sys/net/core/rmem_max"},
+	[SYSCTL_WMEM_MAX] = {"wmem_max", "/proc/sys/net/core/wmem_max"},
+	[SYSCTL_RMEM_DEFAULT] = {"rmem_default", "/proc/sys/net/core/rmem_default"},
+	[SYSCTL_WMEM_DEFAULT] = {"wmem_default", "/proc/sys/net/core/wmem_default"},
+	[SYSCTL_TCP_CC] = {"tcp_cc", "/proc/sys/net/ipv4/tcp_congestion_control"},
+	[SYSCTL_TCP_RMEM] = {"tcp_rmem", "/proc/sys/net/ipv4/tcp_rmem"},
+	[SYSCTL_TCP_WMEM] = {"tcp_wmem", "/proc/sys/net/ipv4/tcp_wmem"},
+};
+
+/* stack options: e.g. "vdestack,mtu=9000,txqueuelen=2000,tcp_cc=cubic" */
+struct vdeopts {
+	char *optbuf;
+	unsigned int mtu;
+	unsigned int txqueuelen;
+	unsigned int qlen;
+	int headdrop;
+	int shared;
+	unsigned int fwthreads;
+	int tpacket;
+	/* the values of SO_RCVBUF/SO_SNDBUF for new sockets when
+		 the core rmem_max/wmem_max sysctls are not per-namespace.
+		 The kernel caps them to the rmem_max/wmem_max of the host */
+	int rcvbuf;
+	int sndbuf;
+	const char *sysctl[SYSCTL_NUM];
+};
+
+/* the forwarder is the only writer of the stats (in shared memory) */
+#define FWSTATS_ADD(stats, field, n) \
+	__atomic_store_n(&(stats)->field, (stats)->field + (n), __ATOMIC_RELAXED)
+#define FWSTATS_BATCH(stats, dir, n) \
+	do { \
+		if ((n) > 0) { \
+			FWSTATS_ADD(stats, dir ## _batches, 1); \
+			if ((uint64_t) (n) > (stats)->dir ## _maxbatch) \
+				__atomic_store_n(&(stats)->dir ## _maxbatch, (n), __ATOMIC_RELAXED); \
+		} \
+	} while(0)
+
+#define FWSTATS_SIZE(noif) ((noif) > 0 ? (noif) * sizeof(struct ioth_fwstats) : 1)
+
+/* bounded frame queue (used by the forwarder only) */
+struct fwqueue {
+	unsigned int head;
+	unsigned int count;
+	unsigned int qlen;
+	int headdrop;
+	size_t bufsize;
+	uint32_t *len;
+	char *frames;
+};
+
+#define IF2NET 0
+#define NET2IF 1
+
+#define FW_NETFD 0
+#define FW_TAPFD 1
+
+/* TPACKET_V3 rx and tx rings of the veth peer (tpacket backend) */
+struct tpring {
+	char *map;
+	size_t mapsize;
+	size_t block_size;
+	unsigned int rx_blocks;
+	unsigned int rx_block; // next rx block
+	char *tx;
+	size_t tx_frame_size;
+	unsigned int tx_block_frames; // frames per block
+	unsigned int tx_frames;
+	unsigned int tx_frame; // next tx frame
+	int tx_pending; // frames to be sent
+};
+
+struct vdeiface;
+
+/* epoll registration of the fds of an interface (shared forwarder) */
+struct fwepoll {
+	struct vdeiface *iface;
+	int fd;
+	uint32_t events;
+};
+
+struct vdeiface {
+	VDECONN *vdeconn;
+	struct ringlink *ringlink;
+	int ringside;
+	char ifname[IFNAMSIZ];
+	struct ioth_fwstats *stats;
+	/* forwarder side */
+	int netfd;
+	int tapfd; // tap or packet socket (tpacket backend)
+	struct tpring *tpring;
+	struct fwqueue queue[2]; // IF2NET, NET2IF
+	struct fwepoll epoll[2]; // FW_NETFD, FW_TAPFD
+};
+
+struct fwworker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	int epfd;
+	int efd; // wake up for termination
+	int terminate;
+	unsigned int gen; // incremented when a stack is removed
+	int nstacks;
+	char scratch[MAX_BUFSIZE];
+};
 
 struct vdestack {
 	pid_t pid;
 	pid_t parentpid;
 	int noif;
+	size_t bufsize;
+	struct vdeopts opts;
+	struct ioth_fwstats *stats; // shared with the forwarder
 	pthread_mutex_t mutex;
 	int cmdpipe[2]; // socketpair for commands;
 	char *child_stack;
-	struct {
-		VDECONN *vdeconn;
-		char ifname[IFNAMSIZ];
-	} iface[];
+	int nsfd; // shared forwarder: network namespace of the stack
+	struct fwworker *worker;
+	struct vdeiface iface[];
 };
 
+struct vdebroker {
+	pthread_mutex_t mutex;
+	int refcount;
+	pid_t pid;
+	pid_t parentpid;
+	int cmdpipe[2];
+	char *child_stack;
+	int nworkers;
+	struct fwworker *worker;
+};
+
+static struct vdebroker broker = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
 struct vdecmd {
 	int domain;
 	int type;
@@ -69,10 +283,440 @@ struct vdereply {
 	int err;
 };
 
+/* broker commands: BROKER_NEWNS is followed by the options string
+ * and by noif interface names (IFNAMSIZ bytes each) */
+struct brokercmd {
+	int cmd;
+	int nsfd;
+	struct vdecmd socket;
+	int rcvbuf;
+	int sndbuf;
+	int noif;
+	char data[];
+};
+
+/* BROKER_NEWNS: rval is the namespace fd, fd[] are the taps */
+struct brokerreply {
+	int rval;
+	int err;
+	int rcvbuf;
+	int sndbuf;
+	int fd[];
+};
+
+/* get (or create) the link named "name", each link has two endpoints */
+static struct ringlink *ringlink_open(const char *name, int *side) {
+	struct ringlink *link;
+	pthread_mutex_lock(&ringlinks_mutex);
+	for (link = ringlinks; link != NULL; link = link->next) {
+		if (strncmp(link->name, name, RING_NAMESIZE) == 0)
+			break;
+	}
+	if (link != NULL) {
+		if (link->refcount > 1)
+			link = NULL, errno = EADDRINUSE;
+		else {
+			/* the free endpoint: the first one may have been closed */
+			*side = link->used[0] ? 1 : 0;
+			link->used[*side] = 1;
+			link->refcount++;
+		}
+	} else if ((link = calloc(1, sizeof(*link))) != NULL) {
+		link->ring = mmap(0, 2 * sizeof(struct ringbuf), PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (link->ring == MAP_FAILED)
+			goto err_mmap;
+		if ((link->efd[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+			goto err_efd0;
+		if ((link->efd[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+			goto err_efd1;
+		snprintf(link->name, RING_NAMESIZE, "%s", name);
+		link->refcount = 1;
+		link->used[0] = 1;
+		link->next = ringlinks;
+		ringlinks = link;
+		*side = 0;
+	}
+	/* the new endpoint waits for the first notification */
+	if (link != NULL)
+		atomic_store(&link->ring[*side].sleeping, 1);
+	pthread_mutex_unlock(&ringlinks_mutex);
+	return link;
+err_efd1:
+	close(link->efd[0]);
+err_efd0:
+	munmap(link->ring, 2 * sizeof(struct ringbuf));
+err_mmap:
+	free(link);
+	pthread_mutex_unlock(&ringlinks_mutex);
+	return NULL;
+}
+
+static void ringlink_close(struct ringlink *link, int side) {
+	struct ringlink **scan;
+	pthread_mutex_lock(&ringlinks_mutex);
+	link->used[side] = 0;
+	if (--link->refcount == 0) {
+		for (scan = &ringlinks; *scan != NULL; scan = &((*scan)->next)) {
+			if (*scan == link) {
+				*scan = link->next;
+				break;
+			}
+		}
+		close(link->efd[0]);
+		close(link->efd[1]);
+		munmap(link->ring, 2 * sizeof(struct ringbuf));
+		free(link);
+	}
+	pthread_mutex_unlock(&ringlinks_mutex);
+}
+
+/* send a frame to the other side: if the ring is full it fails (EAGAIN),
+ * efd[side] will be notified when the other side frees some slots */
+static ssize_t ringlink_send(struct ringlink *link, int side, const void *buf, size_t len) {
+	struct ringbuf *ring = &link->ring[!side];
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (len > VDE_ETHBUFSIZE)
+		return errno = EMSGSIZE, -1;
+	if (tail - head >= RING_SLOTS) {
+		atomic_store(&ring->waiting, 1);
+		/* re-check: the consumer may have freed slots in the meanwhile */
+		head = atomic_load(&ring->head);
+		if (tail - head >= RING_SLOTS)
+			return errno = EAGAIN, -1;
+	}
+	ring->slot[tail % RING_SLOTS].len = len;
+	memcpy(ring->slot[tail % RING_SLOTS].data, buf, len);
+	atomic_store(&ring->tail, tail + 1);
+	/* wake up the consumer only when it is waiting (see ringlink_recv) */
+	if (atomic_load(&ring->sleeping) && atomic_exchange(&ring->sleeping, 0))
+		eventfd_write(link->efd[!side], 1);
+	return len;
+}
+
+/* receive a frame, return 0 if the ring is empty */
+static ssize_t ringlink_recv(struct ringlink *link, int side, void *buf, size_t len) {
+	struct ringbuf *ring = &link->ring[side];
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	struct ringslot *slot = &ring->slot[head % RING_SLOTS];
+	if (head == tail) {
+		atomic_store(&ring->sleeping, 1);
+		/* re-check: the producer may have published a frame in the meanwhile */
+		if (atomic_load(&ring->tail) == head)
+			return 0;
+		atomic_store(&ring->sleeping, 0);
+	}
+	if (len > slot->len)
+		len = slot->len;
+	memcpy(buf, slot->data, len);
+	atomic_store(&ring->head, head + 1);
+	if (atomic_load(&ring->waiting) && atomic_exchange(&ring->waiting, 0))
+		eventfd_write(link->efd[!side], 1);
+	return len;
+}
+
+/* clear the pending notification before draining the ring */
+static void ringlink_ack(struct ringlink *link, int side) {
+	eventfd_t value;
+	eventfd_read(link->efd[side], &value);
+}
+
+static int vde_parseopts(const char *options, struct vdeopts *opts) {
+	char *tok, *saveptr;
+	memset(opts, 0, sizeof(*opts));
+	opts->qlen = DEFAULT_QLEN;
+	opts->fwthreads = DEFAULT_FWTHREADS;
+	if (options == NULL || *options == '\0')
+		return 0;
+	if ((opts->optbuf = strdup(options)) == NULL)
+		return -1;
+	for (tok = strtok_r(opts->optbuf, ",", &saveptr); tok != NULL;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(tok, '=');
+		char *end;
+		int i;
+		if (value == NULL || value[1] == '\0')
+			goto einval;
+		*value++ = '\0';
+		if (strcmp(tok, "mtu") == 0) {
+			opts->mtu = strtoul(value, &end, 10);
+			if (*end != '\0' || opts->mtu < ETH_HEADER_SIZE || opts->mtu > MAX_MTU)
+				goto einval;
+		} else if (strcmp(tok, "txqueuelen") == 0) {
+			opts->txqueuelen = strtoul(value, &end, 10);
+			if (*end != '\0')
+				goto einval;
+		} else if (strcmp(tok, "qlen") == 0) {
+			opts->qlen = strtoul(value, &end, 10);
+			if (*end != '\0' || opts->qlen == 0 || opts->qlen > MAX_QLEN)
+				goto einval;
+		} else if (strcmp(tok, "drop") == 0) {
+			if (strcmp(value, "tail") == 0)
+				opts->headdrop = 0;
+			else if (strcmp(value, "head") == 0)
+				opts->headdrop = 1;
+			else
+				goto einval;
+		} else if (strcmp(tok, "forwarder") == 0) {
+			if (strcmp(value, "private") == 0)
+				opts->shared = 0;
+			else if (strcmp(value, "shared") == 0)
+				opts->shared = 1;
+			else
+				goto einval;
+		} else if (strcmp(tok, "backend") == 0) {
+			if (strcmp(value, "tap") == 0)
+				opts->tpacket = 0;
+			else if (strcmp(value, "tpacket") == 0)
+				opts->tpacket = 1;
+			else
+				goto einval;
+		} else if (strcmp(tok, "fwthreads") == 0) {
+			opts->fwthreads = strtoul(value, &end, 10);
+			if (*end != '\0' || opts->fwthreads == 0 || opts->fwthreads > MAX_FWTHREADS)
+				goto einval;
+		} else {
+			for (i = 0; i < SYSCTL_NUM; i++) {
+				if (strcmp(tok, vdesysctl[i].tag) == 0) {
+					opts->sysctl[i] = value;
+					break;
+				}
+			}
+			if (i == SYSCTL_NUM)
+				goto einval;
+		}
+	}
+	return 0;
+einval:
+	free(opts->optbuf);
+	opts->optbuf = NULL;
+	return errno = EINVAL, -1;
+}
+
+static int vde_sysctl(const char *path, const char *value) {
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	size_t len = strlen(value);
+	if (fd < 0)
+		return -1;
+	if (write(fd, value, len) != (ssize_t) len) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+/* send a netlink request and wait for the ack */
+static int vde_nlrequest(int fd, struct nlmsghdr *h) {
+	struct {
+		struct nlmsghdr h;
+		struct nlmsgerr e;
+	} reply;
+	if (send(fd, h, h->nlmsg_len, 0) < 0 ||
+			recv(fd, &reply, sizeof(reply), 0) < (ssize_t) sizeof(reply))
+		return -1;
+	if (reply.h.nlmsg_type != NLMSG_ERROR)
+		return errno = EIO, -1;
+	if (reply.e.error < 0)
+		return errno = -reply.e.error, -1;
+	return 0;
+}
+
+/* append an attribute (data == NULL: begin of a nested attribute) */
+static struct rtattr *vde_nladdattr(struct nlmsghdr *h, int type, const void *data, size_t len) {
+	struct rtattr *rta = (void *) ((char *) h + NLMSG_ALIGN(h->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (data != NULL)
+		memcpy(RTA_DATA(rta), data, len);
+	h->nlmsg_len = NLMSG_ALIGN(h->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+	return rta;
+}
+
+static void vde_nlendattr(struct nlmsghdr *h, struct rtattr *nest) {
+	nest->rta_len = (char *) h + h->nlmsg_len - (char *) nest;
+}
+
+/* set mtu and txqueuelen of an interface (RTM_NEWLINK, SIOCSIFTXQLEN
+ * requires CAP_NET_ADMIN in the initial user namespace) */
+static int vde_setlink(int fd, const char *ifname, unsigned int mtu, unsigned int txqueuelen) {
+	struct {
+		struct nlmsghdr h;
+		struct ifinfomsg i;
+		struct rtattr mtu_a;
+		uint32_t mtu;
+		struct rtattr txqlen_a;
+		uint32_t txqlen;
+	} req = {
+		.h.nlmsg_len = sizeof(struct nlmsghdr) + sizeof(struct ifinfomsg),
+		.h.nlmsg_type = RTM_NEWLINK,
+		.h.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK,
+		.h.nlmsg_seq = 1,
+		.i.ifi_family = AF_UNSPEC,
+		.mtu_a = {RTA_LENGTH(sizeof(uint32_t)), IFLA_MTU},
+		.mtu = mtu,
+		.txqlen_a = {RTA_LENGTH(sizeof(uint32_t)), IFLA_TXQLEN},
+		.txqlen = txqueuelen,
+	};
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+		return -1;
+	req.i.ifi_index = ifr.ifr_ifindex;
+	if (mtu > 0)
+		req.h.nlmsg_len += sizeof(req.mtu_a) + sizeof(req.mtu);
+	else
+		req.mtu_a.rta_type = IFLA_UNSPEC;
+	if (txqueuelen > 0)
+		req.h.nlmsg_len += sizeof(req.txqlen_a) + sizeof(req.txqlen);
+	/* when mtu is not set, the txqueuelen attribute must follow the header */
+	if (mtu == 0)
+		memmove(&req.mtu_a, &req.txqlen_a, sizeof(req.txqlen_a) + sizeof(req.txqlen));
+	return vde_nlrequest(fd, &req.h);
+}
+
+/* set mtu and txqueuelen of all the interfaces */
+static int vde_setifparams(struct vdestack *stack) {
+	struct vdeopts *opts = &stack->opts;
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	int i;
+	if (fd < 0)
+		return -1;
+	for (i = 0; i < stack->noif; i++) {
+		char peer[IFNAMSIZ];
+		snprintf(peer, IFNAMSIZ, TPACKET_PEER_NAME, i);
+		if (vde_setlink(fd, stack->iface[i].ifname, opts->mtu, opts->txqueuelen) < 0 ||
+				(opts->tpacket && opts->mtu > 0 && vde_setlink(fd, peer, opts->mtu, 0) < 0)) {
+			close(fd);
+			return -1;
+		}
+	}
+	return close(fd);
+}
+
+/* this function runs in the stack namespace (by the forwarder) */
+static int vde_applyopts(struct vdestack *stack) {
+	struct vdeopts *opts = &stack->opts;
+	int i;
+	if ((opts->mtu > 0 || opts->txqueuelen > 0) && vde_setifparams(stack) < 0)
+		return -1;
+	for (i = 0; i < SYSCTL_NUM; i++) {
+		if (opts->sysctl[i] && vde_sysctl(vdesysctl[i].path, opts->sysctl[i]) < 0) {
+			/* net.core.[rw]mem_max can be set in the initial namespace only:
+				 set the socket buffers instead (up to the values of the host,
+				 SO_RCVBUFFORCE/SO_SNDBUFFORCE need CAP_NET_ADMIN in the initial
+				 user namespace) */
+			int global = (errno == ENOENT || errno == EACCES || errno == EPERM);
+			if (global && i == SYSCTL_RMEM_MAX)
+				opts->rcvbuf = atoi(opts->sysctl[i]);
+			else if (global && i == SYSCTL_WMEM_MAX)
+				opts->sndbuf = atoi(opts->sysctl[i]);
+			else
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* create a socket, this function runs in the stack namespace */
+static int vde_newsocket(struct vdecmd *cmd, int rcvbuf, int sndbuf) {
+	int fd = socket(cmd->domain, cmd->type, cmd->protocol);
+	if (fd >= 0 && rcvbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (fd >= 0 && sndbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	return fd;
+}
+
+/* disable the offloading features of the stack side of a veth:
+ * the forwarder must receive complete frames (segmented, checksummed) */
+static int vde_nooffload(int fd, const char *ifname) {
+	static const uint32_t cmds[] = {ETHTOOL_STXCSUM, ETHTOOL_SSG, ETHTOOL_STSO, ETHTOOL_SGSO};
+	struct ethtool_value value = {.data = 0};
+	struct ifreq ifr;
+	unsigned int i;
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+	ifr.ifr_data = (void *) &value;
+	for (i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+		value.cmd = cmds[i];
+		if (ioctl(fd, SIOCETHTOOL, &ifr) < 0 && errno != EOPNOTSUPP)
+			return -1;
+	}
+	return 0;
+}
+
+/* create the veth pair name <-> peer */
+static int vde_newveth(const char *name, const char *peer) {
+	char buf[NLMSG_SPACE(sizeof(struct ifinfomsg)) + 256] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *h = (void *) buf;
+	struct ifinfomsg *ifi = NLMSG_DATA(h);
+	struct ifinfomsg peerinfo = {.ifi_family = AF_UNSPEC};
+	struct rtattr *linkinfo, *infodata, *peerattr;
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	int rv;
+	if (fd < 0)
+		return -1;
+	memset(buf, 0, sizeof(buf));
+	h->nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	h->nlmsg_type = RTM_NEWLINK;
+	h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL;
+	h->nlmsg_seq = 1;
+	ifi->ifi_family = AF_UNSPEC;
+	vde_nladdattr(h, IFLA_IFNAME, name, strlen(name) + 1);
+	linkinfo = vde_nladdattr(h, IFLA_LINKINFO, NULL, 0);
+	vde_nladdattr(h, IFLA_INFO_KIND, "veth", sizeof("veth"));
+	infodata = vde_nladdattr(h, IFLA_INFO_DATA, NULL, 0);
+	peerattr = vde_nladdattr(h, VETH_INFO_PEER, &peerinfo, sizeof(peerinfo));
+	vde_nladdattr(h, IFLA_IFNAME, peer, strlen(peer) + 1);
+	vde_nlendattr(h, peerattr);
+	vde_nlendattr(h, infodata);
+	vde_nlendattr(h, linkinfo);
+	rv = vde_nlrequest(fd, h);
+	close(fd);
+	return rv;
+}
+
+/* tpacket backend: create the veth pair, return a packet socket bound to the peer */
+static int open_veth(char *name, int index) {
+	char peer[IFNAMSIZ];
+	struct sockaddr_ll sll = {.sll_family = AF_PACKET, .sll_protocol = htons(ETH_P_ALL)};
+	struct ifreq ifr;
+	int version = TPACKET_V3;
+	int one = 1;
+	int fd;
+	snprintf(peer, IFNAMSIZ, TPACKET_PEER_NAME, index);
+	if (vde_newveth(name, peer) < 0)
+		return -1;
+	if ((fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, htons(ETH_P_ALL))) < 0)
+		return -1;
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, IFNAMSIZ, "%s", peer);
+	if (vde_nooffload(fd, name) < 0 ||
+			ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+		goto err;
+	sll.sll_ifindex = ifr.ifr_ifindex;
+	/* the peer is always up, the stack side follows the stack configuration */
+	ifr.ifr_flags = IFF_UP;
+	if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0 ||
+			setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+			setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) < 0 ||
+			setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) < 0)
+		goto err;
+	if (bind(fd, (struct sockaddr *) &sll, sizeof(sll)) < 0)
+		goto err;
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
 static int open_tap(char *name) {
 	struct ifreq ifr;
 	int fd=-1;
-	if((fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC)) < 0)
+	if((fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC | O_NONBLOCK)) < 0)
 		return -1;
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
@@ -85,73 +729,798 @@ static int open_tap(char *name) {
 	return fd;
 }
 
+/* the interface of the stack: a tap or a veth (tpacket backend) */
+static int open_iface(char *name, int index, struct vdeopts *opts) {
+	if (opts->tpacket)
+		return open_veth(name, index);
+	else
+		return open_tap(name);
+}
+
+/* map the rx and tx rings of the packet socket of the tpacket backend */
+static struct tpring *tpring_new(int fd, size_t bufsize) {
+	struct tpring *tp = calloc(1, sizeof(*tp));
+	struct tpacket_req3 req;
+	size_t frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + bufsize);
+	if (tp == NULL)
+		goto err_tp;
+	for (tp->block_size = TPACKET_BLOCK_MIN; tp->block_size < frame_size; tp->block_size <<= 1)
+		;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = tp->block_size;
+	req.tp_block_nr = tp->rx_blocks = TPACKET_RX_BLOCKS;
+	req.tp_frame_size = frame_size;
+	req.tp_frame_nr = (tp->block_size / frame_size) * TPACKET_RX_BLOCKS;
+	req.tp_retire_blk_tov = TPACKET_RETIRE_TOV;
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+		goto err_ring;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = tp->block_size;
+	req.tp_block_nr = TPACKET_TX_BLOCKS;
+	req.tp_frame_size = tp->tx_frame_size = frame_size;
+	tp->tx_block_frames = tp->block_size / frame_size;
+	req.tp_frame_nr = tp->tx_frames = tp->tx_block_frames * TPACKET_TX_BLOCKS;
+	if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+		goto err_ring;
+	tp->mapsize = tp->block_size * (TPACKET_RX_BLOCKS + TPACKET_TX_BLOCKS);
+	tp->map = mmap(0, tp->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (tp->map == MAP_FAILED)
+		goto err_ring;
+	tp->tx = tp->map + tp->block_size * TPACKET_RX_BLOCKS;
+	return tp;
+err_ring:
+	free(tp);
+err_tp:
+	return NULL;
+}
+
+static void tpring_free(struct tpring *tp) {
+	munmap(tp->map, tp->mapsize);
+	free(tp);
+}
+
+/* the next free frame of the tx ring, NULL if the ring is full.
+ * frames do not span blocks: there can be a gap at the end of each block */
+static struct tpacket3_hdr *tpring_txframe(struct tpring *tp) {
+	unsigned int block = tp->tx_frame / tp->tx_block_frames;
+	unsigned int frame = tp->tx_frame % tp->tx_block_frames;
+	struct tpacket3_hdr *hdr = (void *) (tp->tx + block * tp->block_size + frame * tp->tx_frame_size);
+	if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & ~TP_STATUS_WRONG_FORMAT)
+		return NULL;
+	return hdr;
+}
+
+#define tpring_txdata(hdr) ((char *) (hdr) + TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+/* the frame has been copied in the free tx frame: queue it */
+static void tpring_txcommit(struct tpring *tp, struct tpacket3_hdr *hdr, size_t len) {
+	hdr->tp_len = hdr->tp_snaplen = len;
+	hdr->tp_next_offset = 0;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+	tp->tx_frame = (tp->tx_frame + 1) % tp->tx_frames;
+	tp->tx_pending = 1;
+}
+
+/* send the queued frames of the tx ring (a single system call per batch) */
+static void tpring_kick(struct tpring *tp, int fd) {
+	if (tp->tx_pending) {
+		send(fd, NULL, 0, MSG_DONTWAIT);
+		tp->tx_pending = 0;
+	}
+}
+
+static int fwqueue_init(struct fwqueue *q, unsigned int qlen, int headdrop, size_t bufsize) {
+	q->head = q->count = 0;
+	q->qlen = qlen;
+	q->headdrop = headdrop;
+	q->bufsize = bufsize;
+	q->len = malloc(qlen * sizeof(q->len[0]));
+	q->frames = malloc(qlen * bufsize);
+	if (q->len == NULL || q->frames == NULL) {
+		free(q->len);
+		free(q->frames);
+		return errno = ENOMEM, -1;
+	}
+	return 0;
+}
+
+static void fwqueue_fini(struct fwqueue *q) {
+	free(q->len);
+	free(q->frames);
+}
+
+#define fwqueue_frame(q, i) ((q)->frames + (((q)->head + (i)) % (q)->qlen) * (q)->bufsize)
+
+static void fwqueue_pop(struct fwqueue *q) {
+	q->head = (q->head + 1) % q->qlen;
+	q->count--;
+}
+
+/* the buffer for the next frame: when the queue is full the frame is
+ * received in the scratch buffer */
+static char *fwqueue_tail(struct fwqueue *q, char *scratch) {
+	if (q->count == q->qlen)
+		return scratch;
+	return fwqueue_frame(q, q->count);
+}
+
+/* enqueue the frame received in the buffer returned by fwqueue_tail.
+ * queue full: tail drop discards the new frame, head drop the oldest one.
+ * return -1 if a frame has been dropped */
+static int fwqueue_push(struct fwqueue *q, char *frame, size_t len) {
+	int retval = 0;
+	if (q->count == q->qlen) {
+		if (!q->headdrop)
+			return -1;
+		fwqueue_pop(q);
+		memcpy(fwqueue_frame(q, q->count), frame, len);
+		retval = -1;
+	}
+	q->len[(q->head + q->count) % q->qlen] = len;
+	q->count++;
+	return retval;
+}
+
+/* copy a frame in the queue, return -1 if a frame has been dropped */
+static int fwqueue_copy(struct fwqueue *q, const char *frame, size_t len) {
+	int retval = 0;
+	if (q->count == q->qlen) {
+		if (!q->headdrop)
+			return -1;
+		fwqueue_pop(q);
+		retval = -1;
+	}
+	if (len > q->bufsize)
+		len = q->bufsize;
+	memcpy(fwqueue_frame(q, q->count), frame, len);
+	q->len[(q->head + q->count) % q->qlen] = len;
+	q->count++;
+	return retval;
+}
+
+/* frame accounting: rv is the return value of the send/write operation */
+#define FWSTATS_ACCOUNT(stats, dir, rv, n) \
+	do { \
+		if ((rv) < 0) \
+			FWSTATS_ADD(stats, dir ## _drops, 1); \
+		else if ((rv) < (n)) \
+			FWSTATS_ADD(stats, dir ## _short, 1); \
+		else { \
+			FWSTATS_ADD(stats, dir ## _frames, 1); \
+			FWSTATS_ADD(stats, dir ## _bytes, (n)); \
+		} \
+	} while(0)
+
+static ssize_t fwd_netsend(struct vdeiface *iface, const void *frame, size_t len) {
+	if (iface->ringlink)
+		return ringlink_send(iface->ringlink, iface->ringside, frame, len);
+	else
+		return vde_send(iface->vdeconn, frame, len, 0);
+}
+
+static ssize_t fwd_ifwrite(struct vdeiface *iface, const void *frame, size_t len) {
+	if (iface->tpring) {
+		struct tpacket3_hdr *hdr = tpring_txframe(iface->tpring);
+		if (hdr == NULL)
+			return errno = EAGAIN, -1;
+		memcpy(tpring_txdata(hdr), frame, len);
+		tpring_txcommit(iface->tpring, hdr, len);
+		return len;
+	} else
+		return write(iface->tapfd, frame, len);
+}
+
+/* send the queued frames to the network, stop when the network is busy */
+static void fwd_if2net_flush(struct vdeiface *iface) {
+	struct fwqueue *q = &iface->queue[IF2NET];
+	while (q->count > 0) {
+		char *frame = fwqueue_frame(q, 0);
+		ssize_t n = q->len[q->head];
+		ssize_t rv = fwd_netsend(iface, frame, n);
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		FWSTATS_ACCOUNT(iface->stats, tx, rv, n);
+		fwqueue_pop(q);
+	}
+}
+
+/* write the queued frames to the interface, stop when the interface is busy */
+static void fwd_net2if_flush(struct vdeiface *iface) {
+	struct fwqueue *q = &iface->queue[NET2IF];
+	while (q->count > 0) {
+		char *frame = fwqueue_frame(q, 0);
+		ssize_t n = q->len[q->head];
+		ssize_t rv = fwd_ifwrite(iface, frame, n);
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		FWSTATS_ACCOUNT(iface->stats, rx, rv, n);
+		fwqueue_pop(q);
+	}
+	if (iface->tpring)
+		tpring_kick(iface->tpring, iface->tapfd);
+}
+
+/* tpacket backend: drain the ready blocks of the rx ring.
+ * Frames are sent from the ring, they are copied in the queue only
+ * if the network is busy */
+static void fwd_if2net_tpacket(struct vdeiface *iface) {
+	struct tpring *tp = iface->tpring;
+	struct fwqueue *q = &iface->queue[IF2NET];
+	int batch = 0;
+	while (batch < FWD_BUDGET) {
+		struct tpacket_block_desc *pbd = (void *) (tp->map + tp->rx_block * tp->block_size);
+		struct tpacket3_hdr *ppd;
+		uint32_t i;
+		if ((__atomic_load_n(&pbd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+			break;
+		ppd = (void *) ((char *) pbd + pbd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < pbd->hdr.bh1.num_pkts; i++, batch++) {
+			char *frame = (char *) ppd + ppd->tp_mac;
+			ssize_t n = ppd->tp_snaplen;
+			ssize_t rv = -1;
+			if (q->count == 0 && ((rv = fwd_netsend(iface, frame, n)) >= 0 ||
+						(errno != EAGAIN && errno != EWOULDBLOCK)))
+				FWSTATS_ACCOUNT(iface->stats, tx, rv, n);
+			else if (fwqueue_copy(q, frame, n) < 0)
+				FWSTATS_ADD(iface->stats, tx_overflows, 1);
+			ppd = (void *) ((char *) ppd + ppd->tp_next_offset);
+		}
+		__atomic_store_n(&pbd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		tp->rx_block = (tp->rx_block + 1) % tp->rx_blocks;
+	}
+	FWSTATS_BATCH(iface->stats, tx, batch);
+}
+
+/* read frames from the tap. return -1 if the tap has been closed */
+static int fwd_if2net(struct vdeiface *iface, char *scratch) {
+	struct fwqueue *q = &iface->queue[IF2NET];
+	int batch;
+	if (iface->tpring) {
+		fwd_if2net_tpacket(iface);
+		fwd_if2net_flush(iface);
+		return 0;
+	}
+	for (batch = 0; batch < FWD_BUDGET; batch++) {
+		char *frame = fwqueue_tail(q, scratch);
+		ssize_t n = read(iface->tapfd, frame, q->bufsize);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+			return -1;
+		if (fwqueue_push(q, frame, n) < 0)
+			FWSTATS_ADD(iface->stats, tx_overflows, 1);
+	}
+	FWSTATS_BATCH(iface->stats, tx, batch);
+	fwd_if2net_flush(iface);
+	return 0;
+}
+
+/* receive frames from the network */
+static void fwd_net2if(struct vdeiface *iface, char *scratch) {
+	struct fwqueue *q = &iface->queue[NET2IF];
+	int batch;
+	if (iface->ringlink)
+		ringlink_ack(iface->ringlink, iface->ringside);
+	for (batch = 0; batch < FWD_BUDGET; batch++) {
+		/* tpacket backend: receive in the tx ring when there is no backlog */
+		struct tpacket3_hdr *hdr = (iface->tpring && q->count == 0) ?
+			tpring_txframe(iface->tpring) : NULL;
+		char *frame = hdr ? tpring_txdata(hdr) : fwqueue_tail(q, scratch);
+		ssize_t n;
+		if (iface->ringlink)
+			n = ringlink_recv(iface->ringlink, iface->ringside, frame, q->bufsize);
+		else
+			n = vde_recv(iface->vdeconn, frame, q->bufsize, 0);
+		if (n <= 0)
+			break;
+		if (n < ETH_HEADER_SIZE)
+			FWSTATS_ADD(iface->stats, rx_drops, 1);
+		else if (hdr) {
+			tpring_txcommit(iface->tpring, hdr, n);
+			FWSTATS_ACCOUNT(iface->stats, rx, n, n);
+		} else if (fwqueue_push(q, frame, n) < 0)
+			FWSTATS_ADD(iface->stats, rx_overflows, 1);
+	}
+	/* the ring is not empty: wake up again (the notification has been cleared) */
+	if (iface->ringlink && batch == FWD_BUDGET)
+		eventfd_write(iface->ringlink->efd[iface->ringside], 1);
+	FWSTATS_BATCH(iface->stats, rx, batch);
+	fwd_net2if_flush(iface);
+}
+
+/* allocate the queues (and map the rings of the tpacket backend),
+ * the interface is opened by the caller */
+static int fwd_ifopen(struct vdeiface *iface, struct vdeopts *opts, size_t bufsize) {
+	if (iface->ringlink)
+		iface->netfd = iface->ringlink->efd[iface->ringside];
+	else {
+		iface->netfd = vde_datafd(iface->vdeconn);
+		fcntl(iface->netfd, F_SETFL, fcntl(iface->netfd, F_GETFL) | O_NONBLOCK);
+	}
+	if (fwqueue_init(&iface->queue[IF2NET], opts->qlen, opts->headdrop, bufsize) < 0)
+		goto err_if2net;
+	if (fwqueue_init(&iface->queue[NET2IF], opts->qlen, opts->headdrop, bufsize) < 0)
+		goto err_net2if;
+	if (opts->tpacket && (iface->tpring = tpring_new(iface->tapfd, bufsize)) == NULL)
+		goto err_tpring;
+	return 0;
+err_tpring:
+	fwqueue_fini(&iface->queue[NET2IF]);
+err_net2if:
+	fwqueue_fini(&iface->queue[IF2NET]);
+err_if2net:
+	iface->netfd = -1;
+	return -1;
+}
+
+static void fwd_ifclose(struct vdeiface *iface) {
+	if (iface->tpring)
+		tpring_free(iface->tpring);
+	iface->tpring = NULL;
+	if (iface->tapfd >= 0)
+		close(iface->tapfd);
+	iface->netfd = iface->tapfd = -1;
+}
+
+/* poll events: wait for POLLOUT when a queue is not empty.
+ * ring links notify free slots on the same eventfd used for incoming frames */
+static void fwd_pollevents(struct vdeiface *iface, struct pollfd *netpfd, struct pollfd *tappfd) {
+	netpfd->fd = iface->netfd;
+	tappfd->fd = iface->tapfd;
+	netpfd->events = POLLIN;
+	if (iface->queue[IF2NET].count > 0 && iface->ringlink == NULL)
+		netpfd->events |= POLLOUT;
+	tappfd->events = POLLIN;
+	if (iface->queue[NET2IF].count > 0)
+		tappfd->events |= POLLOUT;
+	netpfd->revents = tappfd->revents = 0;
+}
+
+static void fwd_pollin(struct vdeiface *iface, struct pollfd *netpfd, struct pollfd *tappfd, char *scratch) {
+	if (iface->tapfd < 0)
+		return;
+	if ((netpfd->revents & POLLTERM) || (tappfd->revents & POLLTERM)) {
+		fwd_ifclose(iface);
+		return;
+	}
+	if (tappfd->revents & POLLOUT)
+		fwd_net2if_flush(iface);
+	if ((netpfd->revents & POLLOUT) || (iface->ringlink && (netpfd->revents & POLLIN)))
+		fwd_if2net_flush(iface);
+	if ((tappfd->revents & POLLIN) && fwd_if2net(iface, scratch) < 0) {
+		fwd_ifclose(iface);
+		return;
+	}
+	if (netpfd->revents & POLLIN)
+		fwd_net2if(iface, scratch);
+}
+
 static int childFunc(void *arg)
 {
 	struct vdestack *stack = arg;
 	int noif = stack->noif;
 	struct pollfd pfd[noif * 2 + 1];
+	char buf[stack->bufsize];
+	struct vdereply reply;
 	int i;
 	ssize_t unused;
 	for (i = 0; i < noif; i++) {
-		pfd[i].fd = vde_datafd(stack->iface[i].vdeconn);
-		pfd[i + noif].fd = open_tap(stack->iface[i].ifname);
-		pfd[i].events = pfd[i + noif].events = POLLIN;
-		pfd[i].revents = pfd[i + noif].revents = 0;
-	}
-	pfd[noif * 2].fd = stack->cmdpipe[DAEMONSIDE];
-	pfd[noif * 2].events = POLLIN;
-	pfd[noif * 2].revents = 0;
-	while (poll(pfd, noif * 2 + 1, POLLING_TIMEOUT) >= 0) {
-		char buf[VDE_ETHBUFSIZE];
-		size_t n;
-		// printf("poll in %d %d %d\n",pfd[0].revents,pfd[1].revents,pfd[2].revents);
+		if ((stack->iface[i].tapfd = open_iface(stack->iface[i].ifname, i, &stack->opts)) < 0 ||
+				fwd_ifopen(&stack->iface[i], &stack->opts, stack->bufsize) < 0)
+			break;
+	}
+	/* the first reply on cmdpipe is the outcome of the stack setup */
+	if (i < noif)
+		reply.rval = -1;
+	else
+		reply.rval = vde_applyopts(stack);
+	reply.err = errno;
+	if (write(stack->cmdpipe[DAEMONSIDE], &reply, sizeof(reply)) < 0 || reply.rval < 0)
+		goto terminate;
+	for (;;) {
+		for (i = 0; i < noif; i++)
+			fwd_pollevents(&stack->iface[i], &pfd[i], &pfd[i + noif]);
+		pfd[noif * 2].fd = stack->cmdpipe[DAEMONSIDE];
+		pfd[noif * 2].events = POLLIN;
+		pfd[noif * 2].revents = 0;
+		if (poll(pfd, noif * 2 + 1, POLLING_TIMEOUT) < 0)
+			break;
 		if (kill(stack->parentpid, 0) < 0)
 			break;
 		if (pfd[noif * 2].revents & POLLIN) {
 			struct vdecmd cmd;
-			struct vdereply reply;
-			if ((n = read(stack->cmdpipe[DAEMONSIDE], &cmd, sizeof(cmd))) > 0) {
-				reply.rval = socket(cmd.domain, cmd.type, cmd.protocol);
+			if (read(stack->cmdpipe[DAEMONSIDE], &cmd, sizeof(cmd)) > 0) {
+				reply.rval = vde_newsocket(&cmd, stack->opts.rcvbuf, stack->opts.sndbuf);
 				reply.err = errno;
 				unused = write(stack->cmdpipe[DAEMONSIDE], &reply, sizeof(reply));
 			} else
 				break;
 		}
-		for (i = 0; i < noif; i++) {
-			if (pfd[i + noif].revents & POLLIN) {
-				n = read(pfd[i + noif].fd, buf, VDE_ETHBUFSIZE);
-				if (n > 0)
-					vde_send(stack->iface[i].vdeconn, buf, n, 0);
-				else {
-					close(pfd[i + noif].fd);
-					pfd[i].fd = pfd[i + noif].fd = -1;
-				}
-			}
-			if (pfd[i].revents & POLLIN) {
-				n = vde_recv(stack->iface[i].vdeconn, buf, VDE_ETHBUFSIZE, 0);
-				if (n <= 0) break;
-				if (n >= ETH_HEADER_SIZE)
-					unused = write(pfd[i + noif].fd, buf, n);
-				else if (n <= 0)
-					pfd[i].fd = pfd[i + noif].fd = -1;
-			}
-			if ((pfd[i].revents & POLLTERM) ||
-					(pfd[i + noif].revents & POLLTERM))	{
-				close(pfd[i + noif].fd);
-				pfd[i].fd = pfd[i + noif].fd = -1;
-			}
-		}
+		for (i = 0; i < noif; i++)
+			fwd_pollin(&stack->iface[i], &pfd[i], &pfd[i + noif], buf);
 		(void) unused;
-		//printf("poll out\n");
 	}
+terminate:
+	for (i = 0; i < noif; i++)
+		fwd_ifclose(&stack->iface[i]);
+	close(stack->cmdpipe[DAEMONSIDE]);
+	_exit(EXIT_SUCCESS);
+}
+
+/* shared forwarder: the broker process runs in its own user namespace,
+ * it creates a network namespace for each stack and enters it (setns)
+ * to create the sockets. The fd table is shared with the application */
+static size_t broker_newns(struct brokercmd *cmd, size_t len, struct brokerreply *reply) {
+	size_t optlen = strnlen(cmd->data, len - sizeof(*cmd)) + 1;
+	int noif = cmd->noif;
+	struct vdestack *stack;
+	int i;
+	reply->rval = -1;
+	if (noif < 0 || sizeof(*cmd) + optlen + noif * IFNAMSIZ > len ||
+			sizeof(*reply) + noif * sizeof(reply->fd[0]) > BROKER_MSGSIZE)
+		return reply->err = EINVAL, sizeof(*reply);
+	if ((stack = calloc(1, sizeof(*stack) + noif * sizeof(stack->iface[0]))) == NULL)
+		return reply->err = ENOMEM, sizeof(*reply);
+	stack->noif = noif;
 	for (i = 0; i < noif; i++) {
-		if (pfd[i + noif].fd >= 0)
-			close(pfd[i + noif].fd);
+		snprintf(stack->iface[i].ifname, IFNAMSIZ, "%.*s", IFNAMSIZ - 1,
+				cmd->data + optlen + i * IFNAMSIZ);
+		stack->iface[i].tapfd = -1;
 	}
-	close(stack->cmdpipe[DAEMONSIDE]);
+	if (vde_parseopts(cmd->data, &stack->opts) < 0)
+		goto err;
+	if (unshare(CLONE_NEWNET) < 0)
+		goto err;
+	if ((reply->rval = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC)) < 0)
+		goto err;
+	for (i = 0; i < noif; i++) {
+		if ((stack->iface[i].tapfd = reply->fd[i] =
+					open_iface(stack->iface[i].ifname, i, &stack->opts)) < 0)
+			goto err;
+	}
+	if (vde_applyopts(stack) < 0)
+		goto err;
+	reply->err = 0;
+	reply->rcvbuf = stack->opts.rcvbuf;
+	reply->sndbuf = stack->opts.sndbuf;
+	free(stack->opts.optbuf);
+	free(stack);
+	return sizeof(*reply) + noif * sizeof(reply->fd[0]);
+err:
+	reply->err = errno;
+	for (i = 0; i < noif; i++) {
+		if (stack->iface[i].tapfd >= 0)
+			close(stack->iface[i].tapfd);
+	}
+	if (reply->rval >= 0)
+		close(reply->rval);
+	reply->rval = -1;
+	free(stack->opts.optbuf);
+	free(stack);
+	return sizeof(*reply);
+}
+
+static size_t broker_socket(struct brokercmd *cmd, struct brokerreply *reply) {
+	if (setns(cmd->nsfd, CLONE_NEWNET) < 0)
+		reply->rval = -1;
+	else
+		reply->rval = vde_newsocket(&cmd->socket, cmd->rcvbuf, cmd->sndbuf);
+	reply->err = errno;
+	return sizeof(*reply);
+}
+
+static int brokerFunc(void *arg) {
+	struct vdebroker *b = arg;
+	char cmdbuf[BROKER_MSGSIZE] __attribute__((aligned(sizeof(int))));
+	char replybuf[BROKER_MSGSIZE] __attribute__((aligned(sizeof(int))));
+	struct brokercmd *cmd = (void *) cmdbuf;
+	struct brokerreply *reply = (void *) replybuf;
+	struct pollfd pfd = {b->cmdpipe[DAEMONSIDE], POLLIN, 0};
+	/* the broker returns to its own namespace after each command */
+	int homens = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	memset(reply, 0, sizeof(*reply));
+	reply->rval = homens;
+	reply->err = errno;
+	if (write(b->cmdpipe[DAEMONSIDE], reply, sizeof(*reply)) < 0 || homens < 0)
+		goto terminate;
+	for (;;) {
+		ssize_t n;
+		size_t replylen;
+		if (poll(&pfd, 1, POLLING_TIMEOUT) < 0)
+			break;
+		if (kill(b->parentpid, 0) < 0)
+			break;
+		if ((pfd.revents & POLLIN) == 0)
+			continue;
+		if ((n = read(b->cmdpipe[DAEMONSIDE], cmdbuf, BROKER_MSGSIZE)) < (ssize_t) sizeof(*cmd))
+			break;
+		memset(reply, 0, sizeof(*reply));
+		if (cmd->cmd == BROKER_NEWNS)
+			replylen = broker_newns(cmd, n, reply);
+		else
+			replylen = broker_socket(cmd, reply);
+		setns(homens, CLONE_NEWNET);
+		if (write(b->cmdpipe[DAEMONSIDE], reply, replylen) < 0)
+			break;
+	}
+terminate:
+	if (homens >= 0)
+		close(homens);
+	close(b->cmdpipe[DAEMONSIDE]);
 	_exit(EXIT_SUCCESS);
 }
 
+/* update the epoll registration of the fds of an interface:
+ * add new fds, remove closed fds, set POLLOUT as required */
+static void fwd_epollupdate(int epfd, struct vdeiface *iface) {
+	struct pollfd pfd[2];
+	int i;
+	fwd_pollevents(iface, &pfd[FW_NETFD], &pfd[FW_TAPFD]);
+	for (i = 0; i < 2; i++) {
+		struct fwepoll *e = &iface->epoll[i];
+		struct epoll_event ev = {.events = pfd[i].events, .data.ptr = e};
+		if (pfd[i].fd != e->fd) {
+			if (e->fd >= 0)
+				epoll_ctl(epfd, EPOLL_CTL_DEL, e->fd, NULL);
+			e->fd = pfd[i].fd;
+			if (e->fd >= 0)
+				epoll_ctl(epfd, EPOLL_CTL_ADD, e->fd, &ev);
+		} else if (e->fd >= 0 && e->events != (uint32_t) pfd[i].events)
+			epoll_ctl(epfd, EPOLL_CTL_MOD, e->fd, &ev);
+		e->events = pfd[i].events;
+	}
+}
+
+static void *fwworker(void *arg) {
+	struct fwworker *w = arg;
+	struct epoll_event ev[FWD_EVENTS];
+	for (;;) {
+		unsigned int gen;
+		int i, n;
+		pthread_mutex_lock(&w->mutex);
+		gen = w->gen;
+		pthread_mutex_unlock(&w->mutex);
+		n = epoll_wait(w->epfd, ev, FWD_EVENTS, -1);
+		if (n < 0 && errno != EINTR)
+			break;
+		pthread_mutex_lock(&w->mutex);
+		if (w->terminate) {
+			pthread_mutex_unlock(&w->mutex);
+			break;
+		}
+		/* the events of stacks deleted in the meanwhile must be discarded:
+			 epoll is level triggered, the others will be notified again */
+		for (i = 0; i < n && gen == w->gen; i++) {
+			struct fwepoll *e = ev[i].data.ptr;
+			struct pollfd pfd[2] = {{.fd = -1}, {.fd = -1}};
+			if (e == NULL)
+				continue;
+			pfd[e - e->iface->epoll].revents = ev[i].events;
+			fwd_pollin(e->iface, &pfd[FW_NETFD], &pfd[FW_TAPFD], w->scratch);
+			fwd_epollupdate(w->epfd, e->iface);
+		}
+		pthread_mutex_unlock(&w->mutex);
+	}
+	return NULL;
+}
+
+static int fwworker_start(struct fwworker *w) {
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+	w->terminate = 0;
+	w->gen = 0;
+	w->nstacks = 0;
+	if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		goto err_epfd;
+	if ((w->efd = eventfd(0, EFD_CLOEXEC)) < 0)
+		goto err_efd;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->efd, &ev) < 0)
+		goto err_mutex;
+	if (pthread_mutex_init(&w->mutex, NULL) != 0)
+		goto err_mutex;
+	if ((errno = pthread_create(&w->thread, NULL, fwworker, w)) != 0)
+		goto err_thread;
+	return 0;
+err_thread:
+	pthread_mutex_destroy(&w->mutex);
+err_mutex:
+	close(w->efd);
+err_efd:
+	close(w->epfd);
+err_epfd:
+	return -1;
+}
+
+static void fwworker_stop(struct fwworker *w) {
+	pthread_mutex_lock(&w->mutex);
+	w->terminate = 1;
+	pthread_mutex_unlock(&w->mutex);
+	eventfd_write(w->efd, 1);
+	pthread_join(w->thread, NULL);
+	pthread_mutex_destroy(&w->mutex);
+	close(w->efd);
+	close(w->epfd);
+}
+
+/* start the broker and the worker threads (broker.mutex locked) */
+static int broker_start(struct vdeopts *opts) {
+	struct brokerreply reply;
+	int i;
+	broker.child_stack =
+		mmap(0, CHILD_STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (broker.child_stack == MAP_FAILED)
+		goto err_child_stack;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, broker.cmdpipe) < 0)
+		goto err_cmdpipe;
+	broker.parentpid = getpid();
+	broker.pid = clone(brokerFunc, broker.child_stack + CHILD_STACK_SIZE,
+			CLONE_FILES | CLONE_NEWUSER | CLONE_NEWNET | SIGCHLD, &broker);
+	if (broker.pid == -1) {
+		close(broker.cmdpipe[DAEMONSIDE]);
+		goto err_clone;
+	}
+	if (read(broker.cmdpipe[APPSIDE], &reply, sizeof(reply)) != sizeof(reply))
+		goto err_broker;
+	if (reply.rval < 0) {
+		errno = reply.err;
+		goto err_broker;
+	}
+	broker.nworkers = opts->fwthreads;
+	if ((broker.worker = calloc(broker.nworkers, sizeof(broker.worker[0]))) == NULL)
+		goto err_broker;
+	for (i = 0; i < broker.nworkers; i++) {
+		if (fwworker_start(&broker.worker[i]) < 0)
+			goto err_worker;
+	}
+	return 0;
+err_worker:
+	while (--i >= 0)
+		fwworker_stop(&broker.worker[i]);
+	free(broker.worker);
+err_broker:
+	/* the broker closes cmdpipe[DAEMONSIDE] (the file table is shared) */
+	close(broker.cmdpipe[APPSIDE]);
+	waitpid(broker.pid, NULL, 0);
+err_clone:
+err_cmdpipe:
+	munmap(broker.child_stack, CHILD_STACK_SIZE);
+err_child_stack:
+	return -1;
+}
+
+static void broker_stop(void) {
+	int i;
+	for (i = 0; i < broker.nworkers; i++)
+		fwworker_stop(&broker.worker[i]);
+	free(broker.worker);
+	close(broker.cmdpipe[APPSIDE]);
+	waitpid(broker.pid, NULL, 0);
+	munmap(broker.child_stack, CHILD_STACK_SIZE);
+}
+
+/* send a command to the broker and wait for the reply (broker.mutex locked) */
+static ssize_t broker_cmd(void *buf, size_t len) {
+	ssize_t n;
+	if (send(broker.cmdpipe[APPSIDE], buf, len, MSG_NOSIGNAL) < 0)
+		return -1;
+	n = recv(broker.cmdpipe[APPSIDE], buf, BROKER_MSGSIZE, 0);
+	if (n < (ssize_t) sizeof(struct brokerreply))
+		return errno = EIO, -1;
+	return n;
+}
+
+/* add a stack to the shared forwarder */
+static int broker_addstack(struct vdestack *stack, const char *options) {
+	char buf[BROKER_MSGSIZE] __attribute__((aligned(sizeof(int))));
+	struct brokercmd *cmd = (void *) buf;
+	struct brokerreply *reply = (void *) buf;
+	size_t optlen = strlen(options) + 1;
+	size_t len = sizeof(*cmd) + optlen + stack->noif * IFNAMSIZ;
+	struct fwworker *w;
+	int i;
+	if (len > BROKER_MSGSIZE)
+		return errno = EINVAL, -1;
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->cmd = BROKER_NEWNS;
+	cmd->noif = stack->noif;
+	memcpy(cmd->data, options, optlen);
+	for (i = 0; i < stack->noif; i++)
+		memcpy(cmd->data + optlen + i * IFNAMSIZ, stack->iface[i].ifname, IFNAMSIZ);
+	pthread_mutex_lock(&broker.mutex);
+	if (broker.refcount == 0 && broker_start(&stack->opts) < 0)
+		goto err_start;
+	broker.refcount++;
+	if (broker_cmd(buf, len) < 0)
+		goto err_newns;
+	if (reply->rval < 0) {
+		errno = reply->err;
+		goto err_newns;
+	}
+	stack->nsfd = reply->rval;
+	stack->opts.rcvbuf = reply->rcvbuf;
+	stack->opts.sndbuf = reply->sndbuf;
+	for (i = 0; i < stack->noif; i++)
+		stack->iface[i].tapfd = reply->fd[i];
+	for (i = 0; i < stack->noif; i++) {
+		if (fwd_ifopen(&stack->iface[i], &stack->opts, stack->bufsize) < 0)
+			goto err_ifopen;
+	}
+	/* the least loaded worker */
+	for (w = &broker.worker[0], i = 1; i < broker.nworkers; i++) {
+		if (broker.worker[i].nstacks < w->nstacks)
+			w = &broker.worker[i];
+	}
+	w->nstacks++;
+	stack->worker = w;
+	pthread_mutex_lock(&w->mutex);
+	for (i = 0; i < stack->noif; i++)
+		fwd_epollupdate(w->epfd, &stack->iface[i]);
+	pthread_mutex_unlock(&w->mutex);
+	pthread_mutex_unlock(&broker.mutex);
+	return 0;
+err_ifopen:
+	while (--i >= 0) {
+		fwqueue_fini(&stack->iface[i].queue[IF2NET]);
+		fwqueue_fini(&stack->iface[i].queue[NET2IF]);
+		if (stack->iface[i].tpring)
+			tpring_free(stack->iface[i].tpring);
+	}
+	for (i = 0; i < stack->noif; i++)
+		close(stack->iface[i].tapfd);
+	close(stack->nsfd);
+err_newns:
+	if (--broker.refcount == 0)
+		broker_stop();
+err_start:
+	pthread_mutex_unlock(&broker.mutex);
+	return -1;
+}
+
+static void broker_delstack(struct vdestack *stack) {
+	struct fwworker *w = stack->worker;
+	int i, j;
+	pthread_mutex_lock(&w->mutex);
+	for (i = 0; i < stack->noif; i++) {
+		for (j = 0; j < 2; j++) {
+			if (stack->iface[i].epoll[j].fd >= 0)
+				epoll_ctl(w->epfd, EPOLL_CTL_DEL, stack->iface[i].epoll[j].fd, NULL);
+		}
+	}
+	w->gen++;
+	pthread_mutex_unlock(&w->mutex);
+	for (i = 0; i < stack->noif; i++) {
+		fwd_ifclose(&stack->iface[i]);
+		fwqueue_fini(&stack->iface[i].queue[IF2NET]);
+		fwqueue_fini(&stack->iface[i].queue[NET2IF]);
+	}
+	close(stack->nsfd);
+	pthread_mutex_lock(&broker.mutex);
+	w->nstacks--;
+	if (--broker.refcount == 0)
+		broker_stop();
+	pthread_mutex_unlock(&broker.mutex);
+}
+
+static int broker_msocket(struct vdestack *stack, int domain, int type, int protocol) {
+	char buf[BROKER_MSGSIZE] __attribute__((aligned(sizeof(int))));
+	struct brokercmd *cmd = (void *) buf;
+	struct brokerreply *reply = (void *) buf;
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->cmd = BROKER_SOCKET;
+	cmd->nsfd = stack->nsfd;
+	cmd->socket = (struct vdecmd) {domain, type, protocol};
+	cmd->rcvbuf = stack->opts.rcvbuf;
+	cmd->sndbuf = stack->opts.sndbuf;
+	pthread_mutex_lock(&broker.mutex);
+	if (broker_cmd(buf, sizeof(*cmd)) < 0) {
+		pthread_mutex_unlock(&broker.mutex);
+		return -1;
+	}
+	pthread_mutex_unlock(&broker.mutex);
+	if (reply->rval < 0)
+		errno = reply->err;
+	return reply->rval;
+}
+
 static int countif(const char **v) {
 	int count;
 	if (v == NULL) return 0;
@@ -160,26 +1529,77 @@ static int countif(const char **v) {
 	return count;
 }
 
+/* start the forwarder of a stack (forwarder=private) */
+static int vde_startfwd(struct vdestack *stack) {
+	struct vdereply reply;
+	stack->child_stack =
+		mmap(0, CHILD_STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (stack->child_stack == MAP_FAILED)
+		goto err_child_stack;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, stack->cmdpipe) < 0)
+		goto err_cmdpipe;
+	stack->parentpid = getpid();
+	stack->pid = clone(childFunc, stack->child_stack + CHILD_STACK_SIZE,
+			CLONE_FILES | CLONE_NEWUSER | CLONE_NEWNET | SIGCHLD, stack);
+	if (stack->pid == -1) {
+		close(stack->cmdpipe[DAEMONSIDE]);
+		goto err_child;
+	}
+	if (read(stack->cmdpipe[APPSIDE], &reply, sizeof(reply)) != sizeof(reply))
+		goto err_reply;
+	if (reply.rval < 0) {
+		errno = reply.err;
+		goto err_reply;
+	}
+	return 0;
+err_reply:
+	/* the forwarder closes cmdpipe[DAEMONSIDE] (the file table is shared) */
+	waitpid(stack->pid, NULL, 0);
+err_child:
+	close(stack->cmdpipe[APPSIDE]);
+err_cmdpipe:
+	munmap(stack->child_stack, CHILD_STACK_SIZE);
+err_child_stack:
+	return -1;
+}
+
+static void vde_stopfwd(struct vdestack *stack) {
+	close(stack->cmdpipe[APPSIDE]);
+	waitpid(stack->pid, NULL, 0);
+	munmap(stack->child_stack, CHILD_STACK_SIZE);
+}
+
 struct vdestack *vde_addstack(const char *vnlv[], const char *options) {
-	(void) options;
 	int i;
 	int noif = countif(vnlv);
 	struct vdestack *stack = malloc(sizeof(*stack) + sizeof(stack->iface[0]) * noif);
 	if (stack) {
 		//printf("noif %d\n",noif);
 		stack->noif = noif;
+		stack->pid = -1;
+		stack->nsfd = -1;
+		if (vde_parseopts(options, &stack->opts) < 0)
+			goto err_opts;
+		/* the forwarder buffer must fit a frame of the largest MTU */
+		stack->bufsize = VDE_ETHBUFSIZE;
+		if (stack->opts.mtu + ETH_HEADER_SIZE + VLAN_TAG_SIZE > stack->bufsize)
+			stack->bufsize = stack->opts.mtu + ETH_HEADER_SIZE + VLAN_TAG_SIZE;
 		if (pthread_mutex_init(&stack->mutex, NULL) != 0)
 			goto err_mutex;
-		stack->child_stack =
-			mmap(0, CHILD_STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-		if (stack->child_stack == NULL)
-			goto err_child_stack;
-
-		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, stack->cmdpipe) < 0)
-			goto err_cmdpipe;
+		stack->stats = mmap(0, FWSTATS_SIZE(noif), PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (stack->stats == MAP_FAILED)
+			goto err_stats;
 
-		for (i = 0; i < noif; i++)
+		for (i = 0; i < noif; i++) {
 			stack->iface[i].vdeconn = NULL;
+			stack->iface[i].ringlink = NULL;
+			stack->iface[i].stats = &stack->stats[i];
+			stack->iface[i].netfd = stack->iface[i].tapfd = -1;
+			stack->iface[i].tpring = NULL;
+			stack->iface[i].epoll[FW_NETFD] = stack->iface[i].epoll[FW_TAPFD] =
+				(struct fwepoll) {&stack->iface[i], -1, 0};
+		}
 
 		for (i = 0; i < noif; i++) {
 			const char *ifvnl = vnlv[i];
@@ -193,30 +1613,31 @@ struct vdestack *vde_addstack(const char *vnlv[], const char *options) {
 			} else
 				snprintf(stack->iface[i].ifname, IFNAMSIZ, "vde%d", i);
 			//printf("open %s %s\n", stack->iface[i].ifname,  ifvnl);
-			if ((stack->iface[i].vdeconn = vde_open((char *) ifvnl, "ioth_vdestack", NULL)) == NULL)
+			if (strncmp(ifvnl, RING_VNL_PREFIX, RING_VNL_PREFIXLEN) == 0) {
+				if ((stack->iface[i].ringlink = ringlink_open(ifvnl + RING_VNL_PREFIXLEN,
+								&stack->iface[i].ringside)) == NULL)
+					goto err_vdenet;
+			} else if ((stack->iface[i].vdeconn = vde_open((char *) ifvnl, "ioth_vdestack", NULL)) == NULL)
 				goto err_vdenet;
 		}
 
-		stack->parentpid = getpid();
-		stack->pid = clone(childFunc, stack->child_stack + CHILD_STACK_SIZE,
-				CLONE_FILES | CLONE_NEWUSER | CLONE_NEWNET | SIGCHLD, stack);
-		if (stack->pid == -1)
-			goto err_child;
+		if ((stack->opts.shared ? broker_addstack(stack, options) : vde_startfwd(stack)) < 0)
+			goto err_vdenet;
 	}
 	return stack;
-err_child:
 err_vdenet:
 	for (i = 0; i < noif; i++) {
 		if (stack->iface[i].vdeconn)
 			vde_close(stack->iface[i].vdeconn);
+		if (stack->iface[i].ringlink)
+			ringlink_close(stack->iface[i].ringlink, stack->iface[i].ringside);
 	}
-	close(stack->cmdpipe[APPSIDE]);
-	close(stack->cmdpipe[DAEMONSIDE]);
-err_cmdpipe:
-	munmap(stack->child_stack, CHILD_STACK_SIZE);
-err_child_stack:
+	munmap(stack->stats, FWSTATS_SIZE(noif));
+err_stats:
 	pthread_mutex_destroy(&stack->mutex);
 err_mutex:
+	free(stack->opts.optbuf);
+err_opts:
 	free(stack);
 	return NULL;
 }
@@ -224,21 +1645,39 @@ err_mutex:
 void vde_delstack(struct vdestack *stack) {
 	int i;
 	int noif = stack->noif;
+	if (stack->opts.shared)
+		broker_delstack(stack);
 	for (i = 0; i < noif; i++) {
 		if (stack->iface[i].vdeconn)
 			vde_close(stack->iface[i].vdeconn);
 	}
-	close(stack->cmdpipe[APPSIDE]);
-	waitpid(stack->pid, NULL, 0);
-	munmap(stack->child_stack, CHILD_STACK_SIZE);
+	if (!stack->opts.shared)
+		vde_stopfwd(stack);
+	/* ring links can be closed only when the forwarder has terminated */
+	for (i = 0; i < noif; i++) {
+		if (stack->iface[i].ringlink)
+			ringlink_close(stack->iface[i].ringlink, stack->iface[i].ringside);
+	}
+	munmap(stack->stats, FWSTATS_SIZE(noif));
 	pthread_mutex_destroy(&stack->mutex);
+	free(stack->opts.optbuf);
 	free(stack);
 }
 
+int vde_fwstats(struct vdestack *stack, struct ioth_fwstats *stats, int nstats) {
+	if (nstats > stack->noif)
+		nstats = stack->noif;
+	if (nstats > 0)
+		memcpy(stats, stack->stats, nstats * sizeof(*stats));
+	return stack->noif;
+}
+
 int vde_msocket(struct vdestack *stack, int domain, int type, int protocol) {
 	struct vdecmd cmd = {domain, type, protocol};
 	struct vdereply reply;
 
+	if (stack->opts.shared)
+		return broker_msocket(stack, domain, type, protocol);
 	pthread_mutex_lock(&stack->mutex);
 	if (write(stack->cmdpipe[APPSIDE],  &cmd, sizeof(cmd)) < 0 ||
 			read(stack->cmdpipe[APPSIDE], &reply, sizeof(reply)) < 0)
@@ -259,28 +1698,6 @@ void *ioth_vdestack_newstack(const char *vnlv[], const char *options,
 		struct ioth_functions *ioth_f) {
 	struct vdestack *stackdata = vde_addstack(vnlv, options);
 	getstackdata = ioth_f->getstackdata;
-	ioth_f->close = close;
-	ioth_f->bind = bind;
-	ioth_f->connect = connect;
-	ioth_f->listen = listen;
-	ioth_f->accept = accept;
-	ioth_f->getsockname = getsockname;
-	ioth_f->getpeername = getpeername;
-	ioth_f->setsockopt = setsockopt;
-	ioth_f->getsockopt = getsockopt;
-	ioth_f->shutdown = shutdown;
-	ioth_f->ioctl = ioctl;
-	ioth_f->fcntl = fcntl;
-	ioth_f->read = read;
-	ioth_f->readv = readv;
-	ioth_f->recv = recv;
-	ioth_f->recvfrom = recvfrom;
-	ioth_f->recvmsg = recvmsg;
-	ioth_f->write = write;
-	ioth_f->writev = writev;
-	ioth_f->send = send;
-	ioth_f->sendto = sendto;
-	ioth_f->sendmsg = sendmsg;
 	return stackdata;
 }
 
@@ -289,15 +1706,53 @@ int ioth_vdestack_delstack(void *stackdata) {
 	return 0;
 }
 
+int ioth_vdestack_fwstats(void *stackdata, struct ioth_fwstats *stats, int nstats) {
+	return vde_fwstats((struct vdestack *) stackdata, stats, nstats);
+}
+
 int ioth_vdestack_socket(int domain, int type, int protocol) {
 	struct vdestack *stackdata = getstackdata();
 	return vde_msocket(stackdata, domain, type, protocol);
 }
 
-void *ioth_vdestack_n_newstack(const char *vnlv[], const char *options,
-		struct ioth_functions *ioth_f)
-	__attribute__ ((alias ("ioth_vdestack_newstack")));
-int ioth_vdestack_n_delstack(void *stackdata)
-	__attribute__ ((alias ("ioth_vdestack_delstack")));
-int ioth_vdestack_n_socket(int domain, int type, int protocol)
-	__attribute__ ((alias ("ioth_vdestack_socket")));
+#define VDESTACK_LICENSE "SPDX-License-Identifier: LGPL-2.1-or-later"
+#define VDESTACK_CAPS (IOTH_CAP_KERNELFD | IOTH_CAP_THREADSAFE | IOTH_CAP_MULTISTACK)
+IOTH_PLUGIN_NOTE(VDESTACK_LICENSE, VDESTACK_CAPS);
+
+const struct ioth_ops ioth_vdestack_ops = {
+	.version = IOTH_OPS_VERSION,
+	.fsize = sizeof(struct ioth_functions),
+	.caps = VDESTACK_CAPS,
+	.license = VDESTACK_LICENSE,
+	.f = {
+		.newstack = ioth_vdestack_newstack,
+		.delstack = ioth_vdestack_delstack,
+		.fwstats = ioth_vdestack_fwstats,
+		.socket = ioth_vdestack_socket,
+		.close = close,
+		.bind = bind,
+		.connect = connect,
+		.listen = listen,
+		.accept = accept,
+		.getsockname = getsockname,
+		.getpeername = getpeername,
+		.setsockopt = setsockopt,
+		.getsockopt = getsockopt,
+		.shutdown = shutdown,
+		.ioctl = ioctl,
+		.fcntl = fcntl,
+		.read = read,
+		.readv = readv,
+		.recv = recv,
+		.recvfrom = recvfrom,
+		.recvmsg = recvmsg,
+		.write = write,
+		.writev = writev,
+		.send = send,
+		.sendto = sendto,
+		.sendmsg = sendmsg,
+	},
+};
+
+extern const struct ioth_ops ioth_vdestack_n_ops
+	__attribute__ ((alias ("ioth_vdestack_ops")));
@@ -0,0 +1,100 @@
+/*
+ *   libioth: choose your networking library as a plugin at run time.
+ *   test program: hash based address derivation benchmark
+ *
+ *   Copyright (C) 2021  Renzo Davoli <renzo@cs.unibo.it>
+ *                       VirtualSquare team.
+ *
+ * this test program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* usage: iothaddr_bench [naddr]
+ * compute naddr (default 100000) hash based addresses, one at a time and in bulk:
+ * check that the results are the same and print the addresses/sec rates */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include <iothaddr.h>
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *what, size_t n, double t1, double tv, int ok) {
+	printf("%-10s %12.0f addr/s %12.0f addr/s (bulk) x%.1f %s\n", what,
+			n / t1, n / tv, t1 / tv, ok ? "ok" : "MISMATCH");
+}
+
+int main(int argc, char *argv[]) {
+	size_t n = (argc > 1) ? strtoul(argv[1], NULL, 0) : 100000;
+	char **namev = malloc(n * sizeof(*namev));
+	char **passwdv = malloc(n * sizeof(*passwdv));
+	struct in6_addr *addr = calloc(n, sizeof(*addr));
+	struct in6_addr *addrv = calloc(n, sizeof(*addrv));
+	unsigned char (*mac)[6] = calloc(n, sizeof(*mac));
+	unsigned char (*macv)[6] = calloc(n, sizeof(*macv));
+	uint32_t otiptime = iothaddr_otiptime(32, 0);
+	double t0, t1, tv;
+	int fails = 0;
+	int ok;
+	if (!namev || !passwdv || !addr || !addrv || !mac || !macv) {
+		perror("malloc");
+		return 1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		/* names of different lengths, some need more than one md5 block */
+		if (asprintf(&namev[i], "host%zu.%.*s.v2.cs.unibo.it.", i,
+					(int) (i % 97), "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz"
+					"abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz") < 0)
+			return 1;
+		passwdv[i] = (i % 3) ? "secret" : NULL;
+	}
+
+#define BENCH(what, single, bulk, res, resv) do { \
+	t0 = now(); \
+	for (size_t i = 0; i < n; i++) single; \
+	t1 = now() - t0; \
+	t0 = now(); \
+	bulk; \
+	tv = now() - t0; \
+	ok = memcmp(res, resv, n * sizeof(res[0])) == 0; \
+	fails += !ok; \
+	report(what, n, t1, tv, ok); \
+} while (0)
+
+	BENCH("hash", iothaddr_hash(&addr[i], namev[i], passwdv[i], 0),
+			iothaddr_hashv(addrv, (const char **) namev, (const char **) passwdv, 0, n), addr, addrv);
+	BENCH("hash+otip", iothaddr_hash(&addr[i], namev[i], passwdv[i], otiptime),
+			iothaddr_hashv(addrv, (const char **) namev, (const char **) passwdv, otiptime, n), addr, addrv);
+	BENCH("hashmac", iothaddr_hashmac(mac[i], namev[i], NULL),
+			iothaddr_hashmacv(macv, (const char **) namev, NULL, n), mac, macv);
+	memset(addr, 0, n * sizeof(*addr));
+	memset(addrv, 0, n * sizeof(*addrv));
+	BENCH("hasheui64", iothaddr_hasheui64(&addr[i], namev[i], passwdv[i]),
+			iothaddr_hasheui64v(addrv, (const char **) namev, (const char **) passwdv, n), addr, addrv);
+
+	for (size_t i = 0; i < n; i++)
+		free(namev[i]);
+	free(namev); free(passwdv);
+	free(addr); free(addrv);
+	free(mac); free(macv);
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+/*
+ *   libioth: choose your networking library as a plugin at run time.
+ *   test program: known answer tests of the hash functions of iothaddr
+ *
+ *   Copyright (C) 2021  Renzo Davoli <renzo@cs.unibo.it>
+ *                       VirtualSquare team.
+ *
+ * this test program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* usage: iothaddr_kat
+ * check md5 (scalar and multi-buffer), SipHash-2-4 and BLAKE2s against
+ * known answers: RFC 1321 test suite, SipHash paper (Aumasson, Bernstein),
+ * BLAKE2s with 8 byte output (values of the reference implementation).
+ * exit status: 0 all the tests passed, 1 otherwise.
+ * iothaddr.c is included to test its (static) hash functions on binary messages */
+
+#include <stdio.h>
+#include <arpa/inet.h>
+#include "iothaddr.c"
+
+static int failures;
+
+static void hex2bin(const char *hex, uint8_t *bin, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		sscanf(hex + 2 * i, "%2hhx", &bin[i]);
+}
+
+static void check(const char *what, size_t len, const uint8_t *out, const char *expected, size_t outlen) {
+	uint8_t exp[16];
+	hex2bin(expected, exp, outlen);
+	if (memcmp(out, exp, outlen) != 0) {
+		printf("FAIL %s (len %zu): got ", what, len);
+		for (size_t i = 0; i < outlen; i++)
+			printf("%02x", out[i]);
+		printf(" expected %s\n", expected);
+		failures++;
+	}
+}
+
+/* the message split in three parts (as name, passwd, otiptime) */
+static void msg3(struct md5_msg *m, const void *buf, size_t len) {
+	size_t l0 = len / 3, l1 = len / 2 - l0;
+	m->part[0] = buf;
+	m->partlen[0] = l0;
+	m->part[1] = (const uint8_t *) buf + l0;
+	m->partlen[1] = l1;
+	m->part[2] = (const uint8_t *) buf + l0 + l1;
+	m->partlen[2] = len - l0 - l1;
+	m->len = len;
+}
+
+/* RFC 1321 A.5 test suite (two blocks: 62 and 80 bytes) */
+static const char *md5_kat[][2] = {
+	{"", "d41d8cd98f00b204e9800998ecf8427e"},
+	{"a", "0cc175b9c0f1b6a831c399e269772661"},
+	{"abc", "900150983cd24fb0d6963f7d28e17f72"},
+	{"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+	{"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+	{"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+		"d174ab98d277d9f5a5611c2c9f419d9f"},
+	{"12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+		"57edf4a22be3c955ac49da2e2107b67a"},
+};
+#define MD5_NKAT (sizeof(md5_kat) / sizeof(md5_kat[0]))
+
+static void test_md5(void) {
+	struct md5_msg m[MD5_LANES];
+	uint8_t digest[MD5_LANES][16];
+	size_t i;
+	for (i = 0; i < MD5_NKAT; i++) {
+		msg3(&m[i], md5_kat[i][0], strlen(md5_kat[i][0]));
+		md5(&m[i], digest[i]);
+		check("md5", m[i].len, digest[i], md5_kat[i][1], 16);
+	}
+	/* lanes of different lengths, the last one is shorter than the longest */
+	m[MD5_NKAT] = m[2];
+	md5_lanes(m, MD5_NKAT + 1, digest);
+	for (i = 0; i < MD5_NKAT; i++)
+		check("md5_lanes", m[i].len, digest[i], md5_kat[i][1], 16);
+	check("md5_lanes", m[2].len, digest[MD5_NKAT], md5_kat[2][1], 16);
+	/* a single lane */
+	md5_lanes(&m[MD5_NKAT - 1], 1, digest);
+	check("md5_lanes", m[MD5_NKAT - 1].len, digest[0], md5_kat[MD5_NKAT - 1][1], 16);
+}
+
+/* SipHash paper, appendix A: key 00..0f, message 00..0e */
+static void test_siphash(void) {
+	uint8_t key[16], buf[15], out[8];
+	struct md5_msg m;
+	for (int i = 0; i < 16; i++)
+		key[i] = i;
+	for (int i = 0; i < 15; i++)
+		buf[i] = i;
+	msg3(&m, buf, 15);
+	siphash(&m, key, out);
+	check("siphash", m.len, out, "e545be4961ca29a1", 8);
+	msg3(&m, buf, 0);
+	siphash(&m, key, out);
+	check("siphash", m.len, out, "310e0edd47db6f72", 8);
+	msg3(&m, buf, 8);
+	siphash(&m, key, out);
+	check("siphash", m.len, out, "6224939a79f5f593", 8);
+}
+
+/* BLAKE2s, 8 byte output: message 00 01 02 ..., no key, key 00..1f, key 00..0f */
+static const struct {
+	size_t len;
+	const char *out[3];
+} blake2s_kat[] = {
+	{0, {"ef2a8b78dd80da9c", "3a23e83d1d585785", "f09b980f484956ea"}},
+	{64, {"cca16c7e0ba1553d", "8013e78702c80e7b", "ce49064ca817bcbd"}},
+	{65, {"21f7eb3a445c8e92", "322e9aa4f43f1ee0", "03c762ad9f223e6d"}},
+	{128, {"48f021896f099170", "20e22a6ff460af1a", "d1dfc2ef330a319f"}},
+	{200, {"ae22e2be0604f6c2", "876ec26c88fbdd89", "f4ba44cc5909ba65"}},
+};
+
+static void test_blake2s(void) {
+	static const size_t keylen[3] = {0, 32, 16};
+	uint8_t key[32], buf[200], out[8];
+	struct md5_msg m;
+	for (int i = 0; i < 32; i++)
+		key[i] = i;
+	for (int i = 0; i < 200; i++)
+		buf[i] = i;
+	for (size_t i = 0; i < sizeof(blake2s_kat) / sizeof(blake2s_kat[0]); i++) {
+		msg3(&m, buf, blake2s_kat[i].len);
+		for (int k = 0; k < 3; k++) {
+			blake2s(&m, keylen[k] ? key : NULL, keylen[k], out);
+			check(keylen[k] ? "blake2s keyed" : "blake2s", m.len, out, blake2s_kat[i].out[k], 8);
+		}
+	}
+	msg3(&m, "abc", 3);
+	blake2s(&m, NULL, 0, out);
+	check("blake2s", m.len, out, "972e9d2cd6de6402", 8);
+}
+
+/* the public API: the example of iothaddr.h, the trailing dot is ignored */
+static void test_api(void) {
+	const char *namev[] = {"test.v2.cs.unibo.it", "test.v2.cs.unibo.it."};
+	struct in6_addr addr, addrv[2];
+	uint8_t mac[6];
+	inet_pton(AF_INET6, "2000:760::", &addr);
+	addrv[0] = addrv[1] = addr;
+	iothaddr_hash(&addr, namev[0], NULL, 0);
+	check("iothaddr_hash", strlen(namev[0]), addr.s6_addr, "200007600000000068d62fac095a5a2e", 16);
+	iothaddr_hashv(addrv, namev, NULL, 0, 2);
+	for (int i = 0; i < 2; i++)
+		check("iothaddr_hashv", strlen(namev[i]), addrv[i].s6_addr, "200007600000000068d62fac095a5a2e", 16);
+	iothaddr_hashmac(mac, namev[1], NULL);
+	check("iothaddr_hashmac", strlen(namev[1]), mac, "6ad62f5a5a2e", 6);
+}
+
+int main(void) {
+	test_md5();
+	test_siphash();
+	test_blake2s();
+	test_api();
+	if (failures == 0)
+		printf("all the known answer tests passed\n");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+/*
+ *   libioth: choose your networking library as a plugin at run time.
+ *   test program: echo server using the reactor (a few threads for all the connections)
+ *
+ *   Copyright (C) 2020-2022  Renzo Davoli <renzo@cs.unibo.it>
+ *                            VirtualSquare team.
+ *
+ * this test program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* usage: iothreactor_server stack [ vnl vnl ]
+ * as iothtest_server: TCP echo server on 192.168.250.50 port 5000
+ * (the number of loops can be set by the environment variable NLOOPS) */
+
+#define SPDX_LICENSE "SPDX-License-Identifier: GPL-2.0-or-later"
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <ioth.h>
+#include <iothreactor.h>
+
+static void echo(struct iothreactor_conn *conn, void *buf, ssize_t len) {
+	if (len > 0)
+		iothreactor_write(conn, buf, len);
+	else
+		printf("close conn %d tid %d\n", iothreactor_fd(conn), gettid());
+}
+
+static void newconn(struct iothreactor_conn *conn, void *arg) {
+	(void) arg;
+	printf("new conn %d tid %d\n", iothreactor_fd(conn), gettid());
+	iothreactor_read_start(conn, echo);
+}
+
+void server(struct ioth *mystack) {
+	struct sockaddr_in servaddr;
+	struct iothreactor *reactor;
+	char *nloops = getenv("NLOOPS");
+	int fd;
+
+	fd = ioth_msocket(mystack, AF_INET, SOCK_STREAM, 0);
+
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = htons(5000);
+	servaddr.sin_addr.s_addr = 0;
+
+	if (ioth_bind(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+		exit(1);
+
+	ioth_listen (fd, SOMAXCONN);
+
+	reactor = iothreactor_new(nloops ? atoi(nloops) : 0);
+	if (reactor == NULL || iothreactor_listen(reactor, fd, newconn, NULL) < 0) {
+		perror("reactor");
+		exit(1);
+	}
+	iothreactor_run(reactor);
+	iothreactor_free(reactor);
+}
+
+struct ioth *net_setup(const char **args) {
+	struct ioth *mystack;
+	uint8_t ipv4addr[] = {192,168,250,50};
+	uint8_t ipv4gw[] = {192,168,250,1};
+	int ifindex;
+
+	mystack = ioth_newstackv(args[0], args+1);
+	if (mystack != NULL) {
+		ifindex = ioth_if_nametoindex(mystack, "vde0");
+		if (ifindex < 0)
+			perror("nametoindex");
+		else {
+			if (ioth_linksetupdown(mystack, ifindex, 1) < 0)
+				perror("link up");
+			if (ioth_ipaddr_add(mystack, AF_INET, ipv4addr, 24, ifindex) < 0)
+				perror("addr ipv4");
+			if (ioth_iproute_add(mystack, AF_INET, NULL, 0, ipv4gw, 0) < 0)
+				perror("route ipv4");
+		}
+	}
+	return mystack;
+}
+
+int main(int argc, const char *argv[]) {
+	ioth_set_license(SPDX_LICENSE);
+	if (argc < 2) {
+		fprintf(stderr, "Usage:\n\n\t%s stack [ vnl vnl ]\n\n", basename(argv[0]));
+		exit(1);
+	} else {
+		struct ioth *mystack = net_setup(argv+1);
+		if (mystack) {
+			server(mystack);
+			ioth_delstack(mystack);
+		} else
+			perror("net_setup");
+	}
+}